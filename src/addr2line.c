@@ -31,6 +31,7 @@
 #include <ctype.h>
 #include <execinfo.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "addr2line.h"
 #include "rb_tree/red_black_tree.h"
@@ -43,6 +44,10 @@
 
 static rb_red_blk_tree* range_map;
 static rb_red_blk_tree* frame_map;
+static Module* modules;
+static int module_count;
+// addr2line_print is called from both the writer thread and the monitor thread.
+static pthread_mutex_t addr2line_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #if HAVE_PRINTF_STYLE_BFD_ERROR_HANDLER_TYPE
 static void addr2LineErrorHandler(char const* fmt, ...)
@@ -228,7 +233,9 @@ static void framestr_print(void const* f1)
 
 void addr2line_init()
 {
+#ifdef DEBUG
   printf("Entering addr2line_init\n");
+#endif
   range_map = RBTreeCreate(range_compare, range_destroy, (void(*)(void*))addr2line_close, range_print, addr2line_print2);
   FILE* fmaps = fopen("/proc/self/maps", "r");
   assert(fmaps);
@@ -258,14 +265,36 @@ void addr2line_init()
 	continue;
       unsigned long ebegin = 0;
       unsigned long eend = 0;
+      unsigned long eoffset = 0;
       char* digit = line_start - 1;
       while (*++digit != '-') { ebegin <<= 4; ebegin += *digit - (isdigit(*digit) ? '0' : (islower(*digit) ? 'a' : 'A') - 10); }
       while (*++digit != ' ') { eend <<= 4; eend += *digit - (isdigit(*digit) ? '0' : (islower(*digit) ? 'a' : 'A') - 10); }
+      digit = mode + 5;
+      while (*++digit != ' ') { eoffset <<= 4; eoffset += *digit - (isdigit(*digit) ? '0' : (islower(*digit) ? 'a' : 'A') - 10); }
       Range* range = (*memleak_libc_malloc)(sizeof(Range));
       range->begin = (void*)ebegin;
       range->end = (void*)eend;
+#ifdef DEBUG
       range_print(range); printf(" : %s\n", filename);
-      RBTreeInsert(range_map, range, addr2line_init_bfd(filename));
+#endif
+      Addr2Line* addr2line = addr2line_init_bfd(filename);
+      RBTreeInsert(range_map, range, addr2line);
+      // Also keep a plain array of all modules, in the order of /proc/self/maps (which is sorted by address).
+      if ((module_count & (module_count - 1)) == 0)
+      {
+        Module* new_modules = (*memleak_libc_malloc)((module_count ? 2 * module_count : 16) * sizeof(Module));
+        if (module_count)
+          memcpy(new_modules, modules, module_count * sizeof(Module));
+        (*memleak_libc_free)(modules);
+        modules = new_modules;
+      }
+      Module* module = &modules[module_count++];
+      module->begin = range->begin;
+      module->end = range->end;
+      module->offset = eoffset;
+      module->path = (*memleak_libc_malloc)(strlen(filename) + 1);
+      strcpy(module->path, filename);
+      module->addr2line = addr2line;
     }
     if (rlen < sizeof(buf) - 1 - offset)
       break;
@@ -276,6 +305,16 @@ void addr2line_init()
   frame_map = RBTreeCreate(frame_compare, frame_destroy, framestr_destroy, frame_print, framestr_print);
 }
 
+int addr2line_module_count()
+{
+  return module_count;
+}
+
+Module const* addr2line_module(int index)
+{
+  return &modules[index];
+}
+
 static void find_address_in_section(bfd* abfd, asection* section, void* data)
 {
   bfd_vma vma;
@@ -342,6 +381,72 @@ static bool addr2line_lookup(Addr2Line* self, bfd_vma pc)
   return false;
 }
 
+static int symbol_compare(void const* s1, void const* s2)
+{
+  bfd_vma v1 = bfd_asymbol_value(*(asymbol* const*)s1);
+  bfd_vma v2 = bfd_asymbol_value(*(asymbol* const*)s2);
+  return v1 < v2 ? -1 : v1 > v2;
+}
+
+void addr2line_functions(Module const* module, int with_files,
+    void (*callback)(void* data, void const* begin, void const* end, char const* name, char const* demangled, char const* file), void* data)
+{
+  Addr2Line* self = module->addr2line;
+  if (!self || !self->abfd)
+    return;
+  pthread_mutex_lock(&addr2line_mutex);
+  // The symbol table is terminated by a NULL pointer.
+  long symcount = 0;
+  while (self->syms[symcount])
+    ++symcount;
+  asymbol** functions = (*memleak_libc_malloc)((symcount + 1) * sizeof(asymbol*));
+  long count = 0;
+  for (long i = 0; i < symcount; ++i)
+  {
+    asymbol* sym = self->syms[i];
+    if ((sym->flags & BSF_FUNCTION) && !bfd_is_und_section(sym->section) && (bfd_section_flags(sym->section) & SEC_CODE))
+      functions[count++] = sym;
+  }
+  qsort(functions, count, sizeof(asymbol*), symbol_compare);
+  // Convert link time addresses to run time addresses the same way as addr2line_print does, but
+  // also taking the file offset of the mapping into account.
+  Range range = { module->begin, module->end };
+  bfd_vma bias = is_no_pie(self, &range) ? 0 : (bfd_vma)module->begin - module->offset;
+  for (long i = 0; i < count; ++i)
+  {
+    asymbol* sym = functions[i];
+    bfd_vma begin = bfd_asymbol_value(sym);
+    // A function ends where the next one (at a higher address) begins, or at the end of its section.
+    bfd_vma end = bfd_section_vma(sym->section) + bfd_section_size(sym->section);
+    for (long j = i + 1; j < count; ++j)
+    {
+      bfd_vma next = bfd_asymbol_value(functions[j]);
+      if (next > begin)
+      {
+        if (next < end)
+          end = next;
+        break;
+      }
+    }
+    if (end <= begin)
+      continue;
+    char const* name = bfd_asymbol_name(sym);
+    char* demangled = strncmp(name, "_Z", 2) == 0 ? cplus_demangle(name, DMGL_ANSI) : NULL;
+    char const* file = NULL;
+    if (with_files)
+    {
+      char const* function;
+      unsigned int line;
+      if (!bfd_find_nearest_line(self->abfd, sym->section, self->syms, begin - bfd_section_vma(sym->section), &file, &function, &line))
+        file = NULL;
+    }
+    callback(data, (void const*)(begin + bias), (void const*)(end + bias), name, demangled, file);
+    free(demangled);
+  }
+  (*memleak_libc_free)(functions);
+  pthread_mutex_unlock(&addr2line_mutex);
+}
+
 static int frame_cache_total = 0;
 static int frame_cache_hits = 0;
 
@@ -354,6 +459,7 @@ double frame_cache_stats()
 
 void addr2line_print(FILE* fbacktraces, void** backtrace, size_t backtrace_size)
 {
+  pthread_mutex_lock(&addr2line_mutex);
   char** strs = NULL;
   for (unsigned int i = 0; i < backtrace_size; ++i)
   {
@@ -416,6 +522,7 @@ void addr2line_print(FILE* fbacktraces, void** backtrace, size_t backtrace_size)
   }
   if (strs)
     free(strs);
+  pthread_mutex_unlock(&addr2line_mutex);
 }
 
 #if 0
@@ -0,0 +1,168 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file backtrace_db.c Write the binary backtrace database.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "BacktraceDB.h"
+#include "addr2line.h"
+
+extern void* (*memleak_libc_malloc)(size_t size);
+extern void (*memleak_libc_free)(void* ptr);
+
+static int db_fd = -1;
+static int db_strings_fd = -1;
+static uint64_t db_record_offset;
+static uint64_t db_record_count;
+static uint64_t db_strings_size;
+static char db_path[256];
+
+// Write all of BUF at OFFSET.
+static int db_pwrite(int fd, void const* buf, size_t len, off_t offset)
+{
+  while (len > 0)
+  {
+    ssize_t ret = pwrite(fd, buf, len, offset);
+    if (ret < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    buf = (char const*)buf + ret;
+    len -= ret;
+    offset += ret;
+  }
+  return 0;
+}
+
+void backtrace_db_open(char const* path, char const* exename, int64_t application_start)
+{
+  strncpy(db_path, path, sizeof(db_path) - 1);
+  db_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (db_fd < 0)
+  {
+    fprintf(stderr, "libmemleak: %s: %s\n", path, strerror(errno));
+    return;
+  }
+  char* strings_path = (*memleak_libc_malloc)(strlen(path) + 5);
+  sprintf(strings_path, "%s.str", path);
+  db_strings_fd = open(strings_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (db_strings_fd < 0)
+    fprintf(stderr, "libmemleak: %s: %s\n", strings_path, strerror(errno));
+  (*memleak_libc_free)(strings_path);
+
+  int module_count = addr2line_module_count();
+  BacktraceDBHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BACKTRACE_DB_MAGIC, sizeof(header.magic));
+  header.header_size = sizeof(BacktraceDBHeader);
+  header.module_count = module_count;
+  header.module_offset = sizeof(BacktraceDBHeader);
+  header.record_offset = header.module_offset + module_count * sizeof(BacktraceDBModule);
+  header.record_size = sizeof(BacktraceRecord);
+  header.frames_max = BACKTRACE_DB_FRAMES;
+  header.record_count = 0;
+  header.application_start = application_start;
+  header.pid = getpid();
+  strncpy(header.application, exename, sizeof(header.application) - 1);
+  db_pwrite(db_fd, &header, sizeof(header), 0);
+  for (int m = 0; m < module_count; ++m)
+  {
+    Module const* module = addr2line_module(m);
+    BacktraceDBModule entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.begin = (uintptr_t)module->begin;
+    entry.end = (uintptr_t)module->end;
+    entry.offset = module->offset;
+    strncpy(entry.path, module->path, sizeof(entry.path) - 1);
+    db_pwrite(db_fd, &entry, sizeof(entry), header.module_offset + m * sizeof(BacktraceDBModule));
+  }
+  db_record_offset = header.record_offset;
+
+  if (db_strings_fd >= 0)
+  {
+    char line[300];
+    int len = snprintf(line, sizeof(line), "Application: \"%s\"\n", exename);
+    if (write(db_strings_fd, line, len) == len)
+      db_strings_size = len;
+  }
+}
+
+char const* backtrace_db_path()
+{
+  return db_path;
+}
+
+// Return the index of the module that contains PC, or BACKTRACE_DB_NO_MODULE.
+static uint16_t db_find_module(uint64_t pc)
+{
+  int low = 0;
+  int high = addr2line_module_count();
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    Module const* module = addr2line_module(mid);
+    if (pc < (uintptr_t)module->begin)
+      high = mid;
+    else if (pc >= (uintptr_t)module->end)
+      low = mid + 1;
+    else
+      return mid;
+  }
+  return BACKTRACE_DB_NO_MODULE;
+}
+
+void backtrace_db_append(BacktraceRecord* records, int count)
+{
+  if (db_fd < 0 || count == 0)
+    return;
+  for (int i = 0; i < count; ++i)
+    for (uint32_t f = 0; f < records[i].frames; ++f)
+      records[i].module[f] = db_find_module(records[i].pc[f]);
+  // Write the records first, then commit them by updating record_count.
+  if (db_pwrite(db_fd, records, count * sizeof(BacktraceRecord), db_record_offset + db_record_count * sizeof(BacktraceRecord)) < 0)
+    return;
+  db_record_count += count;
+  db_pwrite(db_fd, &db_record_count, sizeof(db_record_count), offsetof(BacktraceDBHeader, record_count));
+}
+
+void backtrace_db_set_strings(uint32_t backtrace_nr, char const* text, size_t len)
+{
+  if (db_fd < 0 || db_strings_fd < 0 || backtrace_nr == 0 || backtrace_nr > db_record_count)
+    return;
+  uint64_t offset = db_strings_size;
+  if (db_pwrite(db_strings_fd, text, len, offset) < 0)
+    return;
+  db_strings_size += len;
+  uint64_t strings = BACKTRACE_DB_STRINGS(offset, len);
+  db_pwrite(db_fd, &strings, sizeof(strings),
+      db_record_offset + (backtrace_nr - 1) * sizeof(BacktraceRecord) + offsetof(BacktraceRecord, strings));
+}
@@ -0,0 +1,131 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file churn.c Keep track of the backtraces with the highest allocation rate.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include "churn.h"
+#include "BacktraceEntry.h"
+
+static char const* churn_names[] = { "allocations", "bytes", "pairs" };
+
+int churn_parse(char const* name)
+{
+  for (int key = 0; key < (int)(sizeof(churn_names) / sizeof(churn_names[0])); ++key)
+    if (strcmp(name, churn_names[key]) == 0)
+      return key;
+  return -1;
+}
+
+char const* churn_name(int key)
+{
+  return churn_names[key];
+}
+
+uint64_t churn_value(ChurnTop const* top, BacktraceEntry const* entry)
+{
+  Churn const* churn = &entry->churn;
+  if (churn->epoch != top->epoch)
+    return 0;
+  switch (top->key)
+  {
+    case churn_by_allocations:
+      return churn->allocations;
+    case churn_by_bytes:
+      return churn->bytes;
+  }
+  return churn->frees < churn->allocations ? churn->frees : churn->allocations;
+}
+
+// Move ENTRY up in TOP, or add it, now that its value increased.
+static void churn_update(ChurnTop* top, BacktraceEntry* entry)
+{
+  uint64_t value = churn_value(top, entry);
+  int pos = entry->churn.rank - 1;
+  if (pos < 0)
+  {
+    if (top->count < top->limit)
+      pos = top->count++;
+    else
+    {
+      // The common case: not in the top and not getting in either. The limit is still 0 during initialization.
+      if (top->count == 0 || value <= churn_value(top, top->entries[top->count - 1]))
+        return;
+      pos = top->count - 1;
+      top->entries[pos]->churn.rank = 0;
+    }
+    top->entries[pos] = entry;
+  }
+  while (pos > 0 && churn_value(top, top->entries[pos - 1]) < value)
+  {
+    top->entries[pos] = top->entries[pos - 1];
+    top->entries[pos]->churn.rank = pos + 1;
+    --pos;
+  }
+  top->entries[pos] = entry;
+  entry->churn.rank = pos + 1;
+}
+
+// Reset the counters of ENTRY if they belong to an old window.
+static inline void churn_current(ChurnTop const* top, Churn* churn)
+{
+  if (churn->epoch != top->epoch)
+  {
+    churn->epoch = top->epoch;
+    churn->allocations = churn->bytes = churn->frees = 0;
+  }
+}
+
+void churn_alloc(ChurnTop* top, BacktraceEntry* entry, size_t size)
+{
+  churn_current(top, &entry->churn);
+  ++entry->churn.allocations;
+  entry->churn.bytes += size;
+  churn_update(top, entry);
+}
+
+void churn_free(ChurnTop* top, BacktraceEntry* entry)
+{
+  churn_current(top, &entry->churn);
+  ++entry->churn.frees;
+  if (top->key == churn_by_pairs)
+    churn_update(top, entry);
+}
+
+void churn_reset(ChurnTop* top, time_t now)
+{
+  for (int i = 0; i < top->count; ++i)
+    top->entries[i]->churn.rank = 0;
+  top->count = 0;
+  ++top->epoch;
+  top->start = now;
+}
+
+void churn_rebuild(ChurnTop* top, BacktraceEntry* first)
+{
+  for (int i = 0; i < top->count; ++i)
+    top->entries[i]->churn.rank = 0;
+  top->count = 0;
+  for (BacktraceEntry* entry = first; entry; entry = entry->next)
+    if (churn_value(top, entry) > 0)
+      churn_update(top, entry);
+}
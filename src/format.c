@@ -0,0 +1,347 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file format.c Formatting of the stats as text, JSON lines or CSV.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include "format.h"
+
+// Upper bounds of the size of the structured output, excluding the application name.
+#define FORMAT_HEADER_MAX 256
+#define FORMAT_ROW_MAX (880 + 64 * size_classes)
+
+static char const* format_names[] = { "text", "json", "csv" };
+
+int format_parse(char const* name)
+{
+  for (int format = 0; format < (int)(sizeof(format_names) / sizeof(format_names[0])); ++format)
+    if (strcmp(name, format_names[format]) == 0)
+      return format;
+  return -1;
+}
+
+char const* format_name(int format)
+{
+  return format_names[format];
+}
+
+void interval_print(OutputBuffer* buf, Interval const* interval)
+{
+  output_buffer_printf(buf, "[%4lu,", interval->start);
+  if (interval->end)
+    output_buffer_printf(buf, "%4lu>(%4lu)", interval->end, interval->end - interval->start);
+  else
+    output_buffer_printf(buf, "now");
+  output_buffer_printf(buf, ": %5lu allocations (%6lu total, %4.1f%%), size %7lu; %6.2f allocations/s, %lu bytes/s\n",
+      interval->n, interval->total_n, (100.0 * interval->n / interval->total_n), interval->size,
+      (double)interval->n / (interval->end - interval->start),
+      interval->size / (interval->end - interval->start));
+}
+
+//---------------------------------------------------------------------------------------------
+// Appending to a buffer that is known to be large enough.
+
+#define PUT_LITERAL(p, s) (memcpy(p, s, sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+static char* put_uint(char* p, uint64_t value)
+{
+  char digits[20];
+  int n = 0;
+  do
+  {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  }
+  while (value);
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+static char* put_int(char* p, int64_t value)
+{
+  if (value < 0)
+  {
+    *p++ = '-';
+    return put_uint(p, -(uint64_t)value);
+  }
+  return put_uint(p, value);
+}
+
+// Print VALUE with two decimals.
+static char* put_fixed2(char* p, double value)
+{
+  if (value < 0)
+  {
+    *p++ = '-';
+    value = -value;
+  }
+  uint64_t hundredths = value * 100 + 0.5;
+  p = put_uint(p, hundredths / 100);
+  *p++ = '.';
+  *p++ = '0' + hundredths / 10 % 10;
+  *p++ = '0' + hundredths % 10;
+  return p;
+}
+
+// Write LEN characters of TEXT as a JSON string (at most 6 * LEN + 2 characters).
+static char* put_json_string(char* p, char const* text, size_t len)
+{
+  static char const hex[] = "0123456789abcdef";
+  *p++ = '"';
+  for (size_t i = 0; i < len; ++i)
+  {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\')
+    {
+      *p++ = '\\';
+      *p++ = c;
+    }
+    else if (c == '\n')
+      p = PUT_LITERAL(p, "\\n");
+    else if (c == '\t')
+      p = PUT_LITERAL(p, "\\t");
+    else if (c < 0x20)
+    {
+      p = PUT_LITERAL(p, "\\u00");
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 15];
+    }
+    else
+      *p++ = c;
+  }
+  *p++ = '"';
+  return p;
+}
+
+//---------------------------------------------------------------------------------------------
+
+static void format_stats_text(OutputBuffer* buf, StatsHeader const* header, StatsRow const* rows, int count)
+{
+  // Print the total memory with thousands separators.
+  char total[256];
+  long totm = header->total_memory;
+  char* p = &total[sizeof(total)];
+  *--p = 0;
+  int count2 = 0;
+  while (totm > 0)
+  {
+    if (count2 && count2 % 3 == 0)
+      *--p = ',';
+    *--p = '0' + (totm % 10);
+    totm /= 10;
+    ++count2;
+  }
+  output_buffer_printf(buf, "%s: Now: %lu; \tBacktraces: %lu; \tallocations: %lu; \ttotal memory: %s bytes.\n",
+      header->appname, header->now, header->backtraces, header->allocations, p);
+  for (int i = 0; i < count; ++i)
+  {
+    if (header->scorer == scorer_trend)
+      output_buffer_printf(buf, " backtrace %d (leak: %.2f +/- %.2f bytes/s, t = %.1f); ", rows[i].backtrace_nr,
+          rows[i].trend.bytes_rate, rows[i].trend.bytes_error, rows[i].trend.significance);
+    else
+      output_buffer_printf(buf, " backtrace %d (value_n: %6.2f); ", rows[i].backtrace_nr, rows[i].value_n);
+    interval_print(buf, &rows[i].interval);
+  }
+}
+
+void format_stats(OutputBuffer* buf, int format, StatsHeader const* header, StatsRow const* rows, int count)
+{
+  if (format == format_text)
+  {
+    format_stats_text(buf, header, rows, count);
+    return;
+  }
+  size_t appname_len = strlen(header->appname);
+  output_buffer_reserve(buf, FORMAT_HEADER_MAX + 6 * appname_len + count * FORMAT_ROW_MAX);
+  char* p = buf->data + buf->len;
+  if (format == format_json)
+  {
+    p = PUT_LITERAL(p, "{\"type\":\"stats\",\"app\":");
+    p = put_json_string(p, header->appname, appname_len);
+    p = PUT_LITERAL(p, ",\"now\":");
+    p = put_int(p, header->now);
+    p = PUT_LITERAL(p, ",\"backtraces\":");
+    p = put_uint(p, header->backtraces);
+    p = PUT_LITERAL(p, ",\"allocations\":");
+    p = put_uint(p, header->allocations);
+    p = PUT_LITERAL(p, ",\"total_memory\":");
+    p = put_uint(p, header->total_memory);
+    p = PUT_LITERAL(p, "}\n");
+    for (int i = 0; i < count; ++i)
+    {
+      Interval const* interval = &rows[i].interval;
+      p = PUT_LITERAL(p, "{\"type\":\"interval\",\"now\":");
+      p = put_int(p, header->now);
+      p = PUT_LITERAL(p, ",\"backtrace\":");
+      p = put_int(p, rows[i].backtrace_nr);
+      p = PUT_LITERAL(p, ",\"value_n\":");
+      p = put_fixed2(p, rows[i].value_n);
+      p = PUT_LITERAL(p, ",\"start\":");
+      p = put_int(p, interval->start);
+      p = PUT_LITERAL(p, ",\"end\":");
+      p = put_int(p, interval->end);
+      p = PUT_LITERAL(p, ",\"n\":");
+      p = put_uint(p, interval->n);
+      p = PUT_LITERAL(p, ",\"total_n\":");
+      p = put_uint(p, interval->total_n);
+      p = PUT_LITERAL(p, ",\"size\":");
+      p = put_uint(p, interval->size);
+      p = PUT_LITERAL(p, ",\"rate\":");
+      p = put_fixed2(p, rows[i].trend.rate);
+      p = PUT_LITERAL(p, ",\"bytes_rate\":");
+      p = put_fixed2(p, rows[i].trend.bytes_rate);
+      p = PUT_LITERAL(p, ",\"bytes_error\":");
+      p = put_fixed2(p, rows[i].trend.bytes_error);
+      p = PUT_LITERAL(p, ",\"significance\":");
+      p = put_fixed2(p, rows[i].trend.significance);
+      p = PUT_LITERAL(p, ",\"lifetimes\":[");
+      for (int bucket = 0; bucket < lifetime_buckets; ++bucket)
+      {
+        if (bucket)
+          *p++ = ',';
+        p = put_uint(p, rows[i].lifetimes[bucket]);
+      }
+      p = PUT_LITERAL(p, "],\"sizes\":[");
+      int first = 1;
+      for (int sc = 0; sc < size_classes; ++sc)
+      {
+        if (rows[i].total_sizes[sc] == 0)
+          continue;
+        if (!first)
+          *p++ = ',';
+        first = 0;
+        *p++ = '[';
+        p = put_uint(p, size_class_min(sc));
+        *p++ = ',';
+        p = put_uint(p, rows[i].live_sizes[sc]);
+        *p++ = ',';
+        p = put_uint(p, rows[i].total_sizes[sc]);
+        *p++ = ']';
+      }
+      p = PUT_LITERAL(p, "]}\n");
+    }
+  }
+  else
+  {
+    // See format_csv_columns.
+    p = PUT_LITERAL(p, "stats,");
+    p = put_int(p, header->now);
+    *p++ = ',';
+    p = put_uint(p, header->backtraces);
+    *p++ = ',';
+    p = put_uint(p, header->allocations);
+    *p++ = ',';
+    p = put_uint(p, header->total_memory);
+    p = PUT_LITERAL(p, ",,,,,,,,,,,,,\n");
+    for (int i = 0; i < count; ++i)
+    {
+      Interval const* interval = &rows[i].interval;
+      p = PUT_LITERAL(p, "interval,");
+      p = put_int(p, header->now);
+      p = PUT_LITERAL(p, ",,,,");
+      p = put_int(p, rows[i].backtrace_nr);
+      *p++ = ',';
+      p = put_fixed2(p, rows[i].value_n);
+      *p++ = ',';
+      p = put_int(p, interval->start);
+      *p++ = ',';
+      p = put_int(p, interval->end);
+      *p++ = ',';
+      p = put_uint(p, interval->n);
+      *p++ = ',';
+      p = put_uint(p, interval->total_n);
+      *p++ = ',';
+      p = put_uint(p, interval->size);
+      *p++ = ',';
+      p = put_fixed2(p, rows[i].trend.rate);
+      *p++ = ',';
+      p = put_fixed2(p, rows[i].trend.bytes_rate);
+      *p++ = ',';
+      p = put_fixed2(p, rows[i].trend.bytes_error);
+      *p++ = ',';
+      p = put_fixed2(p, rows[i].trend.significance);
+      *p++ = ',';
+      for (int bucket = 0; bucket < lifetime_buckets; ++bucket)
+      {
+        if (bucket)
+          *p++ = ';';
+        p = put_uint(p, rows[i].lifetimes[bucket]);
+      }
+      *p++ = ',';
+      int first = 1;
+      for (int sc = 0; sc < size_classes; ++sc)
+      {
+        if (rows[i].total_sizes[sc] == 0)
+          continue;
+        if (!first)
+          *p++ = ';';
+        first = 0;
+        p = put_uint(p, size_class_min(sc));
+        *p++ = ':';
+        p = put_uint(p, rows[i].live_sizes[sc]);
+        *p++ = ':';
+        p = put_uint(p, rows[i].total_sizes[sc]);
+      }
+      *p++ = '\n';
+    }
+  }
+  buf->len = p - buf->data;
+}
+
+void format_message(OutputBuffer* buf, int format, char const* text, size_t len)
+{
+  if (format == format_text)
+  {
+    output_buffer_write(buf, text, len);
+    return;
+  }
+  if (len > 0 && text[len - 1] == '\n')
+    --len;
+  output_buffer_reserve(buf, 32 + 6 * len);
+  char* p = buf->data + buf->len;
+  if (format == format_json)
+  {
+    p = PUT_LITERAL(p, "{\"type\":\"message\",\"text\":");
+    p = put_json_string(p, text, len);
+    p = PUT_LITERAL(p, "}\n");
+  }
+  else
+  {
+    // Every line becomes a comment.
+    p = PUT_LITERAL(p, "# ");
+    for (size_t i = 0; i < len; ++i)
+    {
+      *p++ = text[i];
+      if (text[i] == '\n')
+        p = PUT_LITERAL(p, "# ");
+    }
+    *p++ = '\n';
+  }
+  buf->len = p - buf->data;
+}
+
+void format_csv_columns(OutputBuffer* buf)
+{
+  static char const columns[] = "record,now,backtraces,allocations,total_memory,backtrace,value_n,start,end,n,total_n,size,rate,bytes_rate,bytes_error,significance,lifetimes,sizes\n";
+  output_buffer_write(buf, columns, sizeof(columns) - 1);
+}
@@ -8,6 +8,7 @@
 extern "C" {
 #include "addr2line.h"
 }
+#include "memleak.h"
 
 #ifdef DIRECT_LINKED
 #include <unistd.h>
@@ -57,6 +58,8 @@ int main()
 	break;
     }
   }
+  if (memleak_mark)
+    memleak_mark("threads started");
 
 #ifdef DIRECT_LINKED
   pthread_t monitor_thread;
@@ -0,0 +1,112 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file BacktraceDB.h This file contains the file format of the backtrace database.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef BACKTRACEDB_H
+#define BACKTRACEDB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The backtrace database consists of two files:
+//
+// <name>      : BacktraceDBHeader, followed by module_count BacktraceDBModule's,
+//               followed by record_count BacktraceRecord's. Backtrace N is
+//               the record at record_offset + (N - 1) * record_size.
+// <name>.str  : The string table; the symbolized backtraces, in the same
+//               text format as libmemleak used to write to memleak_backtraces.
+//
+// Both files are only appended to. The header field record_count is updated
+// after the records themselves were written, and BacktraceRecord::strings
+// is only set after the corresponding text was appended to the string table;
+// both are single aligned 8-byte writes, so that a reader never sees a
+// partially written record or string.
+
+//! @brief Magic number at the start of the database.
+#define BACKTRACE_DB_MAGIC "MLBTDB01"
+
+//! @brief Maximum number of frames in a record (equal to backtrace_size_max).
+#define BACKTRACE_DB_FRAMES 40
+
+//! @brief Module index used for frames that are not inside any known module.
+#define BACKTRACE_DB_NO_MODULE 0xffff
+
+//! @brief Extract the offset into the string table from BacktraceRecord::strings.
+#define BACKTRACE_DB_STRINGS_OFFSET(strings) (((strings) & 0xffffffffffULL) - 1)
+//! @brief Extract the length of the text from BacktraceRecord::strings.
+#define BACKTRACE_DB_STRINGS_LENGTH(strings) ((strings) >> 40)
+//! @brief Encode OFFSET and LENGTH into a value for BacktraceRecord::strings.
+#define BACKTRACE_DB_STRINGS(offset, length) (((uint64_t)(length) << 40) | ((uint64_t)(offset) + 1))
+
+//! @brief The header of the backtrace database.
+struct BacktraceDBHeader {
+  char magic[8];                                //!< BACKTRACE_DB_MAGIC.
+  uint32_t header_size;                         //!< sizeof(BacktraceDBHeader).
+  uint32_t module_count;                        //!< Number of modules in the module table.
+  uint64_t module_offset;                       //!< File offset of the module table.
+  uint64_t record_offset;                       //!< File offset of the first record.
+  uint32_t record_size;                         //!< sizeof(BacktraceRecord).
+  uint32_t frames_max;                          //!< BACKTRACE_DB_FRAMES.
+  uint64_t record_count;                        //!< Number of completely written records.
+  int64_t application_start;                    //!< Time at which the application was started (seconds since the Epoch).
+  int32_t pid;                                  //!< Process ID of the application.
+  uint32_t reserved;
+  char application[256];                        //!< Full path of the executable.
+};
+
+//! @brief An entry of the module table.
+struct BacktraceDBModule {
+  uint64_t begin;                               //!< Start address of the executable mapping.
+  uint64_t end;                                 //!< End address of the executable mapping.
+  uint64_t offset;                              //!< File offset that corresponds to 'begin'.
+  char path[232];                               //!< Full path of the module.
+};
+
+//! @brief A single backtrace.
+struct BacktraceRecord {
+  uint32_t backtrace_nr;                        //!< The backtrace number (the index of this record plus one).
+  uint32_t frames;                              //!< Number of valid elements in 'pc'.
+  uint64_t strings;                             //!< Location in the string table (see BACKTRACE_DB_STRINGS), or 0 if not symbolized.
+  uint64_t pc[BACKTRACE_DB_FRAMES];             //!< The raw program counters.
+  uint16_t module[BACKTRACE_DB_FRAMES];         //!< Index into the module table for each pc, or BACKTRACE_DB_NO_MODULE.
+};
+
+//! @brief Abbreviation for struct BacktraceDBHeader.
+typedef struct BacktraceDBHeader BacktraceDBHeader;
+//! @brief Abbreviation for struct BacktraceDBModule.
+typedef struct BacktraceDBModule BacktraceDBModule;
+//! @brief Abbreviation for struct BacktraceRecord.
+typedef struct BacktraceRecord BacktraceRecord;
+
+//! @brief Create the database PATH for application EXENAME and write the header and module table.
+void backtrace_db_open(char const* path, char const* exename, int64_t application_start);
+
+//! @brief The path of the database, as passed to backtrace_db_open.
+char const* backtrace_db_path();
+
+//! @brief Append COUNT records; their backtrace_nr must continue where the previous call left off.
+void backtrace_db_append(BacktraceRecord* records, int count);
+
+//! @brief Append the symbolized TEXT of backtrace BACKTRACE_NR to the string table.
+void backtrace_db_set_strings(uint32_t backtrace_nr, char const* text, size_t len);
+
+#endif // BACKTRACEDB_H
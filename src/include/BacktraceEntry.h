@@ -24,12 +24,42 @@
 #ifndef BACKTRACEENTRY_H
 #define BACKTRACEENTRY_H
 
+#include <stdint.h>
 #include "Header.h"
 #include "Interval.h"
+#include "score.h"
+#include "churn.h"
+#include "latency.h"
 
 //! @brief Maximum size of a backtrace.
 #define backtrace_size_max 40
 
+//! @brief Number of buckets of the lifetime histogram.
+//
+// Bucket 0 counts allocations that were freed within a second; bucket i counts
+// lifetimes in [2^(i-1), 2^i) seconds, and the last bucket everything that lived longer.
+#define lifetime_buckets 16
+
+//! @brief Number of size classes.
+//
+// Sizes 0 to 7 have a class of their own; after that every power of two is
+// divided into four classes of equal width. All sizes of 32 MB and larger
+// fall into the last class.
+#define size_classes 96
+
+//! @brief Number of (allocating thread, freeing thread) pairs that are counted per backtrace.
+#define thread_pairs_max 8
+
+//! @brief The number of sampled frees by thread free_thread of allocations of thread alloc_thread.
+struct ThreadPair {
+  uint16_t alloc_thread;                        //!< Index of the thread that made the allocations.
+  uint16_t free_thread;                         //!< Index of the thread that freed them.
+  uint32_t count;                               //!< The number of sampled frees; an upper bound once pairs were replaced.
+};
+
+//! @brief Abbreviation for struct ThreadPair.
+typedef struct ThreadPair ThreadPair;
+
 //! @brief Backtrace representation.
 //
 // Representation of the backtrace of some allocation.
@@ -37,6 +67,7 @@ struct BacktraceEntry {
   void* ptr[backtrace_size_max];                //!< The backtrace.
   int backtrace_size;                           //!< Number of valid pointers in 'ptr'.
   int allocations;                              //!< Number of current allocations with this backtrace.
+  size_t size;                                  //!< Total size of the current allocations with this backtrace.
   struct BacktraceEntry* next;                  //!< Next backtrace.
   struct BacktraceEntry* hashnext;              //!< Next backtrace with the same hash.
   int backtrace_nr;                             //!< Small unique ID assigned to this backtrace.
@@ -44,12 +75,42 @@ struct BacktraceEntry {
   int printed;                                  //!< Set to 1 when this backtrace was already printed.
   struct BacktraceEntry* next_n;		//!< Next backtace with a value_n that is less or equal.
   double value_n;				//!< Value used for sorting.
-  Header head;                                  //!< Root of doubly linked list of all current allocations.
+  Header head;                                  //!< Root of doubly linked list of all current allocations that are linked.
+  int linked;                                   //!< Nonzero when new allocations are linked into 'head'; otherwise they are only counted.
+  int unlinked;                                 //!< The number of current allocations that are not linked into 'head'.
   Interval* recording_interval;			//!< The currently active (recording) Interval for this backtrace.
   Interval* intervals;				//!< A linked list of all Interval's related to this backtrace.
+  uint64_t published;                           //!< Checksum of the state that was last sent to subscribers, or 0.
+  Trend trend;                                  //!< Regression of the current allocations against time (see score.h).
+  uint64_t lifetimes[lifetime_buckets];         //!< Histogram of the lifetimes of the freed allocations with this backtrace.
+  uint32_t live_sizes[size_classes];            //!< Histogram of the sizes of the current allocations with this backtrace.
+  uint32_t total_sizes[size_classes];           //!< Histogram of the sizes of all allocations with this backtrace; the counts stop at UINT32_MAX.
+  Churn churn;                                  //!< Allocations and frees in the current churn window (see churn.h).
+  uint64_t alloc_latency[latency_buckets];      //!< Latency histogram of the real allocator calls that allocated for this backtrace.
+  uint64_t free_latency[latency_buckets];       //!< Latency histogram of the real free calls of allocations with this backtrace.
+  uint64_t thread_frees;                        //!< Number of frees of allocations of known threads.
+  uint64_t cross_thread_frees;                  //!< Number of those that were freed by another thread than the one that allocated them.
+  ThreadPair thread_pairs[thread_pairs_max];    //!< The most frequent sampled (allocating, freeing) thread pairs.
 };
 
 //! @brief Abbreviation for struct BacktraceEntry.
 typedef struct BacktraceEntry BacktraceEntry;
 
+//! @brief Return the size class of an allocation of SIZE bytes, without branches.
+static inline int size_class(size_t size)
+{
+  // The position of the highest bit, but at least 2; the two bits below it select the sub class.
+  int shift = 61 - __builtin_clzll(size | 4);
+  int sc = 4 * shift + (int)(size >> shift);
+  return sc < size_classes - 1 ? sc : size_classes - 1;
+}
+
+//! @brief Return the smallest size in size class SC.
+static inline size_t size_class_min(int sc)
+{
+  if (sc < 4)
+    return sc;
+  return (size_t)(sc % 4 + 4) << (sc / 4 - 1);
+}
+
 #endif // BACKTRACEENTRY_H
@@ -36,13 +36,19 @@ struct Interval;
 // Each memory allocation is increased in size and has this data prepended.
 __attribute__((__packed__)) struct Header
 {
-  struct Header* prev;                          //!< Previous allocation with the same backtrace.
-  struct Header* next;                          //!< Next allocation with the same backtrace.
+  struct Header* prev;                          //!< Previous allocation with the same backtrace, or NULL when the allocation isn't linked (see BacktraceEntry::linked).
+  struct Header* next;                          //!< Next allocation with the same backtrace, or NULL when the allocation isn't linked.
   intptr_t size;                                //!< Size of the allocation (minus Header).
-  intptr_t time;                                //!< Time at which the allocation was made (in seconds UTC).
-  intptr_t posix_memalign_offset;               //!< The offset in case of a posix_memalign.
-  struct BacktraceEntry* backtrace;             //!< Pointer to the backtrace that this allocation belongs to.
-  struct Interval* interval;                    //!< Pointer to interval this allocation was made in, if any.
+  int32_t time;                                 //!< Time at which the allocation was made (in seconds since application start).
+  uint16_t thread;                              //!< Index of the thread that made the allocation, or 0 when threads weren't tracked.
+  uint16_t recording;                           //!< When not linked: the recording in which the allocation was counted in an Interval, or 0.
+  uint32_t posix_memalign_offset;               //!< The offset in case of a posix_memalign.
+  uint32_t epoch;                               //!< The number of the last mark (see memleak_mark) before the allocation was made.
+  union {
+    struct BacktraceEntry* backtrace;           //!< Pointer to the backtrace that this allocation belongs to.
+    uint64_t sketch_hash;                       //!< The hash of the backtrace of an allocation that was only counted in the sketch (see sketch.h).
+  };
+  struct Interval* interval;                    //!< Pointer to interval this allocation was made in, if any. Always NULL when not linked.
   void* magic_number;                           //!< Magic Number.
 };
 
@@ -0,0 +1,130 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file Protocol.h This file defines the messages exchanged between libmemleak and memleak_control.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Everything sent over the socket (in either direction) is a message: a
+// ProtocolFrame followed by 'length' bytes of payload. All integers are in
+// the byte order of the host (it is a UNIX socket).
+//
+// After accepting a connection the library sends protocol_hello. The client
+// answers with its own protocol_hello, upon which the library sends the first
+// protocol_prompt. From then on the client may send commands (each command
+// is answered with zero or more protocol_text messages, followed by a
+// protocol_prompt), and subscribe to stats at any time.
+//
+// A subscribed client receives a full snapshot immediately and afterwards,
+// every time the stats are updated, a delta: a protocol_stats message with
+// only the backtraces that changed since the previous delta and the numbers
+// of the backtraces that lost all of their intervals. A delta always carries
+// the complete current state of the backtraces that it contains, so a client
+// keeps an up to date view by replacing what it had for those backtraces.
+//
+// The payload of protocol_stats is a ProtocolStats, followed by entry_count
+// times a ProtocolEntry, each directly followed by its interval_count
+// ProtocolInterval's (newest first), followed by removed_count uint32_t
+// backtrace numbers.
+
+//! @brief The version of the protocol; increment on every incompatible change.
+#define PROTOCOL_VERSION 1
+
+//! @brief The maximum size of the payload of a message to the library.
+#define PROTOCOL_REQUEST_MAX 1024
+
+//! @brief Message types.
+enum ProtocolType {
+  protocol_hello = 1,                           //!< Both directions: a ProtocolHello.
+  protocol_command = 2,                         //!< Client to library: a command line, without newline.
+  protocol_text = 3,                            //!< Library to client: text to be printed.
+  protocol_prompt = 4,                          //!< Library to client: ready for the next command.
+  protocol_quit = 5,                            //!< Library to client: the application terminates.
+  protocol_subscribe = 6,                       //!< Client to library: a uint32_t; 1 to receive stats, 0 to stop.
+  protocol_snapshot = 7,                        //!< Client to library: request a snapshot (no payload).
+  protocol_stats = 8                            //!< Library to client: a snapshot or delta of the stats.
+};
+
+//! @brief Flags of ProtocolStats.
+enum ProtocolStatsFlags {
+  protocol_stats_snapshot = 1,                  //!< This is a full snapshot, not a delta.
+  protocol_stats_recording = 2                  //!< An interval is being recorded.
+};
+
+//! @brief The header of every message.
+struct ProtocolFrame {
+  uint32_t length;                              //!< The size of the payload that follows.
+  uint16_t type;                                //!< ProtocolType.
+  uint16_t reserved;
+};
+
+//! @brief The payload of protocol_hello.
+struct ProtocolHello {
+  uint32_t version;                             //!< PROTOCOL_VERSION.
+  int32_t pid;                                  //!< The process ID of the sender.
+  char application[256];                        //!< The application (empty when sent by the client).
+};
+
+//! @brief The start of the payload of protocol_stats.
+struct ProtocolStats {
+  uint32_t flags;                               //!< ProtocolStatsFlags.
+  uint32_t entry_count;                         //!< The number of ProtocolEntry's that follow.
+  uint32_t removed_count;                       //!< The number of removed backtrace numbers at the end.
+  uint32_t reserved;
+  uint64_t tick;                                //!< Incremented for every delta.
+  int64_t now;                                  //!< Seconds since application start.
+  uint64_t backtraces;                          //!< Total number of backtraces.
+  uint64_t allocations;                         //!< Total number of current allocations.
+  uint64_t total_memory;                        //!< Total size of all current allocations.
+};
+
+//! @brief A backtrace in protocol_stats.
+struct ProtocolEntry {
+  uint32_t backtrace_nr;                        //!< The backtrace number.
+  uint32_t interval_count;                      //!< The number of ProtocolInterval's that follow.
+  double value_n;                               //!< The leak probability value used for sorting.
+  uint64_t allocations;                         //!< Number of current allocations with this backtrace.
+};
+
+//! @brief An interval in protocol_stats.
+struct ProtocolInterval {
+  int64_t start;                                //!< Start of the interval in seconds since application start.
+  int64_t end;                                  //!< End of the interval, or 0 while it is being recorded.
+  uint64_t total_n;                             //!< Number of allocations done in the interval.
+  uint64_t n;                                   //!< Same, that still aren't freed.
+  uint64_t size;                                //!< The total size in bytes of those n allocations.
+};
+
+//! @brief Abbreviation for struct ProtocolFrame.
+typedef struct ProtocolFrame ProtocolFrame;
+//! @brief Abbreviation for struct ProtocolHello.
+typedef struct ProtocolHello ProtocolHello;
+//! @brief Abbreviation for struct ProtocolStats.
+typedef struct ProtocolStats ProtocolStats;
+//! @brief Abbreviation for struct ProtocolEntry.
+typedef struct ProtocolEntry ProtocolEntry;
+//! @brief Abbreviation for struct ProtocolInterval.
+typedef struct ProtocolInterval ProtocolInterval;
+
+#endif // PROTOCOL_H
@@ -0,0 +1,131 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file SharedStats.h This file defines the layout of the shared memory stats segment.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SHAREDSTATS_H
+#define SHAREDSTATS_H
+
+#include <stdint.h>
+
+// Every time the stats are updated, libmemleak copies the totals and the
+// backtraces with the highest leak probability to a POSIX shared memory
+// segment (by default "/libmemleak.<pid>", so /dev/shm/libmemleak.<pid>).
+// Other processes can map it read-only and read it at any rate without
+// involving the application in any way.
+//
+// The segment is protected by a sequence lock: 'sequence' is odd while the
+// segment is being updated. A reader reads the data between
+// shared_stats_read_begin and shared_stats_read_retry and starts over if
+// the latter returns nonzero.
+
+//! @brief Magic number at the start of the segment.
+#define SHARED_STATS_MAGIC "MLSHARED"
+
+//! @brief The version of the layout; increment on every incompatible change.
+#define SHARED_STATS_VERSION 1
+
+//! @brief The maximum number of backtraces in the segment.
+#define SHARED_STATS_TOP 32
+
+//! @brief The maximum number of intervals per backtrace (the newest ones).
+#define SHARED_STATS_INTERVALS 8
+
+//! @brief An interval of a backtrace.
+struct SharedStatsInterval {
+  int64_t start;                                //!< Start of the interval in seconds since application start.
+  int64_t end;                                  //!< End of the interval, or 0 while it is being recorded.
+  uint64_t total_n;                             //!< Number of allocations done in the interval.
+  uint64_t n;                                   //!< Same, that still aren't freed.
+  uint64_t size;                                //!< The total size in bytes of those n allocations.
+};
+
+//! @brief A backtrace.
+struct SharedStatsEntry {
+  uint32_t backtrace_nr;                        //!< The backtrace number.
+  uint32_t interval_count;                      //!< Number of valid elements in 'intervals'.
+  double value_n;                               //!< The leak probability value used for sorting.
+  uint64_t allocations;                         //!< Number of current allocations with this backtrace.
+  struct SharedStatsInterval intervals[SHARED_STATS_INTERVALS]; //!< The newest intervals, newest first.
+};
+
+//! @brief The shared memory segment.
+struct SharedStats {
+  char magic[8];                                //!< SHARED_STATS_MAGIC.
+  uint32_t version;                             //!< SHARED_STATS_VERSION.
+  uint32_t size;                                //!< sizeof(SharedStats).
+  uint32_t sequence;                            //!< Odd while being updated.
+  int32_t pid;                                  //!< Process ID of the application.
+  int64_t application_start;                    //!< Time at which the application was started (seconds since the Epoch).
+  char application[256];                        //!< Full path of the executable.
+  // Everything below is protected by 'sequence'.
+  uint64_t updates;                             //!< The number of updates so far.
+  int64_t now;                                  //!< Seconds since application start at the last update.
+  uint32_t recording;                           //!< Nonzero while an interval is being recorded.
+  uint32_t entry_count;                         //!< The number of valid elements in 'entries'.
+  uint64_t backtraces;                          //!< Total number of backtraces.
+  uint64_t allocations;                         //!< Total number of current allocations.
+  uint64_t total_memory;                        //!< Total size of all current allocations.
+  uint64_t intervals;                           //!< Total number of intervals.
+  // The overhead of libmemleak itself.
+  uint64_t header_bytes;                        //!< Memory used by the headers prepended to allocations.
+  uint64_t backtrace_bytes;                     //!< Memory used by the backtrace administration.
+  uint64_t interval_bytes;                      //!< Memory used by intervals.
+  uint64_t update_ns;                           //!< The time it took to prepare the last update (nanoseconds).
+  struct SharedStatsEntry entries[SHARED_STATS_TOP]; //!< The backtraces with the highest leak probability, highest first.
+};
+
+//! @brief Abbreviation for struct SharedStatsInterval.
+typedef struct SharedStatsInterval SharedStatsInterval;
+//! @brief Abbreviation for struct SharedStatsEntry.
+typedef struct SharedStatsEntry SharedStatsEntry;
+//! @brief Abbreviation for struct SharedStats.
+typedef struct SharedStats SharedStats;
+
+//! @brief Start reading SHARED; returns the value to pass to shared_stats_read_retry.
+static inline uint32_t shared_stats_read_begin(SharedStats const* shared)
+{
+  uint32_t sequence;
+  while (((sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE)) & 1))
+    ;
+  return sequence;
+}
+
+//! @brief Returns nonzero if SHARED was updated since shared_stats_read_begin returned SEQUENCE.
+static inline int shared_stats_read_retry(SharedStats const* shared, uint32_t sequence)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+//! @brief Create the segment (name from LIBMEMLEAK_SHM; an empty name turns it off).
+void shared_stats_init(char const* exename, int64_t application_start);
+
+//! @brief Start an update; returns the segment, or NULL if there is none. Calls must be serialized.
+SharedStats* shared_stats_begin();
+
+//! @brief Finish the update started with shared_stats_begin.
+void shared_stats_end();
+
+//! @brief Remove the name of the segment (called when the application exits).
+void shared_stats_close();
+
+#endif // SHAREDSTATS_H
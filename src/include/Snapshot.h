@@ -0,0 +1,97 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file Snapshot.h This file contains the file format of heap snapshots.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+// A snapshot is written by the command `snapshot` and contains the live
+// allocations of the application at that moment, summarized per backtrace.
+//
+// The file is a SnapshotHeader followed by record_count SnapshotRecord's,
+// one for every backtrace that has live allocations, in increasing order of
+// backtrace_nr; so that two snapshots can be compared in a single pass.
+// Backtrace numbers refer to the backtrace database (see BacktraceDB.h)
+// whose path is stored in the header.
+//
+// Every backtrace is summarized while holding the lock for just that
+// backtrace, so each record is consistent in itself; backtraces that were
+// created after the snapshot started are not included. Allocations that
+// aren't linked (see `lists suspects`) are included in the totals, but
+// their ages aren't known: they are only counted in unknown_age.
+
+//! @brief Magic number at the start of a snapshot.
+#define SNAPSHOT_MAGIC "MLSNAP01"
+
+//! @brief The number of buckets of the age histogram.
+//
+// Bucket 0 counts allocations younger than one second; bucket i counts ages
+// in [2^(i-1), 2^i) seconds, and the last bucket everything that is older.
+#define SNAPSHOT_AGE_BUCKETS 20
+
+//! @brief The header of a snapshot file.
+struct SnapshotHeader {
+  char magic[8];                                //!< SNAPSHOT_MAGIC.
+  uint32_t header_size;                         //!< sizeof(SnapshotHeader).
+  uint32_t record_size;                         //!< sizeof(SnapshotRecord).
+  uint32_t age_buckets;                         //!< SNAPSHOT_AGE_BUCKETS.
+  int32_t pid;                                  //!< Process ID of the application.
+  int64_t application_start;                    //!< Time at which the application was started (seconds since the Epoch).
+  int64_t time;                                 //!< Time at which the snapshot was taken (seconds since application start).
+  uint64_t record_count;                        //!< Number of records that follow.
+  uint64_t allocations;                         //!< Total number of live allocations in the records.
+  uint64_t total_memory;                        //!< Total size of the live allocations in the records.
+  uint64_t unknown_age;                         //!< Number of the live allocations in the records whose age isn't known.
+  char application[256];                        //!< Full path of the executable.
+  char backtraces[256];                         //!< Path of the backtrace database.
+};
+
+//! @brief The live allocations of a single backtrace.
+struct SnapshotRecord {
+  uint32_t backtrace_nr;                        //!< The backtrace.
+  uint32_t unknown_age;                         //!< Number of the live allocations that aren't in the age histogram, because they aren't linked.
+  uint64_t count;                               //!< Number of live allocations.
+  uint64_t bytes;                               //!< Total size of the live allocations.
+  int64_t oldest;                               //!< Time of the oldest live allocation whose age is known (seconds since application start).
+  uint32_t age[SNAPSHOT_AGE_BUCKETS];           //!< Age histogram of the live allocations whose age is known.
+};
+
+//! @brief Abbreviation for struct SnapshotHeader.
+typedef struct SnapshotHeader SnapshotHeader;
+//! @brief Abbreviation for struct SnapshotRecord.
+typedef struct SnapshotRecord SnapshotRecord;
+
+//! @brief The age histogram bucket of an allocation that is AGE seconds old.
+static inline int snapshot_age_bucket(int64_t age)
+{
+  int bucket = 0;
+  while (age > 0 && bucket < SNAPSHOT_AGE_BUCKETS - 1)
+  {
+    age >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,142 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file Trace.h This file contains the file format of the allocation event trace.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A trace consists of the files <prefix>.0, <prefix>.1, ... ; a new file is
+// started every time the current one reaches the size limit. Only the last
+// LIBMEMLEAK_TRACE_FILES files are kept; older ones are removed.
+//
+// Each file starts with a TraceFileHeader, followed (at segment_offset) by
+// segments of segment_size bytes. Every segment belongs to a single thread
+// and starts with a TraceSegmentHeader, followed by 'used' bytes of records.
+// Segments of different threads are interleaved in the order in which they
+// were needed; within a segment records are in chronological order. When a
+// thread exits, the unused part of its segment is made a hole in the file.
+//
+// A record is a tag byte followed by LEB128 varints:
+//
+//   trace_alloc: time delta, zigzag address delta, size, backtrace_nr
+//   trace_free:  time delta, zigzag address delta
+//
+// Deltas are relative to the previous record of the same segment (the first
+// record of a segment is relative to base_time and zero). Times are
+// nanoseconds of CLOCK_MONOTONIC; addresses are the pointers returned to the
+// application. backtrace_nr refers to the backtrace database (see
+// BacktraceDB.h) whose path is stored in the file header.
+
+//! @brief Magic number at the start of each trace file.
+#define TRACE_MAGIC "MLTRACE1"
+
+//! @brief Magic number at the start of each segment.
+#define TRACE_SEGMENT_MAGIC 0x5347544dU
+
+//! @brief Maximum size of a single encoded record.
+#define TRACE_RECORD_MAX (1 + 4 * 10)
+
+//! @brief Record tags.
+enum TraceTag {
+  trace_alloc = 1,                              //!< An allocation.
+  trace_free = 2                                //!< A deallocation.
+};
+
+//! @brief The header of a trace file.
+struct TraceFileHeader {
+  char magic[8];                                //!< TRACE_MAGIC.
+  uint32_t header_size;                         //!< sizeof(TraceFileHeader).
+  uint32_t segment_offset;                      //!< File offset of the first segment (a multiple of the page size).
+  uint32_t segment_size;                        //!< Size of each segment, including its header.
+  uint32_t reserved;
+  uint32_t sequence;                            //!< The N in <prefix>.N.
+  int32_t pid;                                  //!< Process ID of the application.
+  int64_t application_start;                    //!< Time at which the application was started (seconds since the Epoch).
+  uint64_t monotonic_base;                      //!< CLOCK_MONOTONIC (ns) at ...
+  uint64_t realtime_base;                       //!< ... CLOCK_REALTIME (ns), to convert trace times to wall clock times.
+  char application[256];                        //!< Full path of the executable.
+  char backtraces[256];                         //!< Path of the backtrace database.
+};
+
+//! @brief The header of a segment.
+struct TraceSegmentHeader {
+  uint32_t magic;                               //!< TRACE_SEGMENT_MAGIC.
+  uint32_t thread;                              //!< Kernel thread ID of the thread that owns this segment.
+  uint64_t base_time;                           //!< Time that the first record is relative to.
+  uint32_t used;                                //!< Number of bytes of records after this header; updated after every record.
+  uint32_t reserved;
+};
+
+//! @brief Abbreviation for struct TraceFileHeader.
+typedef struct TraceFileHeader TraceFileHeader;
+//! @brief Abbreviation for struct TraceSegmentHeader.
+typedef struct TraceSegmentHeader TraceSegmentHeader;
+
+//! @brief Decode a varint at *PTR (not beyond END) and advance *PTR. Returns 0 when the input is truncated.
+static inline int trace_read_varint(unsigned char const** ptr, unsigned char const* end, uint64_t* value)
+{
+  uint64_t result = 0;
+  int shift = 0;
+  unsigned char const* p = *ptr;
+  while (p < end && shift < 64)
+  {
+    unsigned char c = *p++;
+    result |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+    {
+      *ptr = p;
+      *value = result;
+      return 1;
+    }
+    shift += 7;
+  }
+  return 0;
+}
+
+//! @brief Undo the zigzag encoding of a signed delta.
+static inline int64_t trace_unzigzag(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+//! @brief Nonzero while tracing is enabled.
+extern int trace_enabled;
+
+//! @brief Read LIBMEMLEAK_TRACE, LIBMEMLEAK_TRACE_SIZE and LIBMEMLEAK_TRACE_FILES; start tracing if a prefix was given.
+void trace_init(char const* exename, int64_t application_start);
+
+//! @brief Turn tracing on or off. Returns the file prefix in use.
+char const* trace_enable(int on);
+
+//! @brief The current time, as used in the trace.
+uint64_t trace_now();
+
+//! @brief Record an allocation of SIZE bytes at PTR with backtrace BACKTRACE_NR, made at time NOW.
+void trace_record_alloc(void const* ptr, size_t size, uint32_t backtrace_nr, uint64_t now);
+
+//! @brief Record that PTR was freed at time NOW.
+void trace_record_free(void const* ptr, uint64_t now);
+
+#endif // TRACE_H
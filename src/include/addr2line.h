@@ -65,6 +65,18 @@ struct Addr2Line {
 //! @brief Abbreviation for struct Addr2Line
 typedef struct Addr2Line Addr2Line;
 
+//! @brief An executable mapping of a shared library or the executable.
+struct Module {
+  void const* begin;		//!< Start of the mapping.
+  void const* end;		//!< One past the end of the mapping.
+  unsigned long offset;		//!< File offset that corresponds to 'begin'.
+  char* path;			//!< Full path of the module (as it appears in /proc/self/maps).
+  Addr2Line* addr2line;		//!< The corresponding Addr2Line object, or NULL if the module couldn't be read.
+};
+
+//! @brief Abbreviation for struct Module
+typedef struct Module Module;
+
 //! @brief Initialize the use of addr2line.
 //
 // This functions reads /proc/self/maps, finds the begin and end
@@ -74,6 +86,21 @@ typedef struct Addr2Line Addr2Line;
 // for fast retrieval as function of a program pointer.
 void addr2line_init();
 
+//! @brief Return the number of modules found by addr2line_init.
+int addr2line_module_count();
+
+//! @brief Return module INDEX; modules are sorted by address.
+Module const* addr2line_module(int index);
+
+//! @brief Call CALLBACK for every function of MODULE, with its address range in the running process.
+//
+// NAME is the symbol name and DEMANGLED the demangled name without parameters, or NULL
+// when NAME isn't mangled. FILE is the source file of the function, or NULL when it is
+// unknown; it is only looked up when WITH_FILES is nonzero, because that requires reading
+// the debug info. Modules without a symbol table (stripped libraries) have no functions.
+void addr2line_functions(Module const* module, int with_files,
+    void (*callback)(void* data, void const* begin, void const* end, char const* name, char const* demangled, char const* file), void* data);
+
 //! @brief Print a backtrace with source file and line numbers.
 void addr2line_print(FILE* fbacktraces, void** backtrace, size_t backtrace_size);
 
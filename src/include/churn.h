@@ -0,0 +1,92 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file churn.h Allocation rate (churn) ranking of the backtraces.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef CHURN_H
+#define CHURN_H
+
+#include <stdint.h>
+#include <time.h>
+
+struct BacktraceEntry;
+
+//! @brief Maximum number of backtraces in the churn top.
+#define churn_top_max 64
+
+//! @brief The values that the churn top can be sorted on.
+enum ChurnKey {
+  churn_by_allocations,                         //!< The number of allocations.
+  churn_by_bytes,                               //!< The number of bytes allocated.
+  churn_by_pairs                                //!< The number of allocations that were matched by a free.
+};
+
+//! @brief The allocations and frees of a backtrace in the current churn window.
+//
+// The counters are reset lazily: they are only valid when epoch equals ChurnTop::epoch.
+struct Churn {
+  uint32_t epoch;                               //!< The window that the counters belong to.
+  int rank;                                     //!< One plus the position in ChurnTop::entries, or 0 when not in the top.
+  uint64_t allocations;                         //!< Number of allocations.
+  uint64_t bytes;                               //!< Number of bytes allocated.
+  uint64_t frees;                               //!< Number of frees.
+};
+
+//! @brief The backtraces with the most churn in the current window, in descending order.
+//
+// Every counter only grows during a window, so the top can be kept up to date
+// with a single comparison for most allocations.
+struct ChurnTop {
+  uint32_t epoch;                               //!< The current window.
+  time_t start;                                 //!< The start of the current window, in seconds since application start.
+  int key;                                      //!< The ChurnKey to sort on.
+  int limit;                                    //!< The number of backtraces to keep, at most churn_top_max.
+  int count;                                    //!< The number of valid elements of entries.
+  struct BacktraceEntry* entries[churn_top_max];        //!< The top.
+};
+
+//! @brief Abbreviation for struct Churn.
+typedef struct Churn Churn;
+//! @brief Abbreviation for struct ChurnTop.
+typedef struct ChurnTop ChurnTop;
+
+//! @brief Return the ChurnKey called NAME ("allocations", "bytes" or "pairs"), or -1.
+int churn_parse(char const* name);
+
+//! @brief Return the name of KEY.
+char const* churn_name(int key);
+
+//! @brief Return the value that ENTRY is sorted on in TOP.
+uint64_t churn_value(ChurnTop const* top, struct BacktraceEntry const* entry);
+
+//! @brief Count an allocation of SIZE bytes by ENTRY and update TOP.
+void churn_alloc(ChurnTop* top, struct BacktraceEntry* entry, size_t size);
+
+//! @brief Count a free by ENTRY and update TOP.
+void churn_free(ChurnTop* top, struct BacktraceEntry* entry);
+
+//! @brief Start a new window at time NOW. O(limit).
+void churn_reset(ChurnTop* top, time_t now);
+
+//! @brief Rebuild TOP from all backtraces, starting at FIRST, after a change of key or limit.
+void churn_rebuild(ChurnTop* top, struct BacktraceEntry* first);
+
+#endif // CHURN_H
@@ -0,0 +1,100 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file format.h This file contains the declarations for format.c.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "Interval.h"
+#include "output.h"
+#include "score.h"
+#include "BacktraceEntry.h"
+
+//! @brief The formats in which stats can be written.
+//
+// format_text is the traditional human readable output. format_json writes
+// one JSON object per line: {"type":"stats",...} for the header of each
+// report, {"type":"interval",...} for each row and {"type":"message",...}
+// for everything else. format_csv writes one line per header or row with
+// the columns given by format_csv_columns; other messages are written as
+// comment lines starting with '#'. The lifetime histogram of a row is a
+// JSON array, or a single CSV column with the buckets separated by ';'.
+// The size class histograms only list the classes with allocations, as
+// [min_size,live,total] arrays in JSON, or min_size:live:total in CSV.
+enum StatsFormat {
+  format_text,                                  //!< Human readable text.
+  format_json,                                  //!< JSON lines.
+  format_csv                                    //!< Comma separated values.
+};
+
+//! @brief The header of a stats report.
+struct StatsHeader {
+  char const* appname;                          //!< The name of the application.
+  time_t now;                                   //!< Seconds since application start.
+  size_t backtraces;                            //!< Total number of backtraces.
+  size_t entries;                               //!< The number of backtraces that exist now; less than backtraces when backtraces were reclaimed.
+  size_t allocations;                           //!< Total number of current allocations.
+  size_t total_memory;                          //!< Total size of all current allocations.
+  size_t intervals;                             //!< Total number of intervals.
+  int recording;                                //!< Nonzero while an interval is being recorded.
+  int scorer;                                   //!< The Scorer that value_n was computed with.
+};
+
+//! @brief A row of a stats report: one interval of a backtrace.
+struct StatsRow {
+  struct BacktraceEntry* entry;                 //!< The backtrace (for use by the caller).
+  int backtrace_nr;                             //!< The backtrace number.
+  double value_n;                               //!< The leak probability value used for sorting.
+  TrendResult trend;                            //!< The growth of the live allocations of the backtrace.
+  uint64_t lifetimes[lifetime_buckets];         //!< A copy of the lifetime histogram of the backtrace.
+  uint32_t live_sizes[size_classes];            //!< A copy of the size class histogram of the live allocations of the backtrace.
+  uint32_t total_sizes[size_classes];           //!< A copy of the size class histogram of all allocations of the backtrace.
+  Interval interval;                            //!< A copy of the interval.
+};
+
+//! @brief Abbreviation for struct StatsHeader.
+typedef struct StatsHeader StatsHeader;
+//! @brief Abbreviation for struct StatsRow.
+typedef struct StatsRow StatsRow;
+
+//! @brief Return the StatsFormat called NAME ("text", "json" or "csv"), or -1.
+int format_parse(char const* name);
+
+//! @brief Return the name of FORMAT.
+char const* format_name(int format);
+
+//! @brief Append the text representation of INTERVAL to BUF.
+void interval_print(OutputBuffer* buf, Interval const* interval);
+
+//! @brief Append a stats report with COUNT rows in FORMAT to BUF.
+void format_stats(OutputBuffer* buf, int format, StatsHeader const* header, StatsRow const* rows, int count);
+
+//! @brief Append the message TEXT of LEN characters (ending on a newline) in FORMAT to BUF.
+void format_message(OutputBuffer* buf, int format, char const* text, size_t len);
+
+//! @brief Append the line that names the columns of format_csv to BUF.
+void format_csv_columns(OutputBuffer* buf);
+
+#endif // FORMAT_H
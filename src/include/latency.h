@@ -0,0 +1,103 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file latency.h Latency histograms of the calls to the real allocator.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+struct BacktraceEntry;
+
+//! @brief Number of buckets of a latency histogram.
+//
+// Bucket 0 counts calls that took less than 32 ticks; bucket i counts
+// calls of [2^(i+4), 2^(i+5)) ticks, and the last bucket everything slower.
+#define latency_buckets 24
+
+//! @brief The first bucket of calls that are considered slow (8192 ticks or more).
+#define latency_slow_bucket 9
+
+//! @brief The calls that are timed.
+enum LatencyOp {
+  latency_malloc,                               //!< The real malloc.
+  latency_calloc,                               //!< The real calloc.
+  latency_realloc,                              //!< The real realloc.
+  latency_memalign,                             //!< The real posix_memalign.
+  latency_free,                                 //!< The real free.
+  latency_overhead,                             //!< The time spent in libmemleak itself, per call.
+  latency_ops
+};
+
+//! @brief Nonzero while the calls to the real allocator are timed.
+extern int latency_enabled;
+
+//! @brief The global histograms, one per LatencyOp.
+extern uint64_t latency_histograms[latency_ops][latency_buckets];
+
+//! @brief Return the current time in ticks: TSC cycles on x86, nanoseconds elsewhere.
+static inline uint64_t latency_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+//! @brief Return the bucket of a call that took TICKS ticks, without branches.
+static inline int latency_bucket(uint64_t ticks)
+{
+  int bucket = 59 - __builtin_clzll(ticks | 31);
+  return bucket < latency_buckets - 1 ? bucket : latency_buckets - 1;
+}
+
+//! @brief Return the smallest number of ticks of BUCKET.
+static inline uint64_t latency_bucket_min(int bucket)
+{
+  return bucket ? (uint64_t)1 << (bucket + 4) : 0;
+}
+
+//! @brief Turn timing on or off.
+void latency_enable(int on);
+
+//! @brief Erase all histograms, starting at the backtrace FIRST. Call with memleak_mutex locked.
+void latency_reset(struct BacktraceEntry* first);
+
+//! @brief Record a call of OP by ENTRY (may be NULL) that took TICKS ticks in the real allocator and OVERHEAD ticks in libmemleak.
+//
+// Lock free; backtraces are never freed.
+void latency_record(int op, struct BacktraceEntry* entry, uint64_t ticks, uint64_t overhead);
+
+//! @brief Return the number of nanoseconds per tick.
+double latency_tick_ns();
+
+//! @brief Return the name of OP.
+char const* latency_name(int op);
+
+#endif // LATENCY_H
@@ -0,0 +1,49 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file memleak.h The API that libmemleak exports to the application.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef MEMLEAK_H
+#define MEMLEAK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! @brief Mark a logical point in the execution of the application.
+//
+// For example "warmup finished" or "request batch 1000 done". Returns the
+// number of the new mark (1, 2, ...), or 0 when there are too many marks.
+// The command `since N` of memleak_control lists the backtraces that still
+// own allocations that were made after mark N.
+//
+// The function is declared weak, so that the application can be run
+// without libmemleak too:
+//
+//   if (memleak_mark)
+//     memleak_mark("warmup finished");
+unsigned int memleak_mark(char const* name) __attribute__((weak));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MEMLEAK_H
@@ -0,0 +1,103 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file output.h This file contains the declarations for output.c.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+struct BacktraceEntry;
+struct BacktraceRecord;
+
+//! @brief The destinations that the writer thread writes to.
+enum OutputChannel {
+  output_stats,                                 //!< Stats and status messages (LIBMEMLEAK_OUTPUT).
+  output_backtraces,                            //!< The backtrace database (LIBMEMLEAK_BACKTRACES).
+  output_channels                               //!< The number of channels.
+};
+
+//! @brief A preformatted chunk of output, queued for the writer thread.
+//
+// Buffers for output_backtraces carry no text; instead 'records' are appended
+// to the backtrace database, and 'backtraces' are symbolized (by the writer
+// thread, not the caller) and added to its string table.
+struct OutputBuffer {
+  int channel;                                  //!< The OutputChannel to write to.
+  size_t len;                                   //!< The number of valid characters in 'data'.
+  size_t capacity;                              //!< The allocated size of 'data'.
+  char* data;                                   //!< The formatted output.
+  struct BacktraceEntry* backtraces;            //!< Array of copied BacktraceEntry objects to symbolize, or NULL.
+  int entries;                                  //!< Number of elements in 'backtraces'.
+  struct BacktraceRecord* records;              //!< Array of new records for the backtrace database, or NULL.
+  int record_count;                             //!< Number of elements in 'records'.
+};
+
+//! @brief Abbreviation for struct OutputBuffer.
+typedef struct OutputBuffer OutputBuffer;
+
+//! @brief Open the output channels.
+//
+// Reads LIBMEMLEAK_OUTPUT, LIBMEMLEAK_FORMAT and LIBMEMLEAK_BACKTRACES and opens the
+// corresponding files, which are kept open for the lifetime of the process.
+void output_init(char const* exename, int64_t application_start);
+
+//! @brief The StatsFormat of output_stats (see format.h).
+int output_format();
+
+//! @brief The main loop of the writer thread. Never returns.
+void output_writer();
+
+//! @brief Create a new, empty OutputBuffer for CHANNEL.
+OutputBuffer* output_buffer_create(int channel);
+
+//! @brief Append formatted text to BUF.
+void output_buffer_printf(OutputBuffer* buf, char const* format, ...) __attribute__((format(printf, 2, 3)));
+
+//! @brief Append formatted text to BUF.
+void output_buffer_vprintf(OutputBuffer* buf, char const* format, va_list ap);
+
+//! @brief Make sure that at least LEN more characters fit in BUF.
+void output_buffer_reserve(OutputBuffer* buf, size_t len);
+
+//! @brief Append LEN bytes of DATA to BUF.
+void output_buffer_write(OutputBuffer* buf, char const* data, size_t len);
+
+//! @brief Free BUF, that was not submitted.
+void output_buffer_destroy(OutputBuffer* buf);
+
+//! @brief Hand BUF over to the writer thread.
+//
+// Blocks while the queue is full. Ownership of BUF (and its 'backtraces' and 'records') is transferred.
+void output_submit(OutputBuffer* buf);
+
+//! @brief Convenience function: format a single message and submit it.
+//
+// Messages for output_stats are converted to the format of that channel.
+void output_printf(int channel, char const* format, ...) __attribute__((format(printf, 2, 3)));
+
+//! @brief Block until everything that was submitted so far has been written.
+void output_flush();
+
+#endif // OUTPUT_H
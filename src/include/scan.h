@@ -0,0 +1,98 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file scan.h Conservative reachability scan of the tracked allocations.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct BacktraceEntry;
+
+// A scan finds the tracked allocations that are not referenced, directly or
+// through other tracked allocations, by any word in the roots of the
+// application: the stacks, registers and static TLS of all threads and the
+// writable segments of all loaded objects. Any word that points into an
+// allocation counts as a reference, so the result never contains an
+// allocation that is still in use, but might miss some that are not.
+//
+// Usage, from a thread that doesn't belong to the application:
+//
+//   ScanState* scan = scan_prepare(workers);          // Before locking memleak_mutex.
+//   lock memleak_mutex
+//   ScanBlock* blocks = scan_blocks(scan, count);     // Fill in the live allocations.
+//   scan_run(scan, count, &result);                   // Stops the world while marking.
+//   unlock memleak_mutex
+//   ... scan_block(scan, i) and scan_reachable(scan, i) ...
+//   scan_finish(scan);
+//
+// Between scan_prepare and scan_finish nothing may call malloc while
+// memleak_mutex is locked; all memory is mapped with mmap.
+
+//! @brief A tracked allocation.
+struct ScanBlock {
+  uintptr_t start;                              //!< The address that was returned to the application.
+  size_t size;                                  //!< The size of the allocation.
+  struct BacktraceEntry* entry;                 //!< The backtrace of the allocation.
+};
+
+//! @brief What a scan did.
+struct ScanResult {
+  size_t blocks;                                //!< The number of tracked allocations.
+  size_t unreachable;                           //!< The number of allocations that are not reachable.
+  size_t threads;                               //!< The number of threads that were stopped.
+  size_t unstopped;                             //!< The number of threads that could not be stopped in time.
+  size_t root_bytes;                            //!< The size of the scanned roots.
+  int workers;                                  //!< The number of threads that marked.
+  double index_ms;                              //!< Time spent sorting the allocations.
+  double pause_ms;                              //!< Time that the application was stopped.
+};
+
+//! @brief Abbreviation for struct ScanBlock.
+typedef struct ScanBlock ScanBlock;
+//! @brief Abbreviation for struct ScanResult.
+typedef struct ScanResult ScanResult;
+//! @brief Opaque scan state.
+typedef struct ScanState ScanState;
+
+//! @brief Start WORKERS extra marking threads and record the writable segments. Returns NULL on failure.
+ScanState* scan_prepare(int workers);
+
+//! @brief Return room for COUNT allocations, to be filled in by the caller. Returns NULL on failure.
+ScanBlock* scan_blocks(ScanState* scan, size_t count);
+
+//! @brief Stop all other threads, mark the first COUNT allocations that are reachable and resume the threads.
+//
+// Returns 0 on success and -1 on failure (errno is set).
+int scan_run(ScanState* scan, size_t count, ScanResult* result);
+
+//! @brief Return the I-th allocation, in order of address. Only valid after scan_run.
+ScanBlock const* scan_block(ScanState const* scan, size_t i);
+
+//! @brief Return nonzero if the I-th allocation is reachable. Only valid after scan_run.
+int scan_reachable(ScanState const* scan, size_t i);
+
+//! @brief Stop the marking threads and release all memory.
+void scan_finish(ScanState* scan);
+
+#endif // SCAN_H
@@ -0,0 +1,91 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file score.h The scorers that rank the backtraces by leak probability.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SCORE_H
+#define SCORE_H
+
+#include <stddef.h>
+#include <time.h>
+
+struct BacktraceEntry;
+
+//! @brief The scorers that can be used to rank the backtraces.
+//
+// Each scorer computes the value that the backtraces are sorted on
+// (BacktraceEntry::value_n) once per stats tick. To add a scorer, add
+// it here and to the table in score.c.
+enum Scorer {
+  scorer_value_n,                               //!< The number of leaked allocations per interval, doubled for every larger interval class.
+  scorer_trend                                  //!< The lower confidence bound of the growth in bytes per second.
+};
+
+//! @brief Incremental, exponentially weighted linear regression of the live allocations of a backtrace against time.
+//
+// Times are relative to the last sample, so that the sums stay small.
+struct Trend {
+  double w;                                     //!< Sum of the weights.
+  double w2;                                    //!< Sum of the squared weights.
+  double t;                                     //!< Sum of w * t.
+  double tt;                                    //!< Sum of w * t * t.
+  double n;                                     //!< Sum of w * n, where n is the number of live allocations.
+  double tn;                                    //!< Sum of w * t * n.
+  double nn;                                    //!< Sum of w * n * n.
+  double b;                                     //!< Sum of w * b, where b is the size of the live allocations.
+  double tb;                                    //!< Sum of w * t * b.
+  double bb;                                    //!< Sum of w * b * b.
+  time_t last;                                  //!< The time of the last sample.
+};
+
+//! @brief The result of a Trend.
+struct TrendResult {
+  double rate;                                  //!< Growth of the number of live allocations, per second.
+  double bytes_rate;                            //!< Growth of the size of the live allocations, in bytes per second.
+  double bytes_error;                           //!< Half width of the 95% confidence interval of bytes_rate.
+  double significance;                          //!< bytes_rate divided by its standard error (the t statistic).
+};
+
+//! @brief Abbreviation for struct Trend.
+typedef struct Trend Trend;
+//! @brief Abbreviation for struct TrendResult.
+typedef struct TrendResult TrendResult;
+
+//! @brief Return the Scorer called NAME ("value_n" or "trend"), or -1.
+int score_parse(char const* name);
+
+//! @brief Return the name of SCORER.
+char const* score_name(int scorer);
+
+//! @brief Return the value that ENTRY is sorted on when using SCORER.
+//
+// Called after interval_update_value_n and trend_sample.
+double score(int scorer, struct BacktraceEntry const* entry);
+
+//! @brief Add a sample of N live allocations of BYTES in total at time NOW to TREND.
+//
+// Older samples are weighted down with a half-life of HALF_LIFE seconds. O(1).
+void trend_sample(Trend* trend, time_t now, double half_life, size_t n, size_t bytes);
+
+//! @brief Compute the regression of TREND into RESULT. O(1).
+void trend_result(Trend const* trend, TrendResult* result);
+
+#endif // SCORE_H
@@ -0,0 +1,119 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file sketch.h Approximate per call site accounting in constant memory.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//! @brief Number of rows of the count-min sketch.
+//
+// An estimate exceeds the true value by more than the error bound
+// (see sketch_error) with a probability of at most e^-sketch_depth (1.8%).
+#define sketch_depth 4
+
+//! @brief Number of counters per row of the count-min sketch; a power of two.
+#define sketch_width 4096
+
+//! @brief Number of call sites in the heavy hitters table.
+#define sketch_heavy_max 128
+
+//! @brief Number of frames kept of each heavy hitter, to print where it is.
+#define sketch_frames_max 16
+
+//! @brief Fixed size summary of the allocations of an unbounded number of call sites.
+//
+// Call sites are identified by a hash of their backtrace. The count-min sketch
+// counts the surviving (not yet freed) allocations and bytes per call site; the
+// heavy hitters table is a space-saving summary of the call sites with the most
+// allocations. A heavy hitter whose estimated number of surviving allocations
+// reaches the threshold is materialized: its later allocations are tracked
+// exactly, with a BacktraceEntry.
+struct Sketch {
+  int enabled;                                  //!< Nonzero while new allocations go into the sketch.
+  uint64_t threshold;                           //!< The number of surviving allocations at which a heavy hitter is materialized.
+  uint64_t surviving;                           //!< The total number of surviving allocations in the sketch.
+  uint64_t surviving_bytes;                     //!< Their total size.
+  uint64_t allocations;                         //!< The total number of allocations that were added to the sketch.
+  int64_t counts[sketch_depth][sketch_width];   //!< Surviving allocations.
+  int64_t bytes[sketch_depth][sketch_width];    //!< Surviving bytes.
+  int heavy_count;                              //!< The number of used elements of the heavy_* arrays.
+  uint64_t heavy_hash[sketch_heavy_max];        //!< The call sites.
+  uint64_t heavy_allocations[sketch_heavy_max]; //!< Their number of allocations (an overestimate) ...
+  uint64_t heavy_error[sketch_heavy_max];       //!< ... by at most this much.
+  uint8_t heavy_materialized[sketch_heavy_max]; //!< Nonzero when the call site is tracked exactly.
+  uint8_t heavy_frame_count[sketch_heavy_max];  //!< The number of frames in heavy_frames.
+  void* heavy_frames[sketch_heavy_max][sketch_frames_max];      //!< The first frames of the backtrace of the call site.
+};
+
+//! @brief Abbreviation for struct Sketch.
+typedef struct Sketch Sketch;
+
+//! @brief A heavy hitter, as returned by sketch_top.
+struct SketchRow {
+  uint64_t hash;                                //!< The hash of the backtrace.
+  uint64_t surviving;                           //!< Estimated number of surviving allocations; an upper bound.
+  uint64_t surviving_bytes;                     //!< Estimated size of the surviving allocations; an upper bound.
+  uint64_t allocations;                         //!< Number of allocations; an upper bound.
+  uint64_t allocations_error;                   //!< The maximum overestimation of allocations.
+  int materialized;                             //!< Nonzero when the call site is tracked exactly now.
+  int frame_count;                              //!< The number of frames in frames.
+  void* frames[sketch_frames_max];              //!< The first frames of the backtrace.
+};
+
+//! @brief Abbreviation for struct SketchRow.
+typedef struct SketchRow SketchRow;
+
+//! @brief Return the hash of a backtrace of FRAME_COUNT frames. Never returns 0.
+static inline uint64_t sketch_hash(void* const* frames, int frame_count)
+{
+  uint64_t hash = frame_count;
+  for (int i = 0; i < frame_count; ++i)
+  {
+    hash ^= (uintptr_t)frames[i];
+    hash *= 0xbf58476d1ce4e5b9UL;
+    hash ^= hash >> 31;
+  }
+  return hash | 1;
+}
+
+//! @brief Add an allocation of SIZE bytes by call site HASH, with backtrace FRAMES. Returns nonzero, without adding it, when the call site is materialized.
+int sketch_alloc(Sketch* sketch, uint64_t hash, void* const* frames, int frame_count, size_t size);
+
+//! @brief Remove an allocation of SIZE bytes by call site HASH.
+void sketch_free(Sketch* sketch, uint64_t hash, size_t size);
+
+//! @brief Copy the heavy hitters to ROWS (sketch_heavy_max elements). Returns the number of rows.
+int sketch_top(Sketch const* sketch, SketchRow* rows);
+
+//! @brief Sort COUNT ROWS on decreasing estimated surviving bytes. Might allocate memory.
+void sketch_sort(SketchRow* rows, int count);
+
+//! @brief Return the maximum overestimation of surviving allocations (when BYTES is zero) or bytes.
+uint64_t sketch_error(Sketch const* sketch, int bytes);
+
+//! @brief Forget the heavy hitters; the counters are kept, because the allocations are still alive.
+void sketch_reset(Sketch* sketch);
+
+#endif // SKETCH_H
@@ -0,0 +1,112 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file suppress.h Suppression rules, compiled into a set of address ranges.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SUPPRESS_H
+#define SUPPRESS_H
+
+#include <stdint.h>
+
+//! @brief Maximum number of suppression rules.
+#define suppress_rules_max 64
+
+//! @brief Up to this many ranges are tested all at once, instead of with a binary search.
+#define suppress_linear_max 16
+
+//! @brief The kinds of suppression rules.
+enum SuppressKind {
+  suppress_module,                              //!< All code of the modules whose path matches.
+  suppress_function,                            //!< The functions whose (demangled) name matches.
+  suppress_file                                 //!< The functions defined in a source file whose name matches.
+};
+
+//! @brief Compiled suppression rules.
+//
+// The address ranges of all code that matches one of the rules, sorted and
+// without overlap. Range i is [begin[i], begin[i] + size[i]).
+struct SuppressSet {
+  int count;                                    //!< The number of ranges.
+  uintptr_t* begin;                             //!< The start of each range.
+  uintptr_t* size;                              //!< The size of each range.
+};
+
+//! @brief Abbreviation for struct SuppressSet.
+typedef struct SuppressSet SuppressSet;
+
+//! @brief Add the rule RULE: "module PATTERN", "function PATTERN" or "file PATTERN". Returns 0 on success, -1 if the rule is invalid.
+//
+// PATTERN is a shell wildcard pattern (see fnmatch(3)). Module and file patterns
+// without a '/' are matched against the last path component only.
+int suppress_add(char const* rule);
+
+//! @brief Remove all rules.
+void suppress_clear();
+
+//! @brief Return the number of rules.
+int suppress_rule_count();
+
+//! @brief Return the text of rule INDEX, and the number of address ranges that it matched the last time the rules were compiled.
+char const* suppress_rule(int index, int* ranges);
+
+//! @brief Resolve the rules against the modules found by addr2line_init. Returns NULL when there are no rules.
+SuppressSet* suppress_compile();
+
+//! @brief Free a set returned by suppress_compile.
+void suppress_free(SuppressSet* set);
+
+//! @brief Return nonzero if one of the FRAME_COUNT frames in FRAMES lies in SET.
+static inline int suppress_match(SuppressSet const* set, void* const* frames, int frame_count)
+{
+  uintptr_t const* begin = set->begin;
+  uintptr_t const* size = set->size;
+  int count = set->count;
+  for (int f = 0; f < frame_count; ++f)
+  {
+    uintptr_t pc = (uintptr_t)frames[f];
+    if (count <= suppress_linear_max)
+    {
+      // The subtraction wraps around for pc < begin[i]; this loop has no branches and is vectorized.
+      int hit = 0;
+      for (int i = 0; i < count; ++i)
+        hit |= pc - begin[i] < size[i];
+      if (hit)
+        return 1;
+    }
+    else
+    {
+      // Find the last range that starts at or before pc, without branches in the loop.
+      uintptr_t const* base = begin;
+      int n = count;
+      while (n > 1)
+      {
+        int half = n / 2;
+        base = base[half] <= pc ? base + half : base;
+        n -= half;
+      }
+      if (pc - *base < size[base - begin])
+        return 1;
+    }
+  }
+  return 0;
+}
+
+#endif // SUPPRESS_H
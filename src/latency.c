@@ -0,0 +1,86 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file latency.c Latency histograms of the calls to the real allocator.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include "latency.h"
+#include "BacktraceEntry.h"
+
+int latency_enabled;
+uint64_t latency_histograms[latency_ops][latency_buckets];
+
+static char const* latency_names[] = { "malloc", "calloc", "realloc", "memalign", "free", "overhead" };
+
+// The calibration of the ticks against CLOCK_MONOTONIC.
+static uint64_t calibration_ticks;
+static uint64_t calibration_ns;
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void latency_enable(int on)
+{
+  if (on && !calibration_ns)
+  {
+    calibration_ticks = latency_now();
+    calibration_ns = monotonic_ns();
+  }
+  latency_enabled = on;
+}
+
+void latency_reset(BacktraceEntry* first)
+{
+  memset(latency_histograms, 0, sizeof(latency_histograms));
+  for (BacktraceEntry* entry = first; entry; entry = entry->next)
+  {
+    memset(entry->alloc_latency, 0, sizeof(entry->alloc_latency));
+    memset(entry->free_latency, 0, sizeof(entry->free_latency));
+  }
+}
+
+void latency_record(int op, BacktraceEntry* entry, uint64_t ticks, uint64_t overhead)
+{
+  int bucket = latency_bucket(ticks);
+  __atomic_fetch_add(&latency_histograms[op][bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency_histograms[latency_overhead][latency_bucket(overhead)], 1, __ATOMIC_RELAXED);
+  if (entry)
+    __atomic_fetch_add(op == latency_free ? &entry->free_latency[bucket] : &entry->alloc_latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+double latency_tick_ns()
+{
+  uint64_t ticks = latency_now() - calibration_ticks;
+  uint64_t ns = monotonic_ns() - calibration_ns;
+  if (!calibration_ns || !ticks || ns < 1000000)
+    return 1.0;         // Not calibrated yet; assume one tick per nanosecond.
+  return (double)ns / ticks;
+}
+
+char const* latency_name(int op)
+{
+  return latency_names[op];
+}
@@ -32,16 +32,37 @@
 #include <execinfo.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdint.h>
 #include <math.h>
 #include <ctype.h>
 #include <linux/limits.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
 
 #include "addr2line.h"
 #include "sort.h"
+#include "output.h"
+#include "format.h"
+#include "BacktraceDB.h"
+#include "Trace.h"
+#include "Protocol.h"
+#include "SharedStats.h"
+#include "Snapshot.h"
+#include "churn.h"
+#include "latency.h"
+#include "scan.h"
+#include "suppress.h"
+#include "sketch.h"
+#include "memleak.h"
 
 static void* malloc_bootstrap1(size_t size);
 static void* calloc_bootstrap1(size_t nmemb, size_t size);
@@ -52,6 +73,8 @@ static void init();
 
 #undef assert
 
+#ifdef DEBUG
+
 static void my_write(int fd, char const* ptr, size_t len)
 {
   while (len > 0)
@@ -70,8 +93,6 @@ static void my_write(int fd, char const* ptr, size_t len)
   }
 }
 
-#ifdef DEBUG
-
 #undef DEBUG_EXPENSIVE
 #undef DEBUG_PRINT
 
@@ -154,6 +175,7 @@ static void* (*memleak_libc_realloc)(void* ptr, size_t size);
 void (*memleak_libc_free)(void* ptr);
 static void (*libc_free_final)(void* ptr) = (void (*)(void*))0;
 static int (*libc_posix_memalign)(void** memptr, size_t alignment, size_t size) = (int (*)(void**, size_t, size_t))0;
+static size_t (*libc_malloc_usable_size)(void* ptr) = (size_t (*)(void*))0;
 
 //---------------------------------------------------------------------------------------------
 // This is a tiny 'malloc library' that is used while
@@ -165,6 +187,7 @@ static int (*libc_posix_memalign)(void** memptr, size_t alignment, size_t size)
 #define assert_reserve_ptrs_size 6
 static char allocation_heap[5000 + assert_reserve_heap_size];
 static void* allocation_ptrs[10 + assert_reserve_ptrs_size];
+static size_t allocation_sizes[10 + assert_reserve_ptrs_size];
 static unsigned int allocation_counter = 0;
 static char* allocation_ptr = allocation_heap;
 
@@ -181,6 +204,7 @@ static void* malloc_bootstrap2(size_t size)
     assert(allocation_ptr + size <= allocation_heap + sizeof(allocation_heap) - assert_reserve_heap_size);
   }
   void* ptr = allocation_ptr;
+  allocation_sizes[allocation_counter] = size;
   allocation_ptrs[allocation_counter++] = ptr;
   allocation_ptr += size;
   return ptr;
@@ -192,6 +216,7 @@ static void free_bootstrap2(void* ptr)
     if (allocation_ptrs[i] == ptr)
     {
       allocation_ptrs[i] = allocation_ptrs[allocation_counter - 1];
+      allocation_sizes[i] = allocation_sizes[allocation_counter - 1];
       allocation_ptrs[allocation_counter - 1] = NULL;
       if (--allocation_counter == 0 && libc_free_final) // Done?
         memleak_libc_free = libc_free_final;
@@ -200,6 +225,17 @@ static void free_bootstrap2(void* ptr)
   (*libc_free_final)(ptr);
 }
 
+// Return the size of the allocation PTR of the stubs, or 0 when PTR wasn't allocated here.
+static size_t usable_size_bootstrap2(void* ptr)
+{
+  if ((char*)ptr < allocation_heap || (char*)ptr >= allocation_heap + sizeof(allocation_heap))
+    return 0;
+  for (unsigned int i = 0; i < allocation_counter; ++i)
+    if (allocation_ptrs[i] == ptr)
+      return allocation_sizes[i];
+  return 0;
+}
+
 // This appears not to be called by dlopen/dlsym/dlclose, but lets keep it anyway.
 static void* calloc_bootstrap2(size_t nmemb, size_t size)
 {
@@ -247,6 +283,8 @@ static void init_malloc_function_pointers()
   memleak_libc_realloc = libc_realloc_tmp;
   libc_posix_memalign = (int (*)(void**, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
   assert(libc_posix_memalign);
+  libc_malloc_usable_size = (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+  assert(libc_malloc_usable_size);
   if (allocation_counter == 0)  // Done?
     memleak_libc_free = libc_free_tmp;
   else
@@ -283,6 +321,14 @@ struct Stats {
   time_t oldest_interval_end;
   int recording;
   int max_backtraces;
+  int scorer;
+  double trend_half_life;
+  ChurnTop churn;
+  size_t entries;
+  size_t sized_delete_mismatches;
+  int sized_delete_backtrace_nr;
+  size_t sized_delete_allocated;
+  size_t sized_delete_deleted;
   struct BacktraceEntry* first_entry;
   struct BacktraceEntry* first_entry_n;
 };
@@ -292,6 +338,56 @@ typedef struct Stats Stats;
 static Stats stats;
 static time_t application_start;
 
+//---------------------------------------------------------------------------------------------
+// Marks
+
+#define MARKS_MAX 1024
+#define MARK_NAME_MAX 64
+
+// A logical point in the execution of the application (see memleak_mark).
+struct Mark {
+  time_t time;                                  // Seconds since application start.
+  char name[MARK_NAME_MAX];
+};
+
+static struct Mark marks[MARKS_MAX + 1];        // marks[N] is mark N; protected by memleak_mutex.
+static uint32_t mark_epoch;                     // The number of the last mark; stored in every Header.
+
+//---------------------------------------------------------------------------------------------
+// Threads
+
+#define THREADS_MAX 4096
+
+// A thread that allocated memory while threads were tracked. Protected by memleak_mutex.
+struct ThreadInfo {
+  pid_t tid;                                    // The kernel thread ID.
+  size_t allocations;                           // Number of current allocations made by this thread.
+  size_t size;                                  // Total size of those allocations.
+  uint64_t total_allocations;                   // Number of allocations made by this thread.
+  uint64_t frees;                               // Number of allocations of known threads freed by this thread.
+  uint64_t cross_thread_frees;                  // Number of those that were made by another thread.
+};
+
+// threads[0] is unused: index 0 means unknown. All threads beyond THREADS_MAX - 1 share the last one.
+static struct ThreadInfo threads[THREADS_MAX];
+static int threads_used = 1;
+static int thread_tracking;                     // Nonzero while the allocating thread is recorded.
+static int thread_sample_rate = 16;             // Record one in this many frees in the thread pairs of the backtrace.
+static __thread uint16_t thread_index;          // The index of the current thread, or 0 if it didn't get one yet.
+static __thread int thread_sample_countdown;
+
+// Return the index of the current thread. Called with memleak_mutex locked.
+static uint16_t current_thread_index()
+{
+  if (!thread_index)
+  {
+    thread_index = threads_used < THREADS_MAX ? threads_used++ : THREADS_MAX - 1;
+    if (!threads[thread_index].tid)
+      threads[thread_index].tid = syscall(SYS_gettid);
+  }
+  return thread_index;
+}
+
 //---------------------------------------------------------------------------------------------
 // Header and Interval
 
@@ -300,24 +396,11 @@ static time_t application_start;
 
 static time_t interval_start;
 
-void interval_print(Interval const* interval)
-{
-  printf("[%4lu,", interval->start);
-  if (interval->end)
-    printf("%4lu>(%4lu)", interval->end, interval->end - interval->start);
-  else
-    printf("now");
-  printf(": %5lu allocations (%6lu total, %4.1f%%), size %7lu; %6.2f allocations/s, %lu bytes/s\n",
-      interval->n, interval->total_n, (100.0 * interval->n / interval->total_n), interval->size,
-      (double)interval->n / (interval->end - interval->start),
-      interval->size / (interval->end - interval->start));
-}
-
 #ifdef DEBUG_EXPENSIVE
 static void check_backtrace_headers(struct BacktraceEntry* entry);
 static void check_interval_headers(struct BacktraceEntry* entry);
 static void check_intervals(BacktraceEntry* entry);
-static void check_interval_first(struct Interval* interval);
+static void check_interval_first(struct BacktraceEntry* entry, struct Interval* interval);
 #endif
 
 //---------------------------------------------------------------------------------------------
@@ -327,176 +410,66 @@ static void check_interval_first(struct Interval* interval);
 #define LIKELY(x) __builtin_expect(!!(x), 1)
 
 #include "BacktraceEntry.h"
+#include "interval.hc"
 
-static void interval_link(BacktraceEntry* entry, Interval* interval)
-{
-  interval->prev = NULL;
-  if ((interval->next = entry->intervals))
-    interval->next->prev = interval;
-  entry->intervals = interval;
-}
+static BacktraceEntry* hashtable[0x100000];
 
-static void interval_unlink(BacktraceEntry* entry, Interval* interval)
-{
-  if (interval->prev)
-    interval->prev->next = interval->next;
-  else
-    entry->intervals = interval->next;
-  if (interval->next)
-    interval->next->prev = interval->prev;
-}
+// Allocations are linked into the list of their backtrace, so that they can be listed oldest
+// first, snapshotted and scanned. That costs two extra cache misses per free, so after
+// "lists suspects" only the allocations of suspects (the backtraces that ranked in the top in
+// memleak_stats) are linked; the others are only counted. Protected by memleak_mutex.
+static int link_all = 1;                        // Nonzero when new backtraces link their allocations.
+static uint16_t recording_generation = 1;       // Incremented when all intervals are deleted; never 0.
 
-static void interval_add(Interval* interval, Header* header)
+// Metadata.
+//
+// A BacktraceEntry without allocations, intervals or other references is dead. memleak_stats
+// unlinks dead entries from the hash table and the lists and moves them to the graveyard; they are
+// only freed by the next call, because the monitor thread walks the list without holding the lock.
+// Code that uses entries without the lock for longer than that (a timed free, see latency.h, after
+// del(); a snapshot) pins the entries first: while any entries are pinned, none are reclaimed.
+// When the entries would take more than metadata_max bytes, no new entries are made: allocations
+// with a new backtrace are all added to a single one, whose only frame is other_allocations.
+static size_t metadata_max;                     // The maximum size of all entries in bytes, or 0 for no limit.
+static int reclaim = 1;                         // Nonzero when dead entries are reclaimed.
+static BacktraceEntry* graveyard;               // The entries reclaimed by the last call to memleak_stats, linked by hashnext.
+static size_t reclaimed_entries;                // The number of entries that were reclaimed.
+static size_t folded_allocations;               // The number of allocations that were added to the other backtrace.
+static int entry_pins;                          // The number of threads that use entries without the lock. Atomic.
+
+// Keep all entries that aren't dead now from being freed until unpin_entries.
+static inline void pin_entries()
 {
-  assert(stats.recording);
-  assert(header->time >= interval->start && (interval->end == 0 || header->time < interval->end));
-  if (interval->n == 0)
-  {
-    assert(interval->first == NULL);
-    interval->first = header;
-#ifdef DEBUG_VERBOSE
-    printf("Backtrace: %p: interval [%lu - %lu>(%lu); added first = header = %p[%lu] (header->prev = %p; &header->backtrace->head = %p)\n",
-    	header->backtrace, interval->start, interval->end, interval->end - interval->start, header, header->time, header->prev, &header->backtrace->head);
-#endif
-    assert(header->next == &header->backtrace->head || header->next->time < interval->start);
-  }
-#ifdef DEBUG_VERBOSE
-  else
-  {
-    printf("Backtrace: %p: interval [%lu - %lu>(%lu); interval->n = %lu; added header %p[%lu] (&header->backtrace->head = %p",
-    	header->backtrace, interval->start, interval->end, interval->end - interval->start, interval->n + 1, header, header->time, &header->backtrace->head);
-    Header* h = interval->first;
-    int cnt = 0;
-    for(;;)
-    { 
-      printf("; first");
-      if (cnt > 0)
-	printf("->prev");
-      if (cnt > 1)
-	printf("(x%d)", cnt);
-      printf(" = %p", h);
-      if (h == &header->backtrace->head)
-	break;
-      printf("[%lu]", h->time);
-      h = h->prev;
-      ++cnt;
-    }
-    printf(")\n");
-  }
-#endif
-  interval->total_n += 1;
-  interval->n += 1;
-  interval->size += header->size;
-  header->interval = interval;
+  __atomic_fetch_add(&entry_pins, 1, __ATOMIC_SEQ_CST);
 }
 
-static void interval_del(Interval* interval, Header* header, time_t life_time __attribute__((unused)))
+static inline void unpin_entries()
 {
-  assert(interval->n > 0);
-  interval->n -= 1;
-#ifdef DEBUG_VERBOSE
-  printf("Backtrace %p: deleting header %p; interval->n is now %lu; &header->backtrace->head = %p; interval->first = %p\n", header->backtrace, header, interval->n, &header->backtrace->head, interval->first);
-  Header* h = interval->first;
-  int cnt = 0;
-  for(;;)
-  {
-    printf("; first");
-    if (cnt > 0)
-      printf("->prev");
-    if (cnt > 1)
-      printf("(x%d)", cnt);
-    printf(" = %p", h);
-    if (h == &header->backtrace->head)
-      break;
-    h = h->prev;
-    ++cnt;
-  }
-#endif
-  interval->size -= header->size;
-  if (interval->first == header)
-  {
-    interval->first = header->prev;
-#ifdef DEBUG_VERBOSE
-    printf("  interval->first == header; setting 'first' to %p\n", interval->first);
-#endif
-  }
-  if (interval->n == 0)
-  {
-    assert(interval->first == &header->backtrace->head || !interval->first->interval || interval->first->interval->start > header->time);
-#ifdef DEBUG_VERBOSE
-    printf("  interval->n == 0; setting 'first' to NULL\n");
-#endif
-    interval->first = NULL;
-    if (interval->end)
-    {
-      interval_unlink(header->backtrace, interval);
-      if (header->backtrace->recording_interval == interval)
-	header->backtrace->recording_interval = NULL;
-      (*memleak_libc_free)(interval);
-    }
-  }
+  __atomic_fetch_sub(&entry_pins, 1, __ATOMIC_SEQ_CST);
 }
 
-// Combine this interval with the one that comes after it.
-static void interval_combine(BacktraceEntry* entry, Interval* interval)
+// The frame of the backtrace of all allocations that didn't get a backtrace of their own.
+static void __attribute__((noinline)) other_allocations()
 {
-#ifdef DEBUG_EXPENSIVE
-  check_interval_first(interval);
-#endif
-
-  assert(interval && interval->prev);
-  assert(interval->end);
-  assert(interval->prev->start == interval->end);
-#ifdef DEBUG_VERBOSE
-  printf("Backtrace #%-2d: Combining [%4lu,%4lu>(%lu) with [%4lu,%4lu>(%lu).\n", entry->backtrace_nr,
-      interval->start, interval->end, interval->end - interval->start,
-      interval->prev->start, interval->prev->end, interval->prev->end - interval->prev->start);
-#endif
-  Interval* delinked_interval = interval->prev;
+  __asm__ volatile ("");
+}
 
-#ifdef DEBUG_EXPENSIVE
-  check_interval_first(delinked_interval);
-  check_intervals(entry);
-#endif
+static void* other_backtrace[1] = { (void*)&other_allocations };
 
-  interval_unlink(entry, delinked_interval);
-  interval->end = delinked_interval->end;
-  interval->total_n += delinked_interval->total_n;
-  interval->n += delinked_interval->n;
-  interval->size += delinked_interval->size;
-  assert((delinked_interval->first == NULL && delinked_interval->n == 0) || (delinked_interval->first != NULL && delinked_interval->n > 0));
-#ifdef DEBUG_EXPENSIVE
-  if (delinked_interval->first && interval->first)
+static inline intptr_t backtrace_hash(void* const* backtrace, int backtrace_size)
+{
+  intptr_t hash = backtrace_size;
+  for (int i = 0; i < backtrace_size; ++i)
   {
-    Header* header = interval->first;
-    while (header->interval == interval)
-      header = header->prev;
-    assert(header->interval == delinked_interval);
-    assert(delinked_interval->first == header);
+    intptr_t sp = (intptr_t)backtrace[i];
+    hash += sp;
   }
-#endif
-
-  if (delinked_interval->first)
-    // Use the fact that BacktraceEntry::head.interval == NULL.
-    for (Header* header = delinked_interval->first; header->interval == delinked_interval; header = header->prev)
-      header->interval = interval;
-  if (!interval->first)
-    interval->first = delinked_interval->first;
-
-#ifdef DEBUG_EXPENSIVE
-  check_interval_first(interval);
-  check_intervals(entry);
-#endif
-
-  // Only combine when there are three the same, so this is never at the top.
-  assert(entry->recording_interval != delinked_interval);
-  assert(entry->intervals != delinked_interval);
-
-  (*memleak_libc_free)(delinked_interval);
+  hash *= hash;
+  hash >>= 8;
+  hash &= 0xfffff;
+  return hash;
 }
 
-static BacktraceEntry* hashtable[0x100000];
-
 static int equal(BacktraceEntry* bp, void** backtrace, int backtrace_size)
 {
   if (UNLIKELY(bp->backtrace_size != backtrace_size))
@@ -509,15 +482,7 @@ static int equal(BacktraceEntry* bp, void** backtrace, int backtrace_size)
 
 static BacktraceEntry* update_entry_add(void** backtrace, int backtrace_size)
 {
-  intptr_t hash = backtrace_size;
-  for (int i = 0; i < backtrace_size; ++i)
-  {
-    intptr_t sp = (intptr_t)backtrace[i];
-    hash += sp;
-  }
-  hash *= hash;
-  hash >>= 8;
-  hash &= 0xfffff;
+  intptr_t hash = backtrace_hash(backtrace, backtrace_size);
   BacktraceEntry* bp;
   BacktraceEntry** bpp;
   static int depth;
@@ -531,6 +496,11 @@ static BacktraceEntry* update_entry_add(void** backtrace, int backtrace_size)
     }
     if (UNLIKELY(!(bp = *bpp)))
     {
+      if (UNLIKELY(metadata_max) && (stats.entries + 1) * sizeof(BacktraceEntry) > metadata_max && backtrace != other_backtrace)
+      {
+        ++folded_allocations;
+        return update_entry_add(other_backtrace, 1);
+      }
       bp = *bpp = (*memleak_libc_calloc)(sizeof(BacktraceEntry), 1);
       memcpy(bp->ptr, backtrace, backtrace_size * sizeof(void*));
       bp->backtrace_size = backtrace_size;
@@ -541,6 +511,8 @@ static BacktraceEntry* update_entry_add(void** backtrace, int backtrace_size)
       bp->backtrace_nr = ++stats.backtraces;
       bp->head.prev = &bp->head;
       bp->head.next= &bp->head;
+      bp->linked = link_all;
+      ++stats.entries;
       break;
     }
     else if (LIKELY(equal(bp, backtrace, backtrace_size)))
@@ -550,81 +522,139 @@ static BacktraceEntry* update_entry_add(void** backtrace, int backtrace_size)
   return bp;
 }
 
-static void update_interval_add(Header* header)
+static void update_entry_del(Header* header)
 {
   BacktraceEntry* bp = header->backtrace;
-  Interval* interval = bp->recording_interval;
-  if (stats.recording && !interval)
+  assert(bp->allocations > 0);
+  --(bp->allocations);
+}
+
+// Return nonzero if nothing refers to ENTRY anymore.
+// An entry that subscribers still know about is kept until the next delta told them it was removed.
+static inline int entry_is_dead(BacktraceEntry* entry)
+{
+  return entry->allocations == 0 && !entry->intervals && !entry->recording_interval &&
+      !entry->churn.rank && (entry->printed || !entry->need_printing) && !entry->published;
+}
+
+// Move the dead entries to the graveyard and return the previous graveyard, whose entries can be freed now.
+// Must be called with memleak_mutex locked, after the new backtraces were passed to the backtrace database.
+static BacktraceEntry* reclaim_entries()
+{
+  BacktraceEntry* previous = graveyard;
+  graveyard = NULL;
+  // The entries of the previous graveyard were dead before any of the pins were taken, so nobody uses them.
+  if (!reclaim || __atomic_load_n(&entry_pins, __ATOMIC_SEQ_CST))
+    return previous;
+  for (BacktraceEntry** entry_ptr = &stats.first_entry; *entry_ptr;)
   {
-#if 0
-    if (bp->intervals && header->time < bp->intervals->end)
-      interval = bp->recording_interval = bp->intervals;
-    else
-#endif
-    {
-      interval = bp->recording_interval = (*memleak_libc_calloc)(1, sizeof(Interval));
-      interval_link(bp, interval);
-    }
-    interval->start = interval_start;
-    // Pick up all allocations already done in the last second, before recording started.
-    Header* h = bp->head.next->next;
-    while (h != &bp->head && h->time == interval_start)
-      h = h->next;
-    h = h->prev;
-    while (h != header)
+    BacktraceEntry* entry = *entry_ptr;
+    if (LIKELY(!entry_is_dead(entry)))
     {
-      interval_add(interval, h);
-      h = h->prev;
+      entry_ptr = &entry->next;
+      continue;
     }
+    // Leave entry->next alone: a walk over the list that didn't lock memleak_mutex can be at this entry.
+    *entry_ptr = entry->next;
+    BacktraceEntry** bpp = &hashtable[backtrace_hash(entry->ptr, entry->backtrace_size)];
+    while (*bpp != entry)
+      bpp = &(*bpp)->hashnext;
+    *bpp = entry->hashnext;
+    entry->hashnext = graveyard;
+    graveyard = entry;
+    --stats.entries;
+    ++reclaimed_entries;
   }
-  // interval_start can be one second larger than now (when restarting recording) because we
-  // never want to have overlapping intervals. If that is the case then we need to record
-  // this allocation in the previous interval.
-  while (interval && header->time < interval->start)
-    interval = interval->next;
-  if (interval && (interval->end == 0 || header->time < interval->end))
-    interval_add(interval, header);
-  else if (interval && stats.recording)
+  // Nothing changed since the first loop, so the same entries are dead.
+  for (BacktraceEntry** entry_ptr = &stats.first_entry_n; *entry_ptr;)
   {
-    // If we are recording, but still didn't record this allocation
-    // then that means that the new interval didn't start yet but
-    // the previous interval ended before now: there is a gap between
-    // the intervals because no allocation was made for some time.
-    assert(interval->end && header->time >= interval->end);
-    interval = interval->prev;
-    assert(interval && header->time < interval->start);
-    assert(interval->start - header->time == 1);
-    interval->start = header->time;
-    interval_add(interval, header);
+    if (UNLIKELY(entry_is_dead(*entry_ptr)))
+      *entry_ptr = (*entry_ptr)->next_n;
+    else
+      entry_ptr = &(*entry_ptr)->next_n;
   }
+  return previous;
 }
 
-static void update_entry_del(Header* header)
+// Return the interval of ENTRY that an allocation made at TIME was counted in, or NULL.
+// Intervals never overlap; they are combined or deleted without visiting allocations that
+// aren't linked, so those find their interval back by time.
+static Interval* interval_at(BacktraceEntry* entry, time_t time)
 {
-  BacktraceEntry* bp = header->backtrace;
-  assert(bp->allocations > 0);
-  --(bp->allocations);
+  for (Interval* interval = entry->intervals; interval; interval = interval->next)
+    if (time >= interval->start && (interval->end == 0 || time < interval->end))
+      return interval->n > 0 ? interval : NULL;
+  return NULL;
+}
+
+// Shallow backtraces.
+//
+// When backtrace_depth is less than backtrace_size_max, the hooks only take that many frames.
+// Backtraces that were cut short like that and that rank among the top max_backtraces in
+// memleak_stats become suspects: a hash of their frames is added to suspect_prefixes, and
+// allocations whose first frames match a suspect take a full backtrace again.
+
+#define SUSPECTS_MAX 256                        // Must be a power of two.
+
+static int backtrace_depth = backtrace_size_max;        // The number of frames that the hooks take.
+static uintptr_t suspect_prefixes[SUSPECTS_MAX];        // Hashes of suspect backtraces; 0 is an empty slot. Written with memleak_mutex locked.
+static int suspect_count;                               // The number of used slots in suspect_prefixes. Protected by memleak_mutex.
+static size_t deep_captures;                            // The number of times a full backtrace was taken for a suspect.
+
+static inline uintptr_t prefix_hash(void* const* frames, int depth)
+{
+  uintptr_t hash = depth;
+  for (int i = 0; i < depth; ++i)
+    hash = (hash ^ (uintptr_t)frames[i]) * 0x9e3779b97f4a7c15UL;
+  return hash | 1;
 }
 
-static void update_interval_del(Header* header)
+// Return nonzero if the DEPTH frames in FRAMES are those of a suspect.
+static inline int is_suspect(void* const* frames, int depth)
 {
-  Interval* interval = header->interval;
-  header->interval = NULL;
-  if (interval)
+  uintptr_t hash = prefix_hash(frames, depth);
+  for (unsigned int i = hash;; ++i)
   {
-    assert(stats.recording || interval->end != 0);
-    assert((interval->end == 0 || header->time < interval->end) && header->time >= interval->start);
-    struct timeval tm;
-    gettimeofday(&tm, NULL);
-    interval_del(interval, header, tm.tv_sec - application_start - header->time);
+    uintptr_t slot = __atomic_load_n(&suspect_prefixes[i & (SUSPECTS_MAX - 1)], __ATOMIC_RELAXED);
+    if (slot == hash)
+      return 1;
+    if (slot == 0)
+      return 0;
+  }
+}
+
+// Make ENTRY a suspect if it is a shallow backtrace. Called with memleak_mutex locked.
+static void suspect_add(BacktraceEntry* entry)
+{
+  int depth = backtrace_depth;
+  // Keep at least one slot empty, so that is_suspect terminates.
+  if (entry->backtrace_size != depth || depth == backtrace_size_max || suspect_count == SUSPECTS_MAX - 1)
+    return;
+  uintptr_t hash = prefix_hash(entry->ptr, depth);
+  for (unsigned int i = hash;; ++i)
+  {
+    uintptr_t* slot = &suspect_prefixes[i & (SUSPECTS_MAX - 1)];
+    if (*slot == hash)
+      return;
+    if (*slot == 0)
+    {
+      __atomic_store_n(slot, hash, __ATOMIC_RELAXED);
+      ++suspect_count;
+      return;
+    }
   }
 }
 
 //---------------------------------------------------------------------------------------------
 // Our administration
 
+// Set HEADER_OFFSET to sizeof(Header) rounded up to the nearest multiple of sizeof(void*).
+#define HEADER_OFFSET (((sizeof(Header) - 1) / sizeof(void*) + 1) * sizeof(void*))
+
 static void* const MAGIC_NUMBER = (void*)0x1234FDB90102ACDCUL;
 static void* const MAGIC_MEMLEAK_STATS = (void*)0x12129a9ab91f02a3UL;
+static void* const MAGIC_UNTRACKED = (void*)0x7a11e4ed0b5e7f1dUL;
+static void* const MAGIC_SKETCHED = (void*)0x5e7c4ed0c0a7ed11UL;
 
 static pthread_mutex_t memleak_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -633,7 +663,10 @@ static char exename[256];
 static char* appname;
 
 static void* monitor(void*);
+static void monitor_stats(StatsHeader const* header, StatsRow const* rows, int count);
 static pthread_t monitor_thread;
+static void* writer(void*);
+static pthread_t writer_thread;
 
 static void init()
 {
@@ -652,14 +685,260 @@ static void init()
     appname = exename;
   //printf("exename = \"%s\"\n", exename);
   addr2line_init();
+  output_init(exename, application_start);
+  trace_init(exename, application_start);
+  shared_stats_init(exename, application_start);
+  pthread_create(&writer_thread, NULL, &writer, NULL);
   pthread_create(&monitor_thread, NULL, &monitor, NULL);
   stats.max_backtraces = 4;
+  stats.trend_half_life = 300;
+  stats.churn.limit = 10;
+  churn_reset(&stats.churn, 0);
   if (unsetenv("LD_PRELOAD") == -1)
     fprintf(stderr, "Failed to unset LD_PRELOAD: %s\n", strerror(errno));
 }
 
+//---------------------------------------------------------------------------------------------
+// Filters
+//
+// Allocations that don't pass the filters are not tracked at all: no backtrace is taken and
+// add() isn't called; their Header only contains MAGIC_UNTRACKED and the posix_memalign offset.
+
+#define FILTER_TIDS_MAX 64
+#define FILTER_NAMES_MAX 16
+#define FILTER_RECHECK 1024
+
+struct Filter {
+  size_t min_size;                              // Only track allocations of at least this size...
+  size_t max_size;                              // ... and at most this size.
+  int tid_count;
+  pid_t tids[FILTER_TIDS_MAX];                  // Only track allocations by these threads...
+  int name_count;
+  char names[FILTER_NAMES_MAX][16];             // ... or by threads whose name starts with one of these.
+};
+
+static struct Filter filter = { 0, SIZE_MAX, 0, { 0 }, 0, { { 0 } } };
+static pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;     // Protects the thread sets of filter.
+static int filter_active;                       // Nonzero when any filter is set.
+static int filter_threads;                      // Nonzero when a thread filter is set.
+static int filter_generation = 1;               // Incremented when the thread filter changes.
+static size_t filter_skipped;                   // Number of allocations that were not tracked.
+
+static __thread int thread_filter_generation;   // The filter_generation that thread_filter_match belongs to.
+static __thread int thread_filter_match;        // Nonzero if the current thread passes the thread filter.
+static __thread int thread_filter_countdown;    // Check again after this many allocations, in case the thread was renamed.
+
+// Return nonzero if the current thread passes the thread filter.
+static int filter_match_thread()
+{
+  pid_t tid = syscall(SYS_gettid);
+  char name[16] = { 0 };
+  prctl(PR_GET_NAME, name);
+  int match = 0;
+  pthread_mutex_lock(&filter_mutex);
+  for (int i = 0; i < filter.tid_count && !match; ++i)
+    match = filter.tids[i] == tid;
+  for (int i = 0; i < filter.name_count && !match; ++i)
+    match = strncmp(name, filter.names[i], strlen(filter.names[i])) == 0;
+  pthread_mutex_unlock(&filter_mutex);
+  return match;
+}
+
+// Return nonzero if an allocation of SIZE bytes by the current thread should not be tracked.
+static inline int filtered_out(size_t size)
+{
+  if (LIKELY(!filter_active))
+    return 0;
+  int skip = size < filter.min_size || size > filter.max_size;
+  if (!skip && filter_threads)
+  {
+    int generation = __atomic_load_n(&filter_generation, __ATOMIC_ACQUIRE);
+    if (thread_filter_generation != generation || --thread_filter_countdown <= 0)
+    {
+      thread_filter_match = filter_match_thread();
+      thread_filter_generation = generation;
+      thread_filter_countdown = FILTER_RECHECK;
+    }
+    skip = !thread_filter_match;
+  }
+  if (skip)
+    __atomic_fetch_add(&filter_skipped, 1, __ATOMIC_RELAXED);
+  return skip;
+}
+
+// Mark HEADER as the header of an allocation that isn't tracked.
+static inline void untracked(Header* header, size_t offset)
+{
+  header->posix_memalign_offset = offset;
+  header->magic_number = MAGIC_UNTRACKED;
+}
+
+static void filter_update()
+{
+  filter_threads = filter.tid_count > 0 || filter.name_count > 0;
+  filter_active = filter_threads || filter.min_size > 0 || filter.max_size < SIZE_MAX;
+  __atomic_add_fetch(&filter_generation, 1, __ATOMIC_RELEASE);
+}
+
+// Apply the filter command CMD (the part after "filter "). Writes a reply to REPLY.
+static void filter_command(char const* cmd, char* reply, size_t len)
+{
+  if (strcmp(cmd, "off") == 0)
+  {
+    pthread_mutex_lock(&filter_mutex);
+    filter.min_size = 0;
+    filter.max_size = SIZE_MAX;
+    filter.tid_count = filter.name_count = 0;
+    filter_update();
+    pthread_mutex_unlock(&filter_mutex);
+    snprintf(reply, len, "All allocations are tracked.\n");
+  }
+  else if (strncmp(cmd, "size ", 5) == 0)
+  {
+    unsigned long min_size = 0, max_size = 0;
+    int n = sscanf(cmd + 5, "%lu %lu", &min_size, &max_size);
+    if (n < 1 || (n == 2 && max_size < min_size))
+    {
+      snprintf(reply, len, "Usage: filter size MIN [MAX]\n");
+      return;
+    }
+    pthread_mutex_lock(&filter_mutex);
+    filter.min_size = min_size;
+    filter.max_size = n == 2 ? max_size : SIZE_MAX;
+    filter_update();
+    pthread_mutex_unlock(&filter_mutex);
+    if (n == 2)
+      snprintf(reply, len, "Only tracking allocations of %lu to %lu bytes.\n", min_size, max_size);
+    else
+      snprintf(reply, len, "Only tracking allocations of %lu bytes or more.\n", min_size);
+  }
+  else if (strncmp(cmd, "tid ", 4) == 0)
+  {
+    pid_t tid = atoi(cmd + 4);
+    pthread_mutex_lock(&filter_mutex);
+    int ok = tid > 0 && filter.tid_count < FILTER_TIDS_MAX;
+    if (ok)
+    {
+      filter.tids[filter.tid_count++] = tid;
+      filter_update();
+    }
+    pthread_mutex_unlock(&filter_mutex);
+    if (ok)
+      snprintf(reply, len, "Also tracking the allocations of thread %d.\n", tid);
+    else
+      snprintf(reply, len, "Can't add thread \"%s\" to the filter.\n", cmd + 4);
+  }
+  else if (strncmp(cmd, "name ", 5) == 0)
+  {
+    char const* name = cmd + 5;
+    pthread_mutex_lock(&filter_mutex);
+    int ok = *name && strlen(name) < sizeof(filter.names[0]) && filter.name_count < FILTER_NAMES_MAX;
+    if (ok)
+    {
+      strcpy(filter.names[filter.name_count++], name);
+      filter_update();
+    }
+    pthread_mutex_unlock(&filter_mutex);
+    if (ok)
+      snprintf(reply, len, "Also tracking the allocations of threads whose name starts with \"%s\".\n", name);
+    else
+      snprintf(reply, len, "Can't add the thread name \"%s\" to the filter.\n", name);
+  }
+  else
+    snprintf(reply, len, "Unknown filter \"%s\"; use size MIN [MAX], tid TID, name PREFIX or off.\n", cmd);
+}
+
+//---------------------------------------------------------------------------------------------
+// Suppressions
+//
+// Allocations whose backtrace has a frame in suppressed code are not given a backtrace of their
+// own; they are all added to a single backtrace whose only frame is suppressed_allocations.
+
+static SuppressSet* suppress_set;               // The compiled suppression rules, or NULL. Protected by memleak_mutex.
+static size_t suppressed_total;                 // The number of suppressed allocations. Protected by memleak_mutex.
+
+// The frame of the backtrace of all suppressed allocations, so that it prints as such.
+static void __attribute__((noinline)) suppressed_allocations()
+{
+  __asm__ volatile ("");
+}
+
+static void* suppressed_backtrace[1] = { (void*)&suppressed_allocations };
+
+// Compile the suppression rules and start using them. Returns the number of suppressed address ranges.
+static int suppress_update()
+{
+  // Compile without holding the lock: reading the symbol tables allocates memory.
+  SuppressSet* set = suppress_compile();
+  pthread_mutex_lock(&memleak_mutex);
+  SuppressSet* old = suppress_set;
+  suppress_set = set;
+  pthread_mutex_unlock(&memleak_mutex);
+  suppress_free(old);
+  return set ? set->count : 0;
+}
+
+// Apply the suppress command CMD (the part after "suppress "). Writes a reply to REPLY.
+static void suppress_command(char const* cmd, char* reply, size_t len)
+{
+  if (strcmp(cmd, "off") == 0)
+    suppress_clear();
+  else if (suppress_add(cmd) != 0)
+  {
+    snprintf(reply, len, "Can't add \"%.64s\"; use module PATTERN, function PATTERN, file PATTERN or off.\n", cmd);
+    return;
+  }
+  int ranges = suppress_update();
+  if (suppress_rule_count() == 0)
+    snprintf(reply, len, "No allocations are suppressed.\n");
+  else
+    snprintf(reply, len, "Suppressing allocations from %d address ranges.\n", ranges);
+}
+
+//---------------------------------------------------------------------------------------------
+// Sketch
+//
+// While the sketch is enabled, allocations only get a backtrace when their call site is a heavy
+// hitter of the sketch; all other allocations are only counted in the sketch and get MAGIC_SKETCHED.
+// That keeps the memory used constant, no matter how many different backtraces the application has.
+
+static Sketch sketch;                           // Protected by memleak_mutex.
+
+static void set_sketch(int enabled)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  if (!sketch.threshold)
+    sketch.threshold = 64;
+  if (enabled && !sketch.enabled)
+    sketch_reset(&sketch);
+  sketch.enabled = enabled;
+  pthread_mutex_unlock(&memleak_mutex);
+}
+
 static __thread int inside_memleak_stats = 0;
 
+// Count a sampled free by thread FREE_THREAD of an allocation of thread ALLOC_THREAD in ENTRY.
+// When all slots are taken, the pair with the lowest count is replaced and the new pair
+// inherits its count (the space-saving algorithm), so that frequent pairs are never lost.
+static void thread_pair_add(BacktraceEntry* entry, uint16_t alloc_thread, uint16_t free_thread)
+{
+  ThreadPair* lowest = &entry->thread_pairs[0];
+  for (int i = 0; i < thread_pairs_max; ++i)
+  {
+    ThreadPair* pair = &entry->thread_pairs[i];
+    if (pair->count && pair->alloc_thread == alloc_thread && pair->free_thread == free_thread)
+    {
+      ++pair->count;
+      return;
+    }
+    if (pair->count < lowest->count)
+      lowest = pair;
+  }
+  lowest->alloc_thread = alloc_thread;
+  lowest->free_thread = free_thread;
+  ++lowest->count;
+}
+
 static void add(Header* header, size_t size, void** backtrace, int backtrace_size, size_t offset)
 {
   if (UNLIKELY(inside_memleak_stats))
@@ -672,52 +951,162 @@ static void add(Header* header, size_t size, void** backtrace, int backtrace_siz
   gettimeofday(&tm, NULL);
   header->posix_memalign_offset = offset;
   header->size = size;
+  uint64_t hash = UNLIKELY(sketch.enabled) ? sketch_hash(backtrace, backtrace_size) : 0;
   pthread_mutex_lock(&memleak_mutex);
+  if (UNLIKELY(suppress_set != NULL) && suppress_match(suppress_set, backtrace, backtrace_size))
+  {
+    backtrace = suppressed_backtrace;
+    backtrace_size = 1;
+    ++suppressed_total;
+  }
+  else if (UNLIKELY(hash) && sketch.enabled && !sketch_alloc(&sketch, hash, backtrace, backtrace_size, size))
+  {
+    // Not a heavy hitter (yet); only count it.
+    header->sketch_hash = hash;
+    header->prev = header->next = NULL;
+    header->interval = NULL;
+    header->thread = 0;
+    stats.total_memory += size;
+    ++stats.allocations;
+    header->magic_number = MAGIC_SKETCHED;
+    pthread_mutex_unlock(&memleak_mutex);
+    return;
+  }
   header->backtrace = update_entry_add(backtrace, backtrace_size);
+  header->backtrace->size += size;
+  int sc = size_class(size);
+  ++header->backtrace->live_sizes[sc];
+  // Saturate instead of wrapping around.
+  header->backtrace->total_sizes[sc] += header->backtrace->total_sizes[sc] != UINT32_MAX;
+  churn_alloc(&stats.churn, header->backtrace, size);
 #ifdef DEBUG_EXPENSIVE
   --(header->backtrace->allocations);
   check_intervals(header->backtrace);
   ++(header->backtrace->allocations);
 #endif
-  header->prev = &header->backtrace->head;
-  header->next = header->backtrace->head.next;
-  header->prev->next = header->next->prev = header;
+  if (LIKELY(header->backtrace->linked))
+  {
+    header->prev = &header->backtrace->head;
+    header->next = header->backtrace->head.next;
+    header->prev->next = header->next->prev = header;
+  }
+  else
+  {
+    header->prev = header->next = NULL;
+    ++header->backtrace->unlinked;
+  }
   stats.total_memory += size;
   ++stats.allocations;
   header->interval = NULL;
   header->time = tm.tv_sec - application_start;
+  header->epoch = mark_epoch;
+  header->thread = 0;
+  if (UNLIKELY(thread_tracking))
+  {
+    struct ThreadInfo* thread = &threads[header->thread = current_thread_index()];
+    ++thread->allocations;
+    thread->size += size;
+    ++thread->total_allocations;
+  }
   header->magic_number = MAGIC_NUMBER;
 #ifdef DEBUG_EXPENSIVE
   check_backtrace_headers(header->backtrace);
 #endif
   update_interval_add(header);
+  if (UNLIKELY(!header->prev))
+  {
+    // The interval can be freed without visiting this allocation; see interval_at.
+    header->recording = header->interval ? recording_generation : 0;
+    header->interval = NULL;
+  }
 #ifdef DEBUG_EXPENSIVE
   check_interval_headers(header->backtrace);
   check_intervals(header->backtrace);
 #endif
+  // Take the time stamp while holding the lock, so that a free by another thread can't get an earlier one.
+  int trace = trace_enabled;
+  uint64_t trace_time = UNLIKELY(trace) ? trace_now() : 0;
   pthread_mutex_unlock(&memleak_mutex);
+  if (UNLIKELY(trace))
+    trace_record_alloc((char*)header + HEADER_OFFSET, size, header->backtrace->backtrace_nr, trace_time);
 }
 
-static void del(Header* header)
+// The SIZE that is passed to del when the caller doesn't know the size of the allocation.
+#define NOT_SIZED SIZE_MAX
+
+// HEADER is freed. SIZE is the size given to a sized operator delete, or NOT_SIZED.
+static void del(Header* header, size_t size)
 {
-  if (UNLIKELY(header->magic_number == MAGIC_MEMLEAK_STATS))
+  if (UNLIKELY(header->magic_number == MAGIC_MEMLEAK_STATS || header->magic_number == MAGIC_UNTRACKED))
   {
     header->magic_number = (void*)0xf3ee;
     return;
   }
+  if (UNLIKELY(header->magic_number == MAGIC_SKETCHED))
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    sketch_free(&sketch, header->sketch_hash, header->size);
+    stats.total_memory -= header->size;
+    --stats.allocations;
+    header->magic_number = (void*)0x1111fbee;
+    pthread_mutex_unlock(&memleak_mutex);
+    return;
+  }
   assert(header->magic_number == MAGIC_NUMBER);
+  // Only seconds are needed, for the lifetime of the allocation.
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
   pthread_mutex_lock(&memleak_mutex);
 #ifdef DEBUG_EXPENSIVE
   check_intervals(header->backtrace);
   check_backtrace_headers(header->backtrace);
 #endif
   header->magic_number = (void*)0x123;
-  update_interval_del(header);
+  if (UNLIKELY(size != NOT_SIZED) && UNLIKELY(size != (size_t)header->size))
+  {
+    // Reported by memleak_stats.
+    ++stats.sized_delete_mismatches;
+    stats.sized_delete_backtrace_nr = header->backtrace->backtrace_nr;
+    stats.sized_delete_allocated = header->size;
+    stats.sized_delete_deleted = size;
+  }
+  if (UNLIKELY(!header->prev) && header->recording == recording_generation)
+    header->interval = interval_at(header->backtrace, header->time);
+  update_interval_del(header, ts.tv_sec - application_start);
   stats.total_memory -= header->size;
   --stats.allocations;
-  header->prev->next = header->next;
-  header->next->prev = header->prev;
+  if (LIKELY(header->prev != NULL))
+  {
+    header->prev->next = header->next;
+    header->next->prev = header->prev;
+  }
+  else
+    --header->backtrace->unlinked;
   update_entry_del(header);
+  header->backtrace->size -= header->size;
+  --header->backtrace->live_sizes[size_class(header->size)];
+  churn_free(&stats.churn, header->backtrace);
+  if (UNLIKELY(header->thread))
+  {
+    // Also when tracking was turned off since, to keep the live counts right.
+    struct ThreadInfo* owner = &threads[header->thread];
+    --owner->allocations;
+    owner->size -= header->size;
+    if (thread_tracking)
+    {
+      uint16_t self = current_thread_index();
+      int cross = self != header->thread;
+      ++threads[self].frees;
+      threads[self].cross_thread_frees += cross;
+      ++header->backtrace->thread_frees;
+      header->backtrace->cross_thread_frees += cross;
+      if (--thread_sample_countdown <= 0)
+      {
+        thread_sample_countdown = thread_sample_rate;
+        thread_pair_add(header->backtrace, header->thread, self);
+      }
+    }
+  }
 #ifdef DEBUG_EXPENSIVE
   check_interval_headers(header->backtrace);
 #endif
@@ -725,44 +1114,250 @@ static void del(Header* header)
 #ifdef DEBUG_EXPENSIVE
   check_intervals(header->backtrace);
 #endif
+  int trace = trace_enabled;
+  uint64_t trace_time = UNLIKELY(trace) ? trace_now() : 0;
   pthread_mutex_unlock(&memleak_mutex);
+  if (UNLIKELY(trace))
+    trace_record_free((char*)header + HEADER_OFFSET, trace_time);
   return;
 }
 
-struct memleak_stats_helper {
-  BacktraceEntry* entry;
-  Interval interval;
-};
+// Return the backtrace of the allocation with header HEADER, or NULL if it has none.
+static inline BacktraceEntry* latency_entry(void* header)
+{
+  return ((Header*)header)->magic_number == MAGIC_NUMBER ? ((Header*)header)->backtrace : NULL;
+}
 
-typedef struct memleak_stats_helper memleak_stats_helper;
-
-time_t interval_class(time_t interval)
-{
-  time_t v = interval;
-  v >>= 1;
-  v += interval;
-  v >>= 1;
-  v |= v >> 1;
-  v |= v >> 2;
-  v |= v >> 4;
-  v |= v >> 8;
-  v |= v >> 16;
-#if SIZEOF_TIME_T == 8
-  v |= v >> 32;
-#endif
-  ++v;
-  return v;
+// Copy the totals and the first SHARED_STATS_TOP backtraces of LOCAL_STATS to the shared memory segment.
+// Called with memleak_mutex locked.
+static void shared_stats_update(Stats const* local_stats, time_t now, size_t total_intervals, struct timespec const* started)
+{
+  SharedStats* shared = shared_stats_begin();
+  if (!shared)
+    return;
+  shared->now = now;
+  shared->recording = stats.recording;
+  shared->backtraces = local_stats->backtraces;
+  shared->allocations = local_stats->allocations;
+  shared->total_memory = local_stats->total_memory;
+  shared->intervals = total_intervals;
+  shared->header_bytes = local_stats->allocations * HEADER_OFFSET;
+  shared->backtrace_bytes = sizeof(hashtable) + local_stats->entries * sizeof(BacktraceEntry);
+  shared->interval_bytes = total_intervals * sizeof(Interval);
+  uint32_t count = 0;
+  for(BacktraceEntry* entry = local_stats->first_entry_n; entry && count < SHARED_STATS_TOP; entry = entry->next_n)
+  {
+    if (!entry->intervals)
+      continue;
+    SharedStatsEntry* se = &shared->entries[count++];
+    se->backtrace_nr = entry->backtrace_nr;
+    se->value_n = entry->value_n;
+    se->allocations = entry->allocations;
+    uint32_t n = 0;
+    for (Interval* interval = entry->intervals; interval && n < SHARED_STATS_INTERVALS; interval = interval->next, ++n)
+    {
+      se->intervals[n].start = interval->start;
+      se->intervals[n].end = interval->end;
+      se->intervals[n].total_n = interval->total_n;
+      se->intervals[n].n = interval->n;
+      se->intervals[n].size = interval->size;
+    }
+    se->interval_count = n;
+  }
+  shared->entry_count = count;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  shared->update_ns = (ts.tv_sec - started->tv_sec) * 1000000000L + ts.tv_nsec - started->tv_nsec;
+  shared_stats_end();
+}
+
+// Return a copy of the raw frames of all backtraces that were created since the last call, oldest first.
+// Must be called with memleak_mutex locked.
+static BacktraceRecord* new_backtrace_records(int* count)
+{
+  static int recorded_backtraces = 0;
+  int new_records = stats.backtraces - recorded_backtraces;
+  *count = new_records;
+  if (new_records <= 0)
+    return NULL;
+  BacktraceRecord* records = (*memleak_libc_malloc)(new_records * sizeof(BacktraceRecord));
+  memset(records, 0, new_records * sizeof(BacktraceRecord));
+  // The list starts with the most recently created BacktraceEntry.
+  for(BacktraceEntry* entry = stats.first_entry; entry && entry->backtrace_nr > recorded_backtraces; entry = entry->next)
+  {
+    BacktraceRecord* record = &records[entry->backtrace_nr - recorded_backtraces - 1];
+    record->backtrace_nr = entry->backtrace_nr;
+    record->frames = entry->backtrace_size;
+    record->strings = 0;
+    for (int f = 0; f < entry->backtrace_size; ++f)
+      record->pc[f] = (uintptr_t)entry->ptr[f];
+  }
+  recorded_backtraces = stats.backtraces;
+  return records;
+}
+
+// Add new backtraces to the backtrace database, without printing stats.
+void memleak_sync_backtraces()
+{
+  int was_inside_memleak_stats = inside_memleak_stats;
+  inside_memleak_stats = 1;
+  int new_records;
+  pthread_mutex_lock(&memleak_mutex);
+  BacktraceRecord* records = new_backtrace_records(&new_records);
+  pthread_mutex_unlock(&memleak_mutex);
+  if (new_records > 0)
+  {
+    OutputBuffer* buf = output_buffer_create(output_backtraces);
+    buf->records = records;
+    buf->record_count = new_records;
+    output_submit(buf);
+  }
+  inside_memleak_stats = was_inside_memleak_stats;
+}
+
+// Write all of LEN bytes of DATA to FD. Returns 0 on success, or an errno value.
+static int write_all(int fd, void const* data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t written = write(fd, data, len);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    data = (char const*)data + written;
+    len -= written;
+  }
+  return 0;
+}
+
+// Write a snapshot of all live allocations to PATH (see Snapshot.h) and fill in HEADER.
+// Returns 0 on success, or an errno value.
+int memleak_snapshot(char const* path, SnapshotHeader* header)
+{
+  int was_inside_memleak_stats = inside_memleak_stats;
+  inside_memleak_stats = 1;
+
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  time_t now = tm.tv_sec - application_start;
+  memset(header, 0, sizeof(SnapshotHeader));
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->header_size = sizeof(SnapshotHeader);
+  header->record_size = sizeof(SnapshotRecord);
+  header->age_buckets = SNAPSHOT_AGE_BUCKETS;
+  header->pid = getpid();
+  header->application_start = application_start;
+  header->time = now;
+  memcpy(header->application, exename, sizeof(header->application));
+  strncpy(header->backtraces, backtrace_db_path(), sizeof(header->backtraces) - 1);
+
+  // New backtraces are only prepended to the list. Reclaimed backtraces are only freed by the
+  // next call to memleak_stats, and none are reclaimed while they are pinned, so the list can
+  // be walked without holding the lock, starting at the entry that is first now; also when
+  // memleak_stats is called meanwhile.
+  pthread_mutex_lock(&memleak_mutex);
+  pin_entries();
+  BacktraceEntry* first = stats.first_entry;
+  size_t capacity = stats.entries;
+  pthread_mutex_unlock(&memleak_mutex);
+
+  SnapshotRecord* records = (*memleak_libc_malloc)((capacity + 1) * sizeof(SnapshotRecord));
+  size_t count = 0;
+  for (BacktraceEntry* entry = first; entry && count < capacity; entry = entry->next)
+  {
+    SnapshotRecord* record = &records[count];
+    memset(record, 0, sizeof(SnapshotRecord));
+    record->oldest = now;
+    // Only hold the lock while summarizing a single backtrace, so that the application isn't stalled for the whole walk.
+    pthread_mutex_lock(&memleak_mutex);
+    Header* end = &entry->head;
+    for (Header* h = end->next; h != end; h = h->next)
+    {
+      ++record->count;
+      if (h->time < record->oldest)
+        record->oldest = h->time;
+      ++record->age[snapshot_age_bucket(now - h->time)];
+    }
+    // Allocations that aren't linked are only in the totals of the backtrace; their age is unknown.
+    record->unknown_age = entry->unlinked;
+    record->count += entry->unlinked;
+    record->bytes = entry->size;
+    pthread_mutex_unlock(&memleak_mutex);
+    if (record->count == 0)
+      continue;
+    record->backtrace_nr = entry->backtrace_nr;
+    header->allocations += record->count;
+    header->total_memory += record->bytes;
+    header->unknown_age += record->unknown_age;
+    ++count;
+  }
+  unpin_entries();
+  header->record_count = count;
+
+  // The list is in order of decreasing backtrace number.
+  for (size_t i = 0; i < count / 2; ++i)
+  {
+    SnapshotRecord tmp = records[i];
+    records[i] = records[count - 1 - i];
+    records[count - 1 - i] = tmp;
+  }
+
+  int error = 0;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    error = errno;
+  else
+  {
+    error = write_all(fd, header, sizeof(SnapshotHeader));
+    if (!error)
+      error = write_all(fd, records, count * sizeof(SnapshotRecord));
+    if (close(fd) < 0 && !error)
+      error = errno;
+  }
+  (*memleak_libc_free)(records);
+
+  // Make sure that all backtraces in the snapshot can be looked up in the database.
+  if (!error)
+    memleak_sync_backtraces();
+
+  inside_memleak_stats = was_inside_memleak_stats;
+  return error;
+}
+
+unsigned int memleak_mark(char const* name)
+{
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  unsigned int mark = 0;
+  pthread_mutex_lock(&memleak_mutex);
+  if (mark_epoch < MARKS_MAX)
+  {
+    mark = mark_epoch + 1;
+    marks[mark].time = tm.tv_sec - application_start;
+    strncpy(marks[mark].name, name ? name : "", MARK_NAME_MAX - 1);
+    mark_epoch = mark;
+  }
+  pthread_mutex_unlock(&memleak_mutex);
+  if (mark)
+    output_printf(output_stats, "libmemleak: Mark %u (\"%s\") at %lu seconds.\n", mark, marks[mark].name, marks[mark].time);
+  return mark;
 }
 
 void memleak_stats()
 {
   // Do not record memory allocated from this function.
+  int was_inside_memleak_stats = inside_memleak_stats;
   inside_memleak_stats = 1;
 
   // Record the moment at which this function is called (mostly, copying stats).
   struct timeval tm;
   gettimeofday(&tm, NULL);
   time_t now = tm.tv_sec - application_start;
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
 
   // LOCK ADMINISTRATIVE DATA
   pthread_mutex_lock(&memleak_mutex);
@@ -772,63 +1367,15 @@ void memleak_stats()
   memcpy(&local_stats, &stats, sizeof(Stats));
 
   // Run over all backtraces and their intervals and combine intervals as needed.
-  // Determine the sorting value of each backtrace from it's Intervals.
+  // Determine the sorting value of each backtrace from it's Intervals and/or trend.
+  size_t total_intervals = 0;
   for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
   {
-    Interval* interval = entry->intervals;
-    int combine_count = 0;
-    time_t combine_class = 0;
-    size_t value_n = 0;
-    time_t last_ivc = 100;	// Big
-    while (interval)
-    {
-      time_t ivc = interval_class(interval->end - interval->start);
-      if (LIKELY(ivc > combine_class))
-      {
-	combine_class = ivc;
-	combine_count = 1;
-      }
-      else if (++combine_count == 3 || UNLIKELY(ivc < combine_class))
-      {
-	if (interval->prev->start == interval->end)
-	{
-	  // Combine interval->prev with interval.
-	  interval_combine(entry, interval);
-	  ivc = interval_class(interval->end - interval->start);
-	}
-	else
-	{
-	  // There is a hole between interval->end and interval->prev->start.
-	  // For example, interval is [50, 65> and interval->prev is [84, 100> (so ivc == 16).
-	  time_t new_end = interval->end + ivc;		// 65 + 16 = 81
-	  // Close the hole.
-	  interval->end = interval->prev->start;	// [50, 84>
-	  // If the hole is larger than the class of interval
-	  if (new_end < interval->prev->start)
-	  {
-	    // Then only gobble up that much.
-	    interval->end = new_end;			// [50, 81>
-	    // If the remaining hole is of a class smaller then the current class,
-	    // then add it to interval->prev.
-	    if (interval_class(interval->prev->start - interval->end) < ivc)
-	      interval->prev->start = interval->end;	// [81, 100>
-	  }
-	}
-	ivc = combine_class = interval_class(interval->end - interval->start);
-	combine_count = 1;
-      }
-      // Determine the weight of this backtrace.
-      if (interval->end)
-      {
-	if (last_ivc < ivc)
-	  value_n *= 2;
-	value_n += interval->n;
-      }
-      // Next (older) interval.
-      interval = interval->next;
-      last_ivc = ivc;
-    }
-    entry->value_n = value_n;
+    interval_update_value_n(entry);
+    trend_sample(&entry->trend, now, stats.trend_half_life, entry->allocations, entry->size);
+    entry->value_n = score(stats.scorer, entry);
+    for (Interval* interval = entry->intervals; interval; interval = interval->next)
+      ++total_intervals;
   }
 
   // Remember what is currently the first node.
@@ -850,6 +1397,14 @@ void memleak_stats()
   // Set it to the start of the sorted linked list.
   *entry_ptr_n = local_stats.first_entry_n;
 
+  // The backtraces with the highest score are suspects: they get full backtraces and linked allocations from now on.
+  int suspects = 0;
+  for (BacktraceEntry* entry = local_stats.first_entry_n; entry && suspects < stats.max_backtraces && entry->value_n > 0; entry = entry->next_n, ++suspects)
+  {
+    entry->linked = 1;
+    suspect_add(entry);
+  }
+
   // Count number of intervals.
   int intervals = 0;
   int count = 0;
@@ -872,9 +1427,9 @@ void memleak_stats()
   }
 
   // Make a copy of all the Interval objects that we want to print.
-  memleak_stats_helper* helper = (*memleak_libc_malloc)(intervals * sizeof(memleak_stats_helper));
+  StatsRow* rows = (*memleak_libc_malloc)(intervals * sizeof(StatsRow));
 #ifdef DEBUG_EXPENSIVE
-  memset(helper, 0x13, intervals * sizeof(memleak_stats_helper));
+  memset(rows, 0x13, intervals * sizeof(StatsRow));
 #endif
   intervals = 0;
   count = 0;		// Print at most 4 backtraces.
@@ -887,8 +1442,14 @@ void memleak_stats()
       // Skip not-so-interesting "leaks".
       if (interval->n > 1 && interval->end)
       {
-	helper[intervals].entry = entry;
-	memcpy(&helper[intervals].interval, interval, sizeof(Interval));
+	rows[intervals].entry = entry;
+	rows[intervals].backtrace_nr = entry->backtrace_nr;
+	rows[intervals].value_n = entry->value_n;
+	trend_result(&entry->trend, &rows[intervals].trend);
+	memcpy(rows[intervals].lifetimes, entry->lifetimes, sizeof(entry->lifetimes));
+	memcpy(rows[intervals].live_sizes, entry->live_sizes, sizeof(entry->live_sizes));
+	memcpy(rows[intervals].total_sizes, entry->total_sizes, sizeof(entry->total_sizes));
+	memcpy(&rows[intervals].interval, interval, sizeof(Interval));
 	++intervals;
 	has_interval = 1;
       }
@@ -898,38 +1459,46 @@ void memleak_stats()
       ++count;
   }
 
+  shared_stats_update(&local_stats, now, total_intervals, &started);
+
   // UNLOCK ADMINISTRATIVE DATA
   pthread_mutex_unlock(&memleak_mutex);
 
-  // Print a header.
-  char total[256];
-  long totm = local_stats.total_memory;
-  char* p = &total[sizeof(total)];
-  *--p = 0;
-  int count2 = 0;
-  while (totm > 0)
+  // Print the report.
+  StatsHeader header;
+  header.appname = appname;
+  header.now = now;
+  header.backtraces = local_stats.backtraces;
+  header.entries = local_stats.entries;
+  header.allocations = local_stats.allocations;
+  header.total_memory = local_stats.total_memory;
+  header.intervals = total_intervals;
+  header.recording = local_stats.recording;
+  header.scorer = local_stats.scorer;
+  OutputBuffer* buf = output_buffer_create(output_stats);
+  format_stats(buf, output_format(), &header, rows, intervals);
+  output_submit(buf);
+  // Report new sized deletes with the wrong size (see del).
+  static size_t reported_sized_delete_mismatches;
+  if (local_stats.sized_delete_mismatches != reported_sized_delete_mismatches)
   {
-    if (count2 && count2 % 3 == 0)
-      *--p = ',';
-    *--p = '0' + (totm % 10);
-    totm /= 10;
-    ++count2;
+    reported_sized_delete_mismatches = local_stats.sized_delete_mismatches;
+    output_printf(output_stats, "libmemleak: %lu sized deletes passed the wrong size; the last one passed %lu for %lu bytes of backtrace %d.\n",
+        local_stats.sized_delete_mismatches, local_stats.sized_delete_deleted, local_stats.sized_delete_allocated, local_stats.sized_delete_backtrace_nr);
   }
-  fprintf(stdout, "%s: Now: %lu; \tBacktraces: %lu; \tallocations: %lu; \ttotal memory: %s bytes.\n",
-      appname, now, local_stats.backtraces, local_stats.allocations, p);
+  // Also send it to the clients that asked for it.
+  if (pthread_equal(pthread_self(), monitor_thread))
+    monitor_stats(&header, rows, intervals);
 
-  // Print all intervals and mark the backtrace entries as needing printing.
+  // Mark the backtrace entries as needing printing.
   time_t oldest_interval_end = 10000000;
   for(int i = 0; i < intervals; ++i)
   {
-    helper[i].entry->need_printing = 1;
-    fprintf(stdout, " backtrace %d (value_n: %6.2f); ", helper[i].entry->backtrace_nr, helper[i].entry->value_n);
-    interval_print(&helper[i].interval);
-    if (helper[i].interval.end < oldest_interval_end)
-      oldest_interval_end = helper[i].interval.end;
+    rows[i].entry->need_printing = 1;
+    if (rows[i].interval.end < oldest_interval_end)
+      oldest_interval_end = rows[i].interval.end;
   }
-  (*memleak_libc_free)(helper);
-  fflush(stdout);
+  (*memleak_libc_free)(rows);
 
   // LOCK ADMINISTRATIVE DATA
   pthread_mutex_lock(&memleak_mutex);
@@ -953,36 +1522,38 @@ void memleak_stats()
     ++entries;
   }
 
+  // Copy the raw frames of all backtraces that were created since the last call.
+  int new_records;
+  BacktraceRecord* records = new_backtrace_records(&new_records);
+
+  // Bury the dead backtraces.
+  BacktraceEntry* buried = reclaim_entries();
+
   // UNLOCK ADMINISTRATIVE DATA
   pthread_mutex_unlock(&memleak_mutex);
 
-  // Create or append 'memleak_backtraces' file.
-  static int first_time = 1;
-  FILE* fbacktraces = fopen("memleak_backtraces", first_time ? "w": "a");
-  if (first_time)
+  while (buried)
   {
-    fprintf(fbacktraces, "Application: \"%s\"\n", exename);
-    first_time = 0;
+    BacktraceEntry* next = buried->hashnext;
+    (*memleak_libc_free)(buried);
+    buried = next;
   }
-  // Write all marked entries to the file.
-  for(int e = entries - 1; e >= 0; --e)
+
+  // Let the writer thread add the new backtraces to the database, and symbolize all marked entries.
+  if (new_records > 0 || entries > 0)
   {
-    if (e && (e % 100) == 0)
-    {
-      fprintf(stdout, "%d backtraces to go (%3.1f %% cache hits)...\n", e, 100.0 * frame_cache_stats());
-      fflush(stdout);
-    }
-    BacktraceEntry* entry = &backtraces[e];
-    fprintf(fbacktraces, "Backtrace %d:\n", entry->backtrace_nr);
-    addr2line_print(fbacktraces, entry->ptr, entry->backtrace_size);
+    OutputBuffer* backtraces_buf = output_buffer_create(output_backtraces);
+    backtraces_buf->records = records;
+    backtraces_buf->record_count = new_records;
+    backtraces_buf->backtraces = backtraces;
+    backtraces_buf->entries = entries;
+    output_submit(backtraces_buf);
   }
-  fclose(fbacktraces);
-  if (entries > 0)
-    fprintf(stdout, "libmemleak: Wrote %d new backtraces.\n", entries);
-  (*memleak_libc_free)(backtraces);
+  else
+    (*memleak_libc_free)(backtraces);
 
   // Done.
-  inside_memleak_stats = 0;
+  inside_memleak_stats = was_inside_memleak_stats;
 }
 
 //---------------------------------------------------------------------------------------------
@@ -992,29 +1563,76 @@ static __thread void* backtrace_buffer[backtrace_size_max];
 static __thread int inside_backtrace = 0;
 static __thread int inside_realloc = 0;
 
-// Set HEADER_OFFSET to sizeof(Header) rounded up to the nearest multiple of sizeof(void*).
-#define HEADER_OFFSET (((sizeof(Header) - 1) / sizeof(void*) + 1) * sizeof(void*))
+// Take DEPTH frames from now on (backtrace_size_max for full backtraces) and forget all suspects.
+static void set_backtrace_depth(int depth)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  backtrace_depth = depth;
+  for (int i = 0; i < SUSPECTS_MAX; ++i)
+    __atomic_store_n(&suspect_prefixes[i], 0, __ATOMIC_RELAXED);
+  suspect_count = 0;
+  pthread_mutex_unlock(&memleak_mutex);
+}
 
-void* malloc(size_t size)
+// Link the new allocations of all backtraces if ALL is nonzero, or only those of suspects.
+static void set_link_all(int all)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  link_all = all;
+  // Suspects become suspects again at the next stats report.
+  for (BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+    entry->linked = all;
+  pthread_mutex_unlock(&memleak_mutex);
+}
+
+// Take the backtrace of an allocation into backtrace_buffer and return the number of frames.
+static inline int capture_backtrace()
+{
+  // If malloc is called from inside backtrace, then cut the loop here and add the previous backtrace
+  // for this allocation too (it DID cause this allocation after all).
+  if (inside_backtrace)
+    return 0;
+  inside_backtrace = 1;
+  int depth = backtrace_depth;
+  int backtrace_size = backtrace(backtrace_buffer, depth);
+  // Unwinding is the expensive part, so only suspects are unwound all the way.
+  if (UNLIKELY(backtrace_size == depth && depth < backtrace_size_max) && is_suspect(backtrace_buffer, depth))
+  {
+    backtrace_size = backtrace(backtrace_buffer, backtrace_size_max);
+    __atomic_fetch_add(&deep_captures, 1, __ATOMIC_RELAXED);
+  }
+  inside_backtrace = 0;
+  return backtrace_size;
+}
+
+// The body of malloc, shared with operator new. It is inlined so that the backtraces
+// of both start with the hook that the application called.
+static inline __attribute__((always_inline)) void* allocate(size_t size)
 {
   assert(!inside_realloc);
+  uint64_t start = UNLIKELY(latency_enabled) ? latency_now() : 0;
   void* allocation = (*memleak_libc_malloc)(size + HEADER_OFFSET);
+  uint64_t end = start ? latency_now() : 0;
   if (!allocation)
     return NULL;
+  if (UNLIKELY(filtered_out(size)))
+  {
+    untracked((Header*)allocation, 0);
+    return (char*)allocation + HEADER_OFFSET;
+  }
 #ifdef DEBUG_EXPENSIVE
   memset(allocation, 0xa5, sizeof(Header));
 #endif
-  // If malloc is called from inside backtrace, then cut the loop here and add the previous backtrace
-  // for this allocation too (it DID cause this allocation after all).
-  int backtrace_size = 0;
-  if (!inside_backtrace)
-  {
-    inside_backtrace = 1;
-    backtrace_size = backtrace(backtrace_buffer, backtrace_size_max);
-    inside_backtrace = 0;
-  }
+  int backtrace_size = capture_backtrace();
   add((Header*)allocation, size, backtrace_buffer, backtrace_size, 0);
-  allocation = (char*)allocation + HEADER_OFFSET;
+  if (UNLIKELY(start))
+    latency_record(latency_malloc, latency_entry(allocation), end - start, latency_now() - end);
+  return (char*)allocation + HEADER_OFFSET;
+}
+
+void* malloc(size_t size)
+{
+  void* allocation = allocate(size);
   Debug(print_lock(); print("malloc("); print_size(size); print(") = "); print_ptr(allocation); print_unlock());
   return allocation;
 }
@@ -1024,20 +1642,23 @@ void* calloc(size_t nmemb, size_t size)
   if (!nmemb || !size)
     return NULL;
   size_t alloc_nmemb = nmemb + (HEADER_OFFSET + size - 1) / size;
+  uint64_t start = UNLIKELY(latency_enabled) ? latency_now() : 0;
   void* allocation = (*memleak_libc_calloc)(alloc_nmemb, size);
+  uint64_t end = start ? latency_now() : 0;
   if (!allocation)
     return NULL;
+  if (UNLIKELY(filtered_out(nmemb * size)))
+  {
+    untracked((Header*)allocation, 0);
+    return (char*)allocation + HEADER_OFFSET;
+  }
 #ifdef DEBUG_EXPENSIVE
   memset(allocation, 0xa6, sizeof(Header));
 #endif
-  int backtrace_size = 0;
-  if (!inside_backtrace)
-  {
-    inside_backtrace = 1;
-    backtrace_size = backtrace(backtrace_buffer, backtrace_size_max);
-    inside_backtrace = 0;
-  }
+  int backtrace_size = capture_backtrace();
   add((Header*)allocation, nmemb * size, backtrace_buffer, backtrace_size, 0);
+  if (UNLIKELY(start))
+    latency_record(latency_calloc, latency_entry(allocation), end - start, latency_now() - end);
   allocation = (char*)allocation + HEADER_OFFSET;
   Debug(print_lock(); print("calloc("); print_size(nmemb); print(", "); print_size(size); print(") = "); print_ptr(allocation); print_unlock());
   return allocation;
@@ -1053,12 +1674,16 @@ void* realloc(void* void_ptr, size_t size)
     return NULL;
   }
   void_ptr = (char*)void_ptr - HEADER_OFFSET;
-  del((Header*)void_ptr);
+  uint64_t start = UNLIKELY(latency_enabled) ? latency_now() : 0;
+  int was_tracked = ((Header*)void_ptr)->magic_number == MAGIC_NUMBER || ((Header*)void_ptr)->magic_number == MAGIC_SKETCHED;
+  del((Header*)void_ptr, NOT_SIZED);
   inside_realloc = 1;
 #ifdef DEBUG_EXPENSIVE
   memset(void_ptr, 0xf9, sizeof(Header));
 #endif
+  uint64_t libc_start = start ? latency_now() : 0;
   void* allocation = (*memleak_libc_realloc)(void_ptr, size + HEADER_OFFSET);
+  uint64_t end = start ? latency_now() : 0;
 #ifdef DEBUG_EXPENSIVE
   assert(allocation);
   memset(allocation, 0xa7, sizeof(Header));
@@ -1068,39 +1693,72 @@ void* realloc(void* void_ptr, size_t size)
   {
     // If realloc() fails the original block is left untouched; it is not freed or moved.
     // So we must revert the call to del() above.
+    if (!was_tracked)
+    {
+      untracked((Header*)void_ptr, 0);
+      return NULL;
+    }
     int backtrace_size = backtrace(backtrace_buffer, backtrace_size_max);
     add((Header*)void_ptr, ((Header*)void_ptr)->size, backtrace_buffer, backtrace_size, 0);
     return NULL;
   }
-  int backtrace_size = 0;
-  if (!inside_backtrace)
+  if (UNLIKELY(filtered_out(size)))
   {
-    inside_backtrace = 1;
-    backtrace_size = backtrace(backtrace_buffer, backtrace_size_max);
-    inside_backtrace = 0;
+    untracked((Header*)allocation, 0);
+    return (char*)allocation + HEADER_OFFSET;
   }
+  int backtrace_size = capture_backtrace();
   add((Header*)allocation, size, backtrace_buffer, backtrace_size, 0);
+  if (UNLIKELY(start))
+    latency_record(latency_realloc, latency_entry(allocation), end - libc_start, libc_start - start + latency_now() - end);
   allocation = (char*)allocation + HEADER_OFFSET;
   Debug(print_lock(); print("realloc("); print_ptr(void_ptr); print(", "); print_size(size); print(") = "); print_ptr(allocation); print_unlock());
   return allocation;
 }
 
-void free(void* void_ptr)
+// The body of free, shared with operator delete. OFFSET is the distance from VOID_PTR back to
+// the start of the real allocation when the caller knows it, or 0 to read it from the header.
+// SIZE is the size passed to a sized operator delete, or NOT_SIZED.
+static inline __attribute__((always_inline)) void release(void* void_ptr, size_t offset, size_t size)
 {
-  Debug(print_lock(); print("free("); print_ptr(void_ptr); print(")"); print_unlock());
   assert(!inside_realloc);
-  if (!void_ptr)
-    return;
   Header* header = (Header*)((char*)void_ptr - HEADER_OFFSET);
-  del(header);
-  void* tmp = (char*)void_ptr - (header->posix_memalign_offset ? header->posix_memalign_offset : (intptr_t)HEADER_OFFSET);
+  uint64_t start = 0;
+  BacktraceEntry* entry = NULL;
+  if (UNLIKELY(latency_enabled))
+  {
+    start = latency_now();
+    // Keep the entry from being reclaimed until latency_record is done with it.
+    pin_entries();
+    entry = latency_entry(header);
+  }
+  del(header, size);
+  if (!offset)
+    offset = header->posix_memalign_offset ? header->posix_memalign_offset : HEADER_OFFSET;
+  void* tmp = (char*)void_ptr - offset;
 #ifdef DEBUG_EXPENSIVE
   memset(header, 0x19, sizeof(Header));
 #endif
+  uint64_t libc_start = start ? latency_now() : 0;
   (*memleak_libc_free)(tmp);
+  if (UNLIKELY(start))
+  {
+    uint64_t end = latency_now();
+    latency_record(latency_free, entry, end - libc_start, libc_start - start);
+    unpin_entries();
+  }
 }
 
-int posix_memalign(void** memptr, size_t alignment, size_t size)
+void free(void* void_ptr)
+{
+  Debug(print_lock(); print("free("); print_ptr(void_ptr); print(")"); print_unlock());
+  if (!void_ptr)
+    return;
+  release(void_ptr, 0, NOT_SIZED);
+}
+
+// The body of posix_memalign, shared with memalign, aligned_alloc and the aligned operator new.
+static inline __attribute__((always_inline)) int allocate_aligned(void** memptr, size_t alignment, size_t size)
 {
   if (size == 0)
   {
@@ -1108,28 +1766,38 @@ int posix_memalign(void** memptr, size_t alignment, size_t size)
     return 0;
   }
   size_t offset = ((HEADER_OFFSET - 1) / alignment + 1) * alignment;
+  uint64_t start = UNLIKELY(latency_enabled) ? latency_now() : 0;
   int ret = (*libc_posix_memalign)(memptr, alignment, size + offset);
+  uint64_t end = start ? latency_now() : 0;
   if (ret != 0)
     return ret;
-  int backtrace_size = 0;
   *memptr = (char*)*memptr + offset;
   Header* header = (Header*)((char*)*memptr - HEADER_OFFSET);
+  if (UNLIKELY(filtered_out(size)))
+  {
+    untracked(header, offset);
+    return 0;
+  }
 #ifdef DEBUG_EXPENSIVE
   memset(header, 0xc3, sizeof(Header));
 #endif
-  if (!inside_backtrace)
-  {
-    inside_backtrace = 1;
-    backtrace_size = backtrace(backtrace_buffer, backtrace_size_max);
-    inside_backtrace = 0;
-  }
+  int backtrace_size = capture_backtrace();
   add(header, size, backtrace_buffer, backtrace_size, offset);
-  Debug(print_lock(); print("posix_memalign("); print_ptr(memptr); print(", "); print_size(alignment); print(", "); print_size(size);
-        print(") = 0 (*memptr = "); print_ptr(*memptr); print(")"); print_unlock());
+  if (UNLIKELY(start))
+    latency_record(latency_memalign, latency_entry(header), end - start, latency_now() - end);
   return 0;
 }
 
-void* memalign(size_t boundary, size_t size)
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+  int ret = allocate_aligned(memptr, alignment, size);
+  Debug(print_lock(); print("posix_memalign("); print_ptr(memptr); print(", "); print_size(alignment); print(", "); print_size(size);
+        print(") = "); print_size(ret); print(" (*memptr = "); print_ptr(*memptr); print(")"); print_unlock());
+  return ret;
+}
+
+// The body of memalign.
+static inline __attribute__((always_inline)) void* allocate_boundary(size_t boundary, size_t size)
 {
   if (size == 0)
     size = 1;
@@ -1139,464 +1807,2368 @@ void* memalign(size_t boundary, size_t size)
     boundary = sizeof(void*);
   }
   void* ret;
-  if (posix_memalign(&ret, boundary, size) != 0)
+  if (allocate_aligned(&ret, boundary, size) != 0)
     return NULL;
   return ret;
 }
 
-void* valloc(size_t size)
+void* memalign(size_t boundary, size_t size)
 {
-  return memalign(pagesize, size);
+  return allocate_boundary(boundary, size);
 }
 
-//---------------------------------------------------------------------------------------------
-
-void delete_intervals();
-
-void interval_start_recording()
+void* valloc(size_t size)
 {
-  delete_intervals();
-  struct timeval tm;
-  gettimeofday(&tm, NULL);
-  interval_start = tm.tv_sec - application_start;
-  printf("*** START RECORDING ***\n");
-  stats.recording = 1;
+  return allocate_boundary(pagesize, size);
 }
 
-void interval_stop_recording()
+void* pvalloc(size_t size)
 {
-  if (!stats.recording)
-    return;
+  return allocate_boundary(pagesize, size ? (size + pagesize - 1) & ~(pagesize - 1) : (size_t)pagesize);
+}
 
-  struct timeval tm;
-  gettimeofday(&tm, NULL);
-  time_t interval_end = tm.tv_sec - application_start + 1;
-  pthread_mutex_lock(&memleak_mutex);
-  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)))
   {
-    if (entry->recording_interval)
-    {
-      entry->recording_interval->end = interval_end;
-      if (entry->recording_interval->n == 0)
-      {
-        interval_unlink(entry, entry->recording_interval);
-	(*memleak_libc_free)(entry->recording_interval);
-      }
-      entry->recording_interval = NULL;
-    }
+    errno = EINVAL;
+    return NULL;
   }
-  stats.recording = 0;
-  pthread_mutex_unlock(&memleak_mutex);
-  printf("*** STOP RECORDING ***\n");
+  return allocate_boundary(alignment, size);
 }
 
-void interval_delete(time_t end)
+void* reallocarray(void* void_ptr, size_t nmemb, size_t size)
 {
-  pthread_mutex_lock(&memleak_mutex);
-  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total))
   {
-#ifdef DEBUG_EXPENSIVE
-    check_intervals(entry);
-#endif
-    Interval* interval = entry->intervals;
-    if (!interval)
-      continue;
-    while (interval->next)
-      interval = interval->next;
-    while (interval && interval->end <= end)
-    {
-      Interval* prev = interval->prev;
-      for (Header* header = interval->first; header && header->interval == interval; header = header->prev)
-	header->interval = NULL;
-      interval_unlink(entry, interval);
-      if (entry->recording_interval == interval)
-	entry->recording_interval = NULL;
-      (*memleak_libc_free)(interval);
-      interval = prev;
-    }
-#ifdef DEBUG_EXPENSIVE
-    check_intervals(entry);
-#endif
+    errno = ENOMEM;
+    return NULL;
   }
-  pthread_mutex_unlock(&memleak_mutex);
+  return realloc(void_ptr, total);
 }
 
-void delete_intervals()
+size_t malloc_usable_size(void* void_ptr)
 {
-  interval_stop_recording();
-  pthread_mutex_lock(&memleak_mutex);
-  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
-  {
-    Interval* interval = entry->intervals;
-    while (interval)
-    {
-      Interval* next = interval->next;
-      for (Header* header = interval->first; header && header->interval == interval; header = header->prev)
-	header->interval = NULL;
-      interval_unlink(entry, interval);
-      (*memleak_libc_free)(interval);
-      interval = next;
-    }
-    assert(entry->intervals == NULL);
-  }
-  pthread_mutex_unlock(&memleak_mutex);
+  if (!void_ptr)
+    return 0;
+  // Allocations made while looking up the real malloc functions come from the stubs (only malloc uses those).
+  size_t bootstrap_size = usable_size_bootstrap2((char*)void_ptr - HEADER_OFFSET);
+  if (UNLIKELY(bootstrap_size))
+    return bootstrap_size - HEADER_OFFSET;
+  Header* header = (Header*)((char*)void_ptr - HEADER_OFFSET);
+  size_t offset = header->posix_memalign_offset ? header->posix_memalign_offset : HEADER_OFFSET;
+  // Still inside init_malloc_function_pointers; nothing is filtered or sketched yet, so the size is known.
+  if (UNLIKELY(!libc_malloc_usable_size))
+    return header->size;
+  // What the real allocator has to spare after the end of the allocation can be used too.
+  return (*libc_malloc_usable_size)((char*)void_ptr - offset) - offset;
 }
 
-void interval_restart_recording()
+//---------------------------------------------------------------------------------------------
+// C++ operator new and delete
+//
+// Without these, operator new calls malloc and every C++ backtrace starts with a frame of libstdc++.
+// The functions are defined under their mangled names (size_t is mangled as 'm' on LP64).
+
+#if __SIZEOF_SIZE_T__ == __SIZEOF_LONG__
+#define MANGLED_SIZE_T "m"
+#else
+#define MANGLED_SIZE_T "j"
+#endif
+
+void* memleak_new(size_t size) __asm__("_Znw" MANGLED_SIZE_T);
+void* memleak_new_array(size_t size) __asm__("_Zna" MANGLED_SIZE_T);
+void* memleak_new_nothrow(size_t size, void const* nothrow) __asm__("_Znw" MANGLED_SIZE_T "RKSt9nothrow_t");
+void* memleak_new_array_nothrow(size_t size, void const* nothrow) __asm__("_Zna" MANGLED_SIZE_T "RKSt9nothrow_t");
+void* memleak_new_aligned(size_t size, size_t alignment) __asm__("_Znw" MANGLED_SIZE_T "St11align_val_t");
+void* memleak_new_array_aligned(size_t size, size_t alignment) __asm__("_Zna" MANGLED_SIZE_T "St11align_val_t");
+void* memleak_new_aligned_nothrow(size_t size, size_t alignment, void const* nothrow) __asm__("_Znw" MANGLED_SIZE_T "St11align_val_tRKSt9nothrow_t");
+void* memleak_new_array_aligned_nothrow(size_t size, size_t alignment, void const* nothrow) __asm__("_Zna" MANGLED_SIZE_T "St11align_val_tRKSt9nothrow_t");
+void memleak_delete(void* ptr) __asm__("_ZdlPv");
+void memleak_delete_array(void* ptr) __asm__("_ZdaPv");
+void memleak_delete_nothrow(void* ptr, void const* nothrow) __asm__("_ZdlPvRKSt9nothrow_t");
+void memleak_delete_array_nothrow(void* ptr, void const* nothrow) __asm__("_ZdaPvRKSt9nothrow_t");
+void memleak_delete_sized(void* ptr, size_t size) __asm__("_ZdlPv" MANGLED_SIZE_T);
+void memleak_delete_array_sized(void* ptr, size_t size) __asm__("_ZdaPv" MANGLED_SIZE_T);
+void memleak_delete_aligned(void* ptr, size_t alignment) __asm__("_ZdlPvSt11align_val_t");
+void memleak_delete_array_aligned(void* ptr, size_t alignment) __asm__("_ZdaPvSt11align_val_t");
+void memleak_delete_aligned_nothrow(void* ptr, size_t alignment, void const* nothrow) __asm__("_ZdlPvSt11align_val_tRKSt9nothrow_t");
+void memleak_delete_array_aligned_nothrow(void* ptr, size_t alignment, void const* nothrow) __asm__("_ZdaPvSt11align_val_tRKSt9nothrow_t");
+void memleak_delete_sized_aligned(void* ptr, size_t size, size_t alignment) __asm__("_ZdlPv" MANGLED_SIZE_T "St11align_val_t");
+void memleak_delete_array_sized_aligned(void* ptr, size_t size, size_t alignment) __asm__("_ZdaPv" MANGLED_SIZE_T "St11align_val_t");
+
+// Called when operator new NAME failed to allocate SIZE bytes with ALIGNMENT (0 if not aligned).
+// C can't throw std::bad_alloc, so let the next definition (from libstdc++) call the new_handler and
+// throw, or return NULL for the nothrow versions. It calls malloc, so the allocation is still tracked.
+static __attribute__((noinline)) void* operator_new_failed(char const* name, size_t size, size_t alignment, void const* nothrow)
 {
-  if (!stats.recording)
+  void* next = dlsym(RTLD_NEXT, name);
+  if (!next)
   {
-    interval_start_recording();
-    return;
+    if (nothrow)
+      return NULL;
+    abort();
   }
-  struct timeval tm;
-  gettimeofday(&tm, NULL);
-  time_t interval_end = tm.tv_sec - application_start + 1;
-  pthread_mutex_lock(&memleak_mutex);
-  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+  if (alignment)
+    return nothrow ? ((void* (*)(size_t, size_t, void const*))next)(size, alignment, nothrow) : ((void* (*)(size_t, size_t))next)(size, alignment);
+  return nothrow ? ((void* (*)(size_t, void const*))next)(size, nothrow) : ((void* (*)(size_t))next)(size);
+}
+
+void* memleak_new(size_t size)
+{
+  void* allocation = allocate(size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Znw" MANGLED_SIZE_T, size, 0, NULL);
+  return allocation;
+}
+
+void* memleak_new_array(size_t size)
+{
+  void* allocation = allocate(size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Zna" MANGLED_SIZE_T, size, 0, NULL);
+  return allocation;
+}
+
+void* memleak_new_nothrow(size_t size, void const* nothrow)
+{
+  void* allocation = allocate(size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Znw" MANGLED_SIZE_T "RKSt9nothrow_t", size, 0, nothrow);
+  return allocation;
+}
+
+void* memleak_new_array_nothrow(size_t size, void const* nothrow)
+{
+  void* allocation = allocate(size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Zna" MANGLED_SIZE_T "RKSt9nothrow_t", size, 0, nothrow);
+  return allocation;
+}
+
+void* memleak_new_aligned(size_t size, size_t alignment)
+{
+  void* allocation = allocate_boundary(alignment, size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Znw" MANGLED_SIZE_T "St11align_val_t", size, alignment, NULL);
+  return allocation;
+}
+
+void* memleak_new_array_aligned(size_t size, size_t alignment)
+{
+  void* allocation = allocate_boundary(alignment, size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Zna" MANGLED_SIZE_T "St11align_val_t", size, alignment, NULL);
+  return allocation;
+}
+
+void* memleak_new_aligned_nothrow(size_t size, size_t alignment, void const* nothrow)
+{
+  void* allocation = allocate_boundary(alignment, size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Znw" MANGLED_SIZE_T "St11align_val_tRKSt9nothrow_t", size, alignment, nothrow);
+  return allocation;
+}
+
+void* memleak_new_array_aligned_nothrow(size_t size, size_t alignment, void const* nothrow)
+{
+  void* allocation = allocate_boundary(alignment, size);
+  if (UNLIKELY(!allocation))
+    allocation = operator_new_failed("_Zna" MANGLED_SIZE_T "St11align_val_tRKSt9nothrow_t", size, alignment, nothrow);
+  return allocation;
+}
+
+// Memory of the unaligned operator new never has a posix_memalign offset, so the
+// unaligned operator delete doesn't need to read it from the header.
+
+void memleak_delete(void* ptr)
+{
+  if (ptr)
+    release(ptr, HEADER_OFFSET, NOT_SIZED);
+}
+
+void memleak_delete_array(void* ptr)
+{
+  if (ptr)
+    release(ptr, HEADER_OFFSET, NOT_SIZED);
+}
+
+void memleak_delete_nothrow(void* ptr, void const* nothrow __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, HEADER_OFFSET, NOT_SIZED);
+}
+
+void memleak_delete_array_nothrow(void* ptr, void const* nothrow __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, HEADER_OFFSET, NOT_SIZED);
+}
+
+// Sized delete: the size must be the size that was allocated; del counts the deletes for which it isn't.
+
+void memleak_delete_sized(void* ptr, size_t size)
+{
+  if (ptr)
+    release(ptr, HEADER_OFFSET, size);
+}
+
+void memleak_delete_array_sized(void* ptr, size_t size)
+{
+  if (ptr)
+    release(ptr, HEADER_OFFSET, size);
+}
+
+void memleak_delete_aligned(void* ptr, size_t alignment __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, 0, NOT_SIZED);
+}
+
+void memleak_delete_array_aligned(void* ptr, size_t alignment __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, 0, NOT_SIZED);
+}
+
+void memleak_delete_aligned_nothrow(void* ptr, size_t alignment __attribute__((unused)), void const* nothrow __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, 0, NOT_SIZED);
+}
+
+void memleak_delete_array_aligned_nothrow(void* ptr, size_t alignment __attribute__((unused)), void const* nothrow __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, 0, NOT_SIZED);
+}
+
+void memleak_delete_sized_aligned(void* ptr, size_t size, size_t alignment __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, 0, size);
+}
+
+void memleak_delete_array_sized_aligned(void* ptr, size_t size, size_t alignment __attribute__((unused)))
+{
+  if (ptr)
+    release(ptr, 0, size);
+}
+
+//---------------------------------------------------------------------------------------------
+
+void delete_intervals();
+
+void interval_start_recording()
+{
+  delete_intervals();
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  interval_start = tm.tv_sec - application_start;
+  output_printf(output_stats, "*** START RECORDING ***\n");
+  stats.recording = 1;
+}
+
+void interval_stop_recording()
+{
+  if (!stats.recording)
+    return;
+
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  time_t interval_end = tm.tv_sec - application_start + 1;
+  pthread_mutex_lock(&memleak_mutex);
+  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+    interval_end_recording(entry, interval_end);
+  stats.recording = 0;
+  pthread_mutex_unlock(&memleak_mutex);
+  output_printf(output_stats, "*** STOP RECORDING ***\n");
+}
+
+void interval_delete(time_t end)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+  {
+#ifdef DEBUG_EXPENSIVE
+    check_intervals(entry);
+#endif
+    Interval* interval = entry->intervals;
+    if (!interval)
+      continue;
+    while (interval->next)
+      interval = interval->next;
+    // The interval that is being recorded (end == 0) is never deleted.
+    while (interval && interval->end && interval->end <= end)
+    {
+      Interval* prev = interval->prev;
+      for (Header* header = interval->first; header && header->interval == interval; header = header->prev)
+	header->interval = NULL;
+      interval_unlink(entry, interval);
+      if (entry->recording_interval == interval)
+	entry->recording_interval = NULL;
+      (*memleak_libc_free)(interval);
+      interval = prev;
+    }
+#ifdef DEBUG_EXPENSIVE
+    check_intervals(entry);
+#endif
+  }
+  pthread_mutex_unlock(&memleak_mutex);
+}
+
+void delete_intervals()
+{
+  interval_stop_recording();
+  pthread_mutex_lock(&memleak_mutex);
+  // Allocations that aren't linked and were counted in the deleted intervals are forgotten.
+  if (++recording_generation == 0)
+    recording_generation = 1;
+  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+  {
+    Interval* interval = entry->intervals;
+    while (interval)
+    {
+      Interval* next = interval->next;
+      for (Header* header = interval->first; header && header->interval == interval; header = header->prev)
+	header->interval = NULL;
+      interval_unlink(entry, interval);
+      (*memleak_libc_free)(interval);
+      interval = next;
+    }
+    assert(entry->intervals == NULL);
+  }
+  pthread_mutex_unlock(&memleak_mutex);
+}
+
+void interval_restart_recording()
+{
+  if (!stats.recording)
+  {
+    interval_start_recording();
+    return;
+  }
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  time_t interval_end = tm.tv_sec - application_start + 1;
+  pthread_mutex_lock(&memleak_mutex);
+  for(BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+    interval_end_recording(entry, interval_end);
+  interval_start = interval_end;
+  pthread_mutex_unlock(&memleak_mutex);
+  output_printf(output_stats, "*** RESTART RECORDING ***\n");
+}
+
+//---------------------------------------------------------------------------------------------
+// The monitor thread.
+
+// Stop reading commands from a client while it has this much output pending.
+#define CLIENT_OUTPUT_MAX (1024 * 1024)
+// The maximum size of the payload of a message from a client.
+#define CLIENT_INPUT_MAX PROTOCOL_REQUEST_MAX
+
+//! @brief A connection from memleak_control.
+struct Client {
+  int fd;                                       //!< The socket.
+  char in[sizeof(ProtocolFrame) + CLIENT_INPUT_MAX]; //!< Received input that isn't a complete message yet.
+  size_t in_len;                                //!< Number of valid characters in 'in'.
+  OutputBuffer* out;                            //!< Output that wasn't written yet, or NULL.
+  size_t out_pos;                               //!< Number of characters of 'out' that were already written.
+  uint32_t events;                              //!< The events that this client is registered for with epoll.
+  uint32_t version;                             //!< The protocol version of the client; 0 until it sent protocol_hello.
+  int subscribed;                               //!< Set while the client wants to receive stats.
+  int need_snapshot;                            //!< Set when the client missed a delta and needs a snapshot instead.
+  int closing;                                  //!< Close the connection once all output was written.
+  int format;                                   //!< The StatsFormat in which this client wants every stats report, or -1.
+  int metrics;                                  //!< Set if this is a connection on the metrics socket.
+  uint64_t id;                                  //!< Unique number that identifies the client in epoll events.
+  struct Client* next;                          //!< Next client.
+};
+
+typedef struct Client Client;
+
+static void terminate();
+static int sockfd = -1;
+static int metricsfd = -1;                      // The metrics socket, if any.
+static int epollfd = -1;
+static int timerfd = -1;                        // Expires every stats interval while recording or tracing.
+static int quitfd = -1;                         // Written to by terminate.
+static char const* sockname;
+static char const* metrics_sockname;
+static OutputBuffer* metrics;                   // The body of the response to a scrape, updated every stats tick.
+static Client* clients;
+// Epoll events carry the index of sockfd, timerfd, quitfd or metricsfd (see monitor), or the id of a client.
+enum { monitor_sockfd, monitor_timerfd, monitor_quitfd, monitor_metricsfd, monitor_fds };
+static uint64_t next_client_id = monitor_fds;
+static time_t stats_interval;
+static int restart_multiplier = 5;
+static int tick_count = 0;
+static uint64_t stats_tick;                     // The number of deltas sent to subscribers.
+static int stats_published;                     // Nonzero when entries might have a nonzero published checksum. Protected by memleak_mutex.
+
+static void monitor_exit()
+{
+  close(sockfd);
+  unlink(sockname);
+  if (metricsfd >= 0)
+  {
+    close(metricsfd);
+    unlink(metrics_sockname);
+  }
+  pthread_exit(0);
+}
+
+// Start a message of TYPE in OUT. Returns the offset of its frame, to be passed to message_end.
+static size_t message_begin(OutputBuffer* out, int type)
+{
+  size_t offset = out->len;
+  ProtocolFrame frame;
+  frame.length = 0;
+  frame.type = type;
+  frame.reserved = 0;
+  output_buffer_write(out, (char const*)&frame, sizeof(frame));
+  return offset;
+}
+
+// Fill in the length of the message in OUT whose frame starts at OFFSET.
+static void message_end(OutputBuffer* out, size_t offset)
+{
+  uint32_t length = out->len - offset - sizeof(ProtocolFrame);
+  memcpy(out->data + offset, &length, sizeof(length));
+}
+
+static OutputBuffer* client_output(Client* client)
+{
+  if (!client->out)
+    client->out = output_buffer_create(output_stats);
+  return client->out;
+}
+
+static size_t client_pending(Client* client)
+{
+  return client->out ? client->out->len - client->out_pos : 0;
+}
+
+static void client_send(Client* client, int type, void const* payload, size_t len)
+{
+  OutputBuffer* out = client_output(client);
+  size_t offset = message_begin(out, type);
+  output_buffer_write(out, payload, len);
+  message_end(out, offset);
+}
+
+static void client_write(Client* client, char const* data, size_t len)
+{
+  client_send(client, protocol_text, data, len);
+}
+
+static void client_printf(Client* client, char const* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void client_printf(Client* client, char const* format, ...)
+{
+  OutputBuffer* out = client_output(client);
+  size_t offset = message_begin(out, protocol_text);
+  va_list ap;
+  va_start(ap, format);
+  output_buffer_vprintf(out, format, ap);
+  va_end(ap);
+  message_end(out, offset);
+}
+
+static void client_close(Client* client)
+{
+  epoll_ctl(epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  Client** cp = &clients;
+  while (*cp != client)
+    cp = &(*cp)->next;
+  *cp = client->next;
+  if (client->out)
+    output_buffer_destroy(client->out);
+  (*memleak_libc_free)(client);
+}
+
+// Write as much of the pending output of CLIENT as possible and update what we wait for.
+// Returns -1 if the client was closed.
+static int client_flush(Client* client)
+{
+  size_t pending = 0;
+  if (client->out)
+  {
+    while (client->out_pos < client->out->len)
+    {
+      ssize_t ret = write(client->fd, client->out->data + client->out_pos, client->out->len - client->out_pos);
+      if (ret < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN)
+          break;
+        client_close(client);
+        return -1;
+      }
+      client->out_pos += ret;
+    }
+    pending = client->out->len - client->out_pos;
+    if (pending == 0)
+    {
+      client->out->len = 0;
+      client->out_pos = 0;
+    }
+  }
+  if (pending == 0 && client->closing)
+  {
+    client_close(client);
+    return -1;
+  }
+  // Backpressure: don't read new commands while too much output is pending.
+  uint32_t events = (pending ? EPOLLOUT : 0) | (pending < CLIENT_OUTPUT_MAX && !client->closing ? EPOLLIN : 0);
+  if (events != client->events)
+  {
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = client->id;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, client->fd, &event);
+    client->events = events;
+  }
+  return 0;
+}
+
+// Stats are printed every stats_interval seconds while recording; while only tracing, new backtraces are
+// added to the backtrace database just as often. The metrics are updated at the same rate. Restarts the period.
+static void monitor_arm_timer()
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (stats.recording || trace_enabled || metricsfd >= 0)
+  {
+    its.it_value.tv_sec = stats_interval;
+    its.it_interval.tv_sec = stats_interval;
+  }
+  timerfd_settime(timerfd, 0, &its, NULL);
+}
+
+static inline uint64_t checksum_add(uint64_t checksum, uint64_t value)
+{
+  return (checksum ^ value) * 1099511628211UL;
+}
+
+// Return a checksum over everything of ENTRY that is sent to subscribers, or 0 when it has no intervals.
+static uint64_t entry_checksum(BacktraceEntry* entry)
+{
+  if (!entry->intervals)
+    return 0;
+  uint64_t checksum = 14695981039346656037UL;
+  uint64_t value_n;
+  memcpy(&value_n, &entry->value_n, sizeof(value_n));
+  checksum = checksum_add(checksum, value_n);
+  checksum = checksum_add(checksum, entry->allocations);
+  for (Interval* interval = entry->intervals; interval; interval = interval->next)
+  {
+    checksum = checksum_add(checksum, interval->start);
+    checksum = checksum_add(checksum, interval->end);
+    checksum = checksum_add(checksum, interval->total_n);
+    checksum = checksum_add(checksum, interval->n);
+    checksum = checksum_add(checksum, interval->size);
+  }
+  return checksum | 1;
+}
+
+// Append a protocol_stats message to OUT. If SNAPSHOT is zero this is the next delta: only backtraces
+// that changed since the previous delta are included, and their new state is remembered.
+static void stats_message(OutputBuffer* out, int snapshot)
+{
+  size_t offset = message_begin(out, protocol_stats);
+  size_t header_pos = out->len;
+  ProtocolStats header;
+  memset(&header, 0, sizeof(header));
+  output_buffer_write(out, (char const*)&header, sizeof(header));
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+
+  // LOCK ADMINISTRATIVE DATA
+  pthread_mutex_lock(&memleak_mutex);
+
+  header.flags = (snapshot ? protocol_stats_snapshot : 0) | (stats.recording ? protocol_stats_recording : 0);
+  if (!snapshot)
+  {
+    ++stats_tick;
+    stats_published = 1;
+  }
+  header.tick = stats_tick;
+  header.now = tm.tv_sec - application_start;
+  header.backtraces = stats.backtraces;
+  header.allocations = stats.allocations;
+  header.total_memory = stats.total_memory;
+  for (BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+  {
+    uint64_t checksum = entry_checksum(entry);
+    if (!checksum || (!snapshot && checksum == entry->published))
+      continue;
+    if (!snapshot)
+      entry->published = checksum;
+    ProtocolEntry pe;
+    pe.backtrace_nr = entry->backtrace_nr;
+    pe.interval_count = 0;
+    for (Interval* interval = entry->intervals; interval; interval = interval->next)
+      ++pe.interval_count;
+    pe.value_n = entry->value_n;
+    pe.allocations = entry->allocations;
+    output_buffer_write(out, (char const*)&pe, sizeof(pe));
+    for (Interval* interval = entry->intervals; interval; interval = interval->next)
+    {
+      ProtocolInterval pi;
+      pi.start = interval->start;
+      pi.end = interval->end;
+      pi.total_n = interval->total_n;
+      pi.n = interval->n;
+      pi.size = interval->size;
+      output_buffer_write(out, (char const*)&pi, sizeof(pi));
+    }
+    ++header.entry_count;
+  }
+  // Backtraces that were sent before but lost all their intervals.
+  for (BacktraceEntry* entry = stats.first_entry; entry && !snapshot; entry = entry->next)
+  {
+    if (entry->intervals || !entry->published)
+      continue;
+    uint32_t backtrace_nr = entry->backtrace_nr;
+    output_buffer_write(out, (char const*)&backtrace_nr, sizeof(backtrace_nr));
+    entry->published = 0;
+    ++header.removed_count;
+  }
+
+  // UNLOCK ADMINISTRATIVE DATA
+  pthread_mutex_unlock(&memleak_mutex);
+
+  memcpy(out->data + header_pos, &header, sizeof(header));
+  message_end(out, offset);
+}
+
+// Send the next delta to all subscribed clients.
+static void monitor_publish()
+{
+  Client* client = clients;
+  while (client && !client->subscribed)
+    client = client->next;
+  if (!client)
+  {
+    // Nobody needs to be told about removed backtraces anymore; a new subscriber starts with a snapshot.
+    pthread_mutex_lock(&memleak_mutex);
+    if (stats_published)
+      for (BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+        entry->published = 0;
+    stats_published = 0;
+    pthread_mutex_unlock(&memleak_mutex);
+    return;
+  }
+  OutputBuffer* delta = output_buffer_create(output_stats);
+  stats_message(delta, 0);
+  Client* next;
+  for (client = clients; client; client = next)
+  {
+    next = client->next;
+    if (!client->subscribed)
+      continue;
+    // A client that can't keep up skips deltas; it gets a snapshot once it caught up.
+    if (client_pending(client) >= CLIENT_OUTPUT_MAX)
+      client->need_snapshot = 1;
+    else
+    {
+      if (client->need_snapshot)
+        stats_message(client_output(client), 1);
+      else
+        output_buffer_write(client_output(client), delta->data, delta->len);
+      client->need_snapshot = 0;
+      client_flush(client);
+    }
+  }
+  output_buffer_destroy(delta);
+}
+
+// The aggregated printed intervals of a backtrace, for the metrics.
+struct MetricsBacktrace {
+  int backtrace_nr;
+  double value_n;
+  size_t n;                                     // Leaked allocations.
+  size_t size;                                  // Leaked bytes.
+  time_t duration;                              // The total duration of the intervals.
+};
+
+static void metrics_gauge(OutputBuffer* buf, char const* name, char const* help, double value)
+{
+  output_buffer_printf(buf, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", name, help, name, name, value);
+}
+
+// Rebuild the response to a scrape from the totals in HEADER and the COUNT intervals in ROWS.
+static void metrics_update(StatsHeader const* header, StatsRow const* rows, int count)
+{
+  if (metricsfd < 0)
+    return;
+  OutputBuffer* buf = output_buffer_create(output_stats);
+  metrics_gauge(buf, "memleak_total_memory_bytes", "Total size of all current allocations.", header->total_memory);
+  metrics_gauge(buf, "memleak_allocations", "Number of current allocations.", header->allocations);
+  metrics_gauge(buf, "memleak_backtraces", "Number of distinct allocation backtraces that are kept now.", header->entries);
+  metrics_gauge(buf, "memleak_intervals", "Number of recorded intervals.", header->intervals);
+  metrics_gauge(buf, "memleak_recording", "1 while an interval is being recorded.", header->recording ? 1 : 0);
+  metrics_gauge(buf, "memleak_uptime_seconds", "Seconds since the application started.", header->now);
+
+  // Rows of the same backtrace are adjacent.
+  struct MetricsBacktrace* backtraces = (*memleak_libc_malloc)((count + 1) * sizeof(struct MetricsBacktrace));
+  int nbt = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    if (nbt == 0 || backtraces[nbt - 1].backtrace_nr != rows[i].backtrace_nr)
+    {
+      backtraces[nbt].backtrace_nr = rows[i].backtrace_nr;
+      backtraces[nbt].value_n = rows[i].value_n;
+      backtraces[nbt].n = backtraces[nbt].size = 0;
+      backtraces[nbt].duration = 0;
+      ++nbt;
+    }
+    backtraces[nbt - 1].n += rows[i].interval.n;
+    backtraces[nbt - 1].size += rows[i].interval.size;
+    backtraces[nbt - 1].duration += rows[i].interval.end - rows[i].interval.start;
+  }
+  static char const* families[][2] = {
+    { "memleak_backtrace_value_n", "Leak probability value of a backtrace with the highest leak probability." },
+    { "memleak_backtrace_leaked_allocations", "Allocations that were not freed, in the printed intervals of the backtrace." },
+    { "memleak_backtrace_leaked_bytes", "Bytes that were not freed, in the printed intervals of the backtrace." },
+    { "memleak_backtrace_leak_rate", "Allocations per second that were not freed, over the printed intervals of the backtrace." },
+    { "memleak_backtrace_leak_bytes_per_second", "Bytes per second that were not freed, over the printed intervals of the backtrace." }
+  };
+  for (int f = 0; f < (int)(sizeof(families) / sizeof(families[0])); ++f)
+  {
+    output_buffer_printf(buf, "# HELP %s %s\n# TYPE %s gauge\n", families[f][0], families[f][1], families[f][0]);
+    for (int b = 0; b < nbt; ++b)
+    {
+      double duration = backtraces[b].duration > 0 ? backtraces[b].duration : 1;
+      double values[] = { backtraces[b].value_n, backtraces[b].n, backtraces[b].size, backtraces[b].n / duration, backtraces[b].size / duration };
+      output_buffer_printf(buf, "%s{backtrace=\"%d\"} %.17g\n", families[f][0], backtraces[b].backtrace_nr, values[f]);
+    }
+  }
+  (*memleak_libc_free)(backtraces);
+
+  output_buffer_printf(buf, "# HELP memleak_overhead_bytes Memory used by libmemleak itself.\n# TYPE memleak_overhead_bytes gauge\n");
+  output_buffer_printf(buf, "memleak_overhead_bytes{kind=\"headers\"} %lu\n", header->allocations * HEADER_OFFSET);
+  output_buffer_printf(buf, "memleak_overhead_bytes{kind=\"backtraces\"} %lu\n", sizeof(hashtable) + header->entries * sizeof(BacktraceEntry));
+  output_buffer_printf(buf, "memleak_overhead_bytes{kind=\"intervals\"} %lu\n", header->intervals * sizeof(Interval));
+
+  if (metrics)
+    output_buffer_destroy(metrics);
+  metrics = buf;
+}
+
+// Update the totals in the metrics while not recording.
+static void metrics_update_totals()
+{
+  if (metricsfd < 0)
+    return;
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  StatsHeader header;
+  header.appname = appname;
+  header.now = tm.tv_sec - application_start;
+  header.intervals = 0;
+  pthread_mutex_lock(&memleak_mutex);
+  header.backtraces = stats.backtraces;
+  header.entries = stats.entries;
+  header.allocations = stats.allocations;
+  header.total_memory = stats.total_memory;
+  header.recording = stats.recording;
+  for (BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+    for (Interval* interval = entry->intervals; interval; interval = interval->next)
+      ++header.intervals;
+  pthread_mutex_unlock(&memleak_mutex);
+  metrics_update(&header, NULL, 0);
+}
+
+// Answer the HTTP request of CLIENT on the metrics socket, once it was received completely.
+// Scrapes are served from the cached metrics only.
+static void metrics_request(Client* client)
+{
+  if (client->in_len < sizeof(client->in) &&
+      !memmem(client->in, client->in_len, "\r\n\r\n", 4) && !memmem(client->in, client->in_len, "\n\n", 2))
+    return;
+  OutputBuffer* out = client_output(client);
+  int head = client->in_len >= 5 && strncmp(client->in, "HEAD ", 5) == 0;
+  if (!head && (client->in_len < 4 || strncmp(client->in, "GET ", 4) != 0))
+    output_buffer_printf(out, "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+  else
+  {
+    output_buffer_printf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n"
+        "Connection: close\r\n\r\n", metrics->len);
+    if (!head)
+      output_buffer_write(out, metrics->data, metrics->len);
+  }
+  client->in_len = 0;
+  client->closing = 1;
+}
+
+// Send a stats report to all clients that asked for them and update the metrics. Called from memleak_stats.
+static void monitor_stats(StatsHeader const* header, StatsRow const* rows, int count)
+{
+  metrics_update(header, rows, count);
+  Client* next;
+  for (Client* client = clients; client; client = next)
+  {
+    next = client->next;
+    if (client->format < 0)
+      continue;
+    OutputBuffer* out = client_output(client);
+    size_t offset = message_begin(out, protocol_text);
+    format_stats(out, client->format, header, rows, count);
+    message_end(out, offset);
+    client_flush(client);
+  }
+}
+
+// Called every stats interval and after the commands start, restart and stats.
+static void monitor_tick(int timed_out)
+{
+  if (timed_out && !stats.recording)
+  {
+    // Only tracing and/or serving metrics.
+    if (trace_enabled)
+      memleak_sync_backtraces();
+    metrics_update_totals();
+    return;
+  }
+  ++tick_count;
+  if (tick_count % restart_multiplier == 0)
+    interval_restart_recording();
+  memleak_stats();
+  monitor_publish();
+}
+
+static char const* helptext[] = {
+  "help     : Print this help.\n",
+  "start    : Erase all intervals and start recording the first interval.\n",
+  "stop     : Stop recording.\n",
+  "restart  : Start a new interval. Keep, and possibly combine, previous intervals.\n",
+  "delete   : Delete the oldest interval.\n",
+  "stats    : Print overview of backtrace with highest leak probability.\n",
+  "stats N  : Automatically print stats every N seconds (use 0 to turn off).\n",
+  "restart M: Automatically restart every N * M stats.\n",
+  "list N   : When printing stats, print only the first N backtraces.\n",
+  "dump N   : Print backtrace number N.\n",
+  "trace on : Record all allocations and frees to the trace file.\n",
+  "trace off: Stop recording the trace.\n",
+  "format F : Send every stats report to this client in format F (text, json or csv; off to stop).\n",
+  "snapshot : Write all live allocations per backtrace to a file (snapshot FILE to choose its name).\n",
+  "marks    : List the marks made by the application with memleak_mark.\n",
+  "since N  : List the backtraces that own live allocations that were made after mark N.\n",
+  "score S  : Rank the backtraces with scorer S (value_n or trend).\n",
+  "lifetimes N: Print the histogram of the lifetimes of the freed allocations of backtrace N.\n",
+  "sizes N  : Print the histogram of the sizes of the live and all allocations of backtrace N.\n",
+  "churn    : List the backtraces with the highest allocation rate since churn reset.\n",
+  "churn N  : When listing churn, list only the first N backtraces.\n",
+  "churn by K: Rank churn by K (allocations, bytes or pairs).\n",
+  "churn reset: Start a new churn window.\n",
+  "latency on: Time all calls to the real allocator.\n",
+  "latency off: Stop timing the calls to the real allocator.\n",
+  "latency  : Print the latency of the real allocator and the backtraces with the most slow calls.\n",
+  "latency N: Print the latency histograms of backtrace N.\n",
+  "latency reset: Erase all latency histograms.\n",
+  "scan     : Stop the application and list the backtraces of allocations that are no longer referenced.\n",
+  "threads on: Record which thread makes and frees each allocation.\n",
+  "threads off: Stop recording threads.\n",
+  "threads sample N: Count one in N frees in the thread pairs of a backtrace.\n",
+  "threads  : List the current allocations and the cross thread frees per thread.\n",
+  "xfree    : List the backtraces with the most frees by another thread than the allocating one.\n",
+  "xfree N  : Print the sampled (allocating thread, freeing thread) pairs of backtrace N.\n",
+  "filter   : Print which allocations are tracked.\n",
+  "filter size MIN [MAX]: Only track allocations of MIN to MAX bytes.\n",
+  "filter tid TID: Only track allocations by thread TID (and other threads added to the filter).\n",
+  "filter name PREFIX: Only track allocations by threads whose name starts with PREFIX (idem).\n",
+  "filter off: Track all allocations again.\n",
+  "suppress : List the suppression rules.\n",
+  "suppress module PATTERN: Add all allocations by code of matching modules to a single backtrace.\n",
+  "suppress function PATTERN: Idem for allocations by matching functions, or functions called by them.\n",
+  "suppress file PATTERN: Idem for functions defined in matching source files.\n",
+  "suppress off: Remove all suppression rules.\n",
+  "shallow  : Print how many frames are taken per allocation.\n",
+  "shallow N: Take N frames, and all frames for the backtraces that rank in the top.\n",
+  "shallow off: Take all frames for every allocation.\n",
+  "lists    : Print which allocations are linked into the list of their backtrace.\n",
+  "lists all: Link all allocations (needed for scan, since and the ages in snapshot).\n",
+  "lists suspects: Only link new allocations of backtraces that ranked in the top; only count the others.\n",
+  "metadata : Print how much memory the backtraces use.\n",
+  "metadata max MB: Add the allocations with a new backtrace to a single one while the backtraces use MB megabytes (0: no limit).\n",
+  "metadata reclaim on: Free backtraces that have no allocations left (the default).\n",
+  "metadata reclaim off: Keep all backtraces.\n",
+  "sketch   : List the call sites with the most surviving allocations in the sketch, with error bounds.\n",
+  "sketch on: Only give call sites a backtrace once they are a heavy hitter; only count the others.\n",
+  "sketch off: Give every new call site a backtrace again.\n",
+  "sketch threshold N: Give a heavy hitter a backtrace once it has N surviving allocations.\n"
+};
+
+// Print the heavy hitters of the sketch to CLIENT.
+static void client_sketch(Client* client)
+{
+  SketchRow rows[sketch_heavy_max];
+  pthread_mutex_lock(&memleak_mutex);
+  int count = sketch_top(&sketch, rows);
+  int enabled = sketch.enabled;
+  uint64_t surviving = sketch.surviving;
+  uint64_t surviving_bytes = sketch.surviving_bytes;
+  uint64_t allocations = sketch.allocations;
+  uint64_t error = sketch_error(&sketch, 0);
+  uint64_t error_bytes = sketch_error(&sketch, 1);
+  int max = stats.max_backtraces;
+  pthread_mutex_unlock(&memleak_mutex);
+  sketch_sort(rows, count);
+  client_printf(client, "The sketch is %s; it counted %lu allocations, of which %lu (%lu bytes) are still alive.\n",
+      enabled ? "on" : "off", allocations, surviving, surviving_bytes);
+  client_printf(client, "Surviving counts are at most %lu allocations and %lu bytes too high (with 98%% probability).\n", error, error_bytes);
+  if (count > max)
+    count = max;
+  for (int i = 0; i < count; ++i)
+  {
+    SketchRow const* row = &rows[i];
+    client_printf(client, "Call site %d%s: %lu - %lu surviving allocations, at most %lu bytes; %lu - %lu allocations.\n",
+        i, row->materialized ? " (has a backtrace)" : "",
+        row->surviving > error ? row->surviving - error : 0, row->surviving, row->surviving_bytes,
+        row->allocations - row->allocations_error, row->allocations);
+    char* text;
+    size_t len;
+    FILE* fp = open_memstream(&text, &len);
+    addr2line_print(fp, (void**)row->frames, row->frame_count);
+    fclose(fp);
+    client_write(client, text, len);
+    free(text);
+  }
+}
+
+// Print the lifetime histogram of backtrace NR to CLIENT.
+static void client_lifetimes(Client* client, int nr)
+{
+  uint64_t lifetimes[lifetime_buckets];
+  pthread_mutex_lock(&memleak_mutex);
+  BacktraceEntry* entry = stats.first_entry;
+  while (entry && entry->backtrace_nr != nr)
+    entry = entry->next;
+  if (entry)
+    memcpy(lifetimes, entry->lifetimes, sizeof(lifetimes));
+  pthread_mutex_unlock(&memleak_mutex);
+  if (!entry)
+  {
+    client_printf(client, "Backtrace %d doesn't exist.\n", nr);
+    return;
+  }
+  uint64_t total = 0;
+  for (int bucket = 0; bucket < lifetime_buckets; ++bucket)
+    total += lifetimes[bucket];
+  client_printf(client, "Lifetimes of the %lu freed allocations of backtrace %d:\n", total, nr);
+  for (int bucket = 0; bucket < lifetime_buckets; ++bucket)
+  {
+    if (lifetimes[bucket] == 0)
+      continue;
+    char range[32];
+    if (bucket == 0)
+      snprintf(range, sizeof(range), "< 1 s");
+    else if (bucket == lifetime_buckets - 1)
+      snprintf(range, sizeof(range), ">= %d s", 1 << (bucket - 1));
+    else
+      snprintf(range, sizeof(range), "%d - %d s", 1 << (bucket - 1), (1 << bucket) - 1);
+    client_printf(client, "%15s: %10lu (%5.1f%%)\n", range, lifetimes[bucket], 100.0 * lifetimes[bucket] / total);
+  }
+}
+
+// Print the size class histograms of backtrace NR to CLIENT.
+static void client_sizes(Client* client, int nr)
+{
+  uint32_t live_sizes[size_classes];
+  uint32_t total_sizes[size_classes];
+  pthread_mutex_lock(&memleak_mutex);
+  BacktraceEntry* entry = stats.first_entry;
+  while (entry && entry->backtrace_nr != nr)
+    entry = entry->next;
+  if (entry)
+  {
+    memcpy(live_sizes, entry->live_sizes, sizeof(live_sizes));
+    memcpy(total_sizes, entry->total_sizes, sizeof(total_sizes));
+  }
+  pthread_mutex_unlock(&memleak_mutex);
+  if (!entry)
+  {
+    client_printf(client, "Backtrace %d doesn't exist.\n", nr);
+    return;
+  }
+  uint64_t live = 0, total = 0;
+  for (int sc = 0; sc < size_classes; ++sc)
+  {
+    live += live_sizes[sc];
+    total += total_sizes[sc];
+  }
+  client_printf(client, "Sizes of the %lu live and %lu total allocations of backtrace %d:\n", live, total, nr);
+  for (int sc = 0; sc < size_classes; ++sc)
+  {
+    if (total_sizes[sc] == 0)
+      continue;
+    char range[48];
+    if (sc == size_classes - 1)
+      snprintf(range, sizeof(range), ">= %lu", size_class_min(sc));
+    else if (size_class_min(sc + 1) - size_class_min(sc) == 1)
+      snprintf(range, sizeof(range), "%lu", size_class_min(sc));
+    else
+      snprintf(range, sizeof(range), "%lu - %lu", size_class_min(sc), size_class_min(sc + 1) - 1);
+    client_printf(client, "%21s bytes: %10u live, %10u%s total\n", range, live_sizes[sc], total_sizes[sc], total_sizes[sc] == UINT32_MAX ? "+" : "");
+  }
+}
+
+// Print the churn top to CLIENT.
+static void client_churn(Client* client)
+{
+  struct ChurnRow {
+    int backtrace_nr;
+    Churn churn;
+  } rows[churn_top_max];
+  struct timeval tm;
+  gettimeofday(&tm, NULL);
+  pthread_mutex_lock(&memleak_mutex);
+  int count = stats.churn.count;
+  for (int i = 0; i < count; ++i)
+  {
+    rows[i].backtrace_nr = stats.churn.entries[i]->backtrace_nr;
+    rows[i].churn = stats.churn.entries[i]->churn;
+  }
+  time_t window = tm.tv_sec - application_start - stats.churn.start;
+  int key = stats.churn.key;
+  size_t backtraces = stats.backtraces;
+  pthread_mutex_unlock(&memleak_mutex);
+  if (window < 1)
+    window = 1;
+  client_printf(client, "Churn by %s over the last %lu seconds (%d of %lu backtraces):\n",
+      churn_name(key), window, count, backtraces);
+  for (int i = 0; i < count; ++i)
+  {
+    Churn const* churn = &rows[i].churn;
+    uint64_t pairs = churn->frees < churn->allocations ? churn->frees : churn->allocations;
+    client_printf(client, "backtrace %d: %.1f allocations/s, %.0f bytes/s, %.1f pairs/s (%lu allocations, %lu bytes, %lu frees).\n",
+        rows[i].backtrace_nr, (double)churn->allocations / window, (double)churn->bytes / window, (double)pairs / window,
+        churn->allocations, churn->bytes, churn->frees);
+  }
+}
+
+// Print the range of latency bucket BUCKET in nanoseconds, given NS nanoseconds per tick, into BUF.
+static void latency_range(char* buf, size_t len, int bucket, double ns)
+{
+  if (bucket == latency_buckets - 1)
+    snprintf(buf, len, ">= %.0f ns", latency_bucket_min(bucket) * ns);
+  else
+    snprintf(buf, len, "%.0f - %.0f ns", latency_bucket_min(bucket) * ns, latency_bucket_min(bucket + 1) * ns);
+}
+
+// Return the bucket of HISTOGRAM, with CALLS calls in total, that contains the call at FRACTION.
+static int latency_percentile(uint64_t const* histogram, uint64_t calls, double fraction)
+{
+  uint64_t sum = 0;
+  for (int bucket = 0; bucket < latency_buckets; ++bucket)
+  {
+    sum += histogram[bucket];
+    if (sum >= fraction * calls)
+      return bucket;
+  }
+  return latency_buckets - 1;
+}
+
+// The slow calls of a backtrace.
+struct LatencyRow {
+  int backtrace_nr;
+  uint64_t slow_allocs;
+  uint64_t slow_frees;
+};
+
+// Sort on decreasing number of slow calls.
+static int compare_latency_rows(void const* p1, void const* p2)
+{
+  struct LatencyRow const* r1 = p1;
+  struct LatencyRow const* r2 = p2;
+  uint64_t slow1 = r1->slow_allocs + r1->slow_frees;
+  uint64_t slow2 = r2->slow_allocs + r2->slow_frees;
+  return slow1 < slow2 ? 1 : slow1 > slow2 ? -1 : 0;
+}
+
+// Print the global latency histograms and the backtraces with the most slow calls to CLIENT.
+static void client_latency(Client* client)
+{
+  double ns = latency_tick_ns();
+  client_printf(client, "Latency of the real allocator (timing is %s; slow is %.0f ns or more):\n",
+      latency_enabled ? "on" : "off", latency_bucket_min(latency_slow_bucket) * ns);
+  for (int op = 0; op < latency_ops; ++op)
+  {
+    uint64_t histogram[latency_buckets];
+    memcpy(histogram, latency_histograms[op], sizeof(histogram));
+    uint64_t calls = 0, slow = 0;
+    int max = 0;
+    for (int bucket = 0; bucket < latency_buckets; ++bucket)
+    {
+      calls += histogram[bucket];
+      if (bucket >= latency_slow_bucket)
+        slow += histogram[bucket];
+      if (histogram[bucket])
+        max = bucket;
+    }
+    if (calls == 0)
+      continue;
+    char median[48], p99[48], slowest[48];
+    latency_range(median, sizeof(median), latency_percentile(histogram, calls, 0.5), ns);
+    latency_range(p99, sizeof(p99), latency_percentile(histogram, calls, 0.99), ns);
+    latency_range(slowest, sizeof(slowest), max, ns);
+    client_printf(client, "%-8s: %10lu calls, %8lu slow; median %s, 99%% %s, max %s\n",
+        latency_name(op), calls, slow, median, p99, slowest);
+  }
+  pthread_mutex_lock(&memleak_mutex);
+  // See memleak_snapshot.
+  pin_entries();
+  BacktraceEntry* first = stats.first_entry;
+  size_t capacity = stats.entries;
+  pthread_mutex_unlock(&memleak_mutex);
+  struct LatencyRow* rows = (*memleak_libc_malloc)((capacity + 1) * sizeof(struct LatencyRow));
+  size_t count = 0;
+  for (BacktraceEntry* entry = first; entry && count < capacity; entry = entry->next)
+  {
+    struct LatencyRow* row = &rows[count];
+    row->backtrace_nr = entry->backtrace_nr;
+    row->slow_allocs = row->slow_frees = 0;
+    for (int bucket = latency_slow_bucket; bucket < latency_buckets; ++bucket)
+    {
+      row->slow_allocs += entry->alloc_latency[bucket];
+      row->slow_frees += entry->free_latency[bucket];
+    }
+    if (row->slow_allocs + row->slow_frees > 0)
+      ++count;
+  }
+  unpin_entries();
+  qsort(rows, count, sizeof(struct LatencyRow), compare_latency_rows);
+  for (size_t i = 0; i < count && i < (size_t)stats.max_backtraces; ++i)
+    client_printf(client, "backtrace %d: %lu slow allocations, %lu slow frees.\n",
+        rows[i].backtrace_nr, rows[i].slow_allocs, rows[i].slow_frees);
+  (*memleak_libc_free)(rows);
+}
+
+// Print the latency histograms of backtrace NR to CLIENT.
+static void client_latency_backtrace(Client* client, int nr)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  pin_entries();
+  BacktraceEntry* entry = stats.first_entry;
+  while (entry && entry->backtrace_nr != nr)
+    entry = entry->next;
+  pthread_mutex_unlock(&memleak_mutex);
+  if (!entry)
+  {
+    unpin_entries();
+    client_printf(client, "Backtrace %d doesn't exist.\n", nr);
+    return;
+  }
+  double ns = latency_tick_ns();
+  client_printf(client, "Latency of the real allocator calls of backtrace %d:\n", nr);
+  for (int bucket = 0; bucket < latency_buckets; ++bucket)
+  {
+    // Updated without the lock; the entry is pinned, so it stays alive.
+    uint64_t allocs = __atomic_load_n(&entry->alloc_latency[bucket], __ATOMIC_RELAXED);
+    uint64_t frees = __atomic_load_n(&entry->free_latency[bucket], __ATOMIC_RELAXED);
+    if (allocs == 0 && frees == 0)
+      continue;
+    char range[48];
+    latency_range(range, sizeof(range), bucket, ns);
+    client_printf(client, "%24s: %10lu allocations, %10lu frees\n", range, allocs, frees);
+  }
+  unpin_entries();
+}
+
+// The unreachable allocations of a backtrace.
+struct ScanRow {
+  BacktraceEntry* entry;
+  size_t n;
+  size_t size;
+};
+
+// Sort on entry.
+static int compare_scan_entries(void const* p1, void const* p2)
+{
+  struct ScanRow const* r1 = p1;
+  struct ScanRow const* r2 = p2;
+  return r1->entry < r2->entry ? -1 : r1->entry > r2->entry ? 1 : 0;
+}
+
+// Sort on decreasing size.
+static int compare_scan_rows(void const* p1, void const* p2)
+{
+  struct ScanRow const* r1 = p1;
+  struct ScanRow const* r2 = p2;
+  return r1->size < r2->size ? 1 : r1->size > r2->size ? -1 : 0;
+}
+
+// Stop the application, find the allocations that can't be reached anymore and print them, per backtrace, to CLIENT.
+static void client_scan(Client* client)
+{
+  int workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  char const* workers_str = getenv("LIBMEMLEAK_SCAN_THREADS");
+  if (workers_str && atoi(workers_str) > 0)
+    workers = atoi(workers_str) - 1;
+  else if (workers > 7)
+    workers = 7;
+  ScanState* scan = scan_prepare(workers);
+  if (!scan)
+  {
+    client_printf(client, "Failed to prepare the scan: %s\n", strerror(errno));
+    return;
+  }
+  ScanResult result;
+  // Nothing may call malloc while the lock is held, but just in case make this thread's allocations bypass it.
+  int was_inside_memleak_stats = inside_memleak_stats;
+  inside_memleak_stats = 1;
+  pthread_mutex_lock(&memleak_mutex);
+  size_t count = 0;
+  size_t allocations = stats.allocations;
+  ScanBlock* blocks = scan_blocks(scan, stats.allocations);
+  int ret = -1;
+  if (blocks)
+  {
+    for (BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+    {
+      Header* end = &entry->head;
+      for (Header* h = end->next; h != end && count < stats.allocations; h = h->next)
+      {
+        blocks[count].start = (uintptr_t)h + HEADER_OFFSET;
+        blocks[count].size = h->size;
+        blocks[count].entry = entry;
+        ++count;
+      }
+    }
+    ret = scan_run(scan, count, &result);
+  }
+  pthread_mutex_unlock(&memleak_mutex);
+  inside_memleak_stats = was_inside_memleak_stats;
+  if (ret == -1)
+  {
+    client_printf(client, "The scan failed: out of memory.\n");
+    scan_finish(scan);
+    return;
+  }
+
+  // Group the unreachable allocations by backtrace.
+  struct ScanRow* rows = (*memleak_libc_malloc)((result.unreachable + 1) * sizeof(struct ScanRow));
+  size_t unreachable = 0;
+  size_t unreachable_size = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (scan_reachable(scan, i))
+      continue;
+    ScanBlock const* block = scan_block(scan, i);
+    rows[unreachable].entry = block->entry;
+    rows[unreachable].n = 1;
+    rows[unreachable].size = block->size;
+    unreachable_size += block->size;
+    ++unreachable;
+  }
+  scan_finish(scan);
+  qsort(rows, unreachable, sizeof(struct ScanRow), compare_scan_entries);
+  size_t backtraces = 0;
+  for (size_t i = 0; i < unreachable; ++i)
+  {
+    if (backtraces > 0 && rows[backtraces - 1].entry == rows[i].entry)
+    {
+      ++rows[backtraces - 1].n;
+      rows[backtraces - 1].size += rows[i].size;
+    }
+    else
+      rows[backtraces++] = rows[i];
+  }
+  qsort(rows, backtraces, sizeof(struct ScanRow), compare_scan_rows);
+
+  client_printf(client, "Scanned %lu allocations from %lu bytes of roots of %lu threads, using %d threads.\n",
+      result.blocks, result.root_bytes, result.threads, result.workers);
+  client_printf(client, "The application was stopped for %.1f ms, after sorting the allocations took %.1f ms.\n",
+      result.pause_ms, result.index_ms);
+  if (result.unstopped > 0)
+    client_printf(client, "Warning: %lu threads could not be stopped; some allocations might be reported unreachable wrongly.\n", result.unstopped);
+  // Allocations that aren't in the list of their backtrace can't be found, so they are neither scanned nor reported.
+  if (count < allocations)
+    client_printf(client, "Warning: %lu allocations are not linked (lists suspects or sketch on) and were not scanned; "
+        "allocations that are only referenced by them are reported unreachable wrongly.\n", allocations - count);
+  if (__atomic_load_n(&filter_skipped, __ATOMIC_RELAXED) > 0)
+    client_printf(client, "Warning: allocations that were not tracked because of the filter were not scanned; "
+        "allocations that are only referenced by them are reported unreachable wrongly.\n");
+  client_printf(client, "%lu allocations (%lu bytes) in %lu backtraces are unreachable.\n", unreachable, unreachable_size, backtraces);
+  for (size_t i = 0; i < backtraces && i < (size_t)stats.max_backtraces; ++i)
+    client_printf(client, "backtrace %d: %lu unreachable allocations, %lu bytes.\n", rows[i].entry->backtrace_nr, rows[i].n, rows[i].size);
+  (*memleak_libc_free)(rows);
+}
+
+// Print the name of the thread with kernel thread ID TID into NAME.
+static void thread_name(pid_t tid, char* name, size_t len)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  ssize_t n = fd >= 0 ? read(fd, name, len - 1) : -1;
+  if (fd >= 0)
+    close(fd);
+  if (n <= 0)
+  {
+    snprintf(name, len, "(exited)");
+    return;
+  }
+  name[n] = 0;
+  if (name[n - 1] == '\n')
+    name[n - 1] = 0;
+}
+
+// Print the per thread statistics to CLIENT.
+static void client_threads(Client* client)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  int count = threads_used;
+  struct ThreadInfo* copy = (*memleak_libc_malloc)(count * sizeof(struct ThreadInfo));
+  memcpy(copy, threads, count * sizeof(struct ThreadInfo));
+  pthread_mutex_unlock(&memleak_mutex);
+  client_printf(client, "Thread tracking is %s; %d threads allocated memory while tracked.\n", thread_tracking ? "on" : "off", count - 1);
+  for (int i = 1; i < count; ++i)
+  {
+    struct ThreadInfo const* thread = &copy[i];
+    char name[32];
+    thread_name(thread->tid, name, sizeof(name));
+    client_printf(client, "thread %d (%d, %s): %lu allocations, %lu bytes; %lu allocated, %lu freed of which %lu by another thread.\n",
+        i, thread->tid, name, thread->allocations, thread->size, thread->total_allocations, thread->frees, thread->cross_thread_frees);
+  }
+  if (count == THREADS_MAX)
+    client_printf(client, "Thread %d includes all threads that started after it.\n", THREADS_MAX - 1);
+  (*memleak_libc_free)(copy);
+}
+
+// The cross thread frees of a backtrace.
+struct XfreeRow {
+  int backtrace_nr;
+  uint64_t frees;
+  uint64_t cross_thread_frees;
+};
+
+// Sort on decreasing number of cross thread frees.
+static int compare_xfree_rows(void const* p1, void const* p2)
+{
+  struct XfreeRow const* r1 = p1;
+  struct XfreeRow const* r2 = p2;
+  return r1->cross_thread_frees < r2->cross_thread_frees ? 1 : r1->cross_thread_frees > r2->cross_thread_frees ? -1 : 0;
+}
+
+// Print the backtraces with the most cross thread frees to CLIENT.
+static void client_xfree(Client* client)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  // See memleak_snapshot.
+  pin_entries();
+  BacktraceEntry* first = stats.first_entry;
+  size_t capacity = stats.entries;
+  pthread_mutex_unlock(&memleak_mutex);
+  struct XfreeRow* rows = (*memleak_libc_malloc)((capacity + 1) * sizeof(struct XfreeRow));
+  size_t count = 0;
+  uint64_t frees = 0, cross_thread_frees = 0;
+  for (BacktraceEntry* entry = first; entry && count < capacity; entry = entry->next)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    rows[count].backtrace_nr = entry->backtrace_nr;
+    rows[count].frees = entry->thread_frees;
+    rows[count].cross_thread_frees = entry->cross_thread_frees;
+    pthread_mutex_unlock(&memleak_mutex);
+    frees += rows[count].frees;
+    cross_thread_frees += rows[count].cross_thread_frees;
+    if (rows[count].cross_thread_frees > 0)
+      ++count;
+  }
+  unpin_entries();
+  qsort(rows, count, sizeof(struct XfreeRow), compare_xfree_rows);
+  client_printf(client, "%lu of %lu frees of tracked allocations were made by another thread, in %lu backtraces.\n",
+      cross_thread_frees, frees, count);
+  for (size_t i = 0; i < count && i < (size_t)stats.max_backtraces; ++i)
+    client_printf(client, "backtrace %d: %lu of %lu frees by another thread (%.1f%%).\n", rows[i].backtrace_nr,
+        rows[i].cross_thread_frees, rows[i].frees, 100.0 * rows[i].cross_thread_frees / rows[i].frees);
+  (*memleak_libc_free)(rows);
+}
+
+// Print the sampled thread pairs of backtrace NR to CLIENT.
+static void client_xfree_backtrace(Client* client, int nr)
+{
+  ThreadPair pairs[thread_pairs_max];
+  pid_t tids[thread_pairs_max][2];
+  pthread_mutex_lock(&memleak_mutex);
+  BacktraceEntry* entry = stats.first_entry;
+  while (entry && entry->backtrace_nr != nr)
+    entry = entry->next;
+  if (entry)
+  {
+    memcpy(pairs, entry->thread_pairs, sizeof(pairs));
+    for (int i = 0; i < thread_pairs_max; ++i)
+    {
+      tids[i][0] = threads[pairs[i].alloc_thread].tid;
+      tids[i][1] = threads[pairs[i].free_thread].tid;
+    }
+  }
+  pthread_mutex_unlock(&memleak_mutex);
+  if (!entry)
+  {
+    client_printf(client, "Backtrace %d doesn't exist.\n", nr);
+    return;
+  }
+  client_printf(client, "Sampled frees (one in %d) of backtrace %d by allocating and freeing thread:\n", thread_sample_rate, nr);
+  for (int i = 0; i < thread_pairs_max; ++i)
+  {
+    if (pairs[i].count == 0)
+      continue;
+    client_printf(client, "thread %d (%d) -> thread %d (%d): %u%s\n", pairs[i].alloc_thread, tids[i][0],
+        pairs[i].free_thread, tids[i][1], pairs[i].count, pairs[i].alloc_thread == pairs[i].free_thread ? "" : " (cross thread)");
+  }
+}
+
+// The live allocations of a backtrace that were made after a mark.
+struct SinceRow {
+  int backtrace_nr;
+  size_t n;
+  size_t size;
+};
+
+// Sort on decreasing size.
+static int compare_since_rows(void const* p1, void const* p2)
+{
+  struct SinceRow const* r1 = p1;
+  struct SinceRow const* r2 = p2;
+  return r1->size < r2->size ? 1 : r1->size > r2->size ? -1 : 0;
+}
+
+// Count the live allocations of ENTRY that were made after mark MARK, that was made at MARK_TIME, into ROW.
+// Called with memleak_mutex locked.
+static void since_count(BacktraceEntry* entry, uint32_t mark, time_t mark_time, struct SinceRow* row)
+{
+  // Allocations are ordered from new to old, and so are their epochs. An interval that started
+  // after the mark only has allocations that were made after the mark: use its totals. Those
+  // also count the allocations that aren't linked, so only when there are none.
+  Header* end = &entry->head;
+  Header* h = end->next;
+  while (h != end && h->epoch >= mark)
+  {
+    Interval* interval = h->interval;
+    if (interval && interval->start > mark_time && !entry->unlinked)
+    {
+      // H is the newest allocation of this interval and interval->first its oldest.
+      row->n += interval->n;
+      row->size += interval->size;
+      h = interval->first->next;
+    }
+    else
+    {
+      ++row->n;
+      row->size += h->size;
+      h = h->next;
+    }
+  }
+}
+
+// Print the marks to CLIENT.
+static void client_marks(Client* client)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  uint32_t last = mark_epoch;
+  pthread_mutex_unlock(&memleak_mutex);
+  if (last == 0)
+    client_printf(client, "No marks were made.\n");
+  // Marks never change once they are made.
+  for (uint32_t mark = 1; mark <= last; ++mark)
+    client_printf(client, "mark %u at %lu seconds: %s\n", mark, marks[mark].time, marks[mark].name);
+}
+
+// Print the backtraces that own live allocations that were made after MARK to CLIENT.
+static void client_since(Client* client, int mark)
+{
+  pthread_mutex_lock(&memleak_mutex);
+  uint32_t last = mark_epoch;
+  // See memleak_snapshot.
+  pin_entries();
+  BacktraceEntry* first = stats.first_entry;
+  size_t capacity = stats.entries;
+  pthread_mutex_unlock(&memleak_mutex);
+  if (mark < 1 || (uint32_t)mark > last)
+  {
+    unpin_entries();
+    client_printf(client, "Mark %d doesn't exist.\n", mark);
+    return;
+  }
+  time_t mark_time = marks[mark].time;
+  struct SinceRow* rows = (*memleak_libc_malloc)((capacity + 1) * sizeof(struct SinceRow));
+  size_t count = 0;
+  size_t total_n = 0;
+  size_t total_size = 0;
+  size_t unlinked = 0;
+  for (BacktraceEntry* entry = first; entry && count < capacity; entry = entry->next)
+  {
+    struct SinceRow* row = &rows[count];
+    row->backtrace_nr = entry->backtrace_nr;
+    row->n = row->size = 0;
+    pthread_mutex_lock(&memleak_mutex);
+    since_count(entry, mark, mark_time, row);
+    unlinked += entry->unlinked;
+    pthread_mutex_unlock(&memleak_mutex);
+    if (row->n == 0)
+      continue;
+    total_n += row->n;
+    total_size += row->size;
+    ++count;
+  }
+  unpin_entries();
+  qsort(rows, count, sizeof(struct SinceRow), compare_since_rows);
+  client_printf(client, "Since mark %d (\"%s\" at %lu seconds): %lu allocations, %lu bytes in %lu backtraces.\n",
+      mark, marks[mark].name, mark_time, total_n, total_size, count);
+  for (size_t i = 0; i < count && i < (size_t)stats.max_backtraces; ++i)
+    client_printf(client, "backtrace %d: %lu allocations, %lu bytes.\n", rows[i].backtrace_nr, rows[i].n, rows[i].size);
+  if (unlinked)
+    client_printf(client, "Not counted: %lu live allocations that were made while their backtrace wasn't linked (see 'lists').\n", unlinked);
+  (*memleak_libc_free)(rows);
+}
+
+// Execute the command CMD received from CLIENT.
+static void client_command(Client* client, char const* cmd)
+{
+  if (strcmp(cmd, "help") == 0)
+  {
+    for (size_t line = 0; line < sizeof(helptext) / sizeof(char*); ++line)
+      client_write(client, helptext[line], strlen(helptext[line]));
+  }
+  else if ((!stats.recording && strcmp(cmd, "start") == 0) ||
+           ( stats.recording && strcmp(cmd, "restart") == 0))
+  {
+    tick_count = -1;
+    client_printf(client, "Auto restart interval is %d * %lu seconds.\n", restart_multiplier, stats_interval);
+    monitor_tick(0);
+    monitor_arm_timer();
+  }
+  else if (stats.recording && strcmp(cmd, "stop") == 0)
+  {
+    interval_stop_recording();
+    client_write(client, "Stopped.\n", 9);
+    monitor_arm_timer();
+    monitor_publish();
+  }
+  else if (strcmp(cmd, "delete") == 0)
+  {
+    client_printf(client, "Deleting all intervals that end before %lu seconds since application start.\n", stats.oldest_interval_end);
+    interval_delete(stats.oldest_interval_end);
+    monitor_publish();
+  }
+  else if (strcmp(cmd, "stats") == 0)
+  {
+    monitor_tick(0);
+    monitor_arm_timer();
+  }
+  else if (strncmp(cmd, "stats ", 6) == 0)
+  {
+    int arg = atoi(cmd + 6);
+    if (arg >= 1)
+    {
+      stats_interval = arg;
+      client_printf(client, "Printing memory statistics every %lu seconds.\n", stats_interval);
+      monitor_arm_timer();
+    }
+    else
+      client_printf(client, "Interval between printing of stats must be at least 1 second.\n");
+  }
+  else if (strncmp(cmd, "restart ", 8) == 0)
+  {
+    int arg = atoi(cmd + 8);
+    if (arg >= 2)
+    {
+      restart_multiplier = arg;
+      client_printf(client, "Restart multiplier set to %d.\n", restart_multiplier);
+    }
+    else
+      client_printf(client, "Restart multiplier must be at least 2.\n");
+  }
+  else if (strncmp(cmd, "list ", 5) == 0)
+  {
+    int arg = atoi(cmd + 5);
+    if (arg >= 1)
+    {
+      stats.max_backtraces = arg;
+      if (stats.max_backtraces == 1)
+        client_printf(client, "Now printing only the first backtrace.\n");
+      else
+        client_printf(client, "Now printing the first %d backtraces.\n", stats.max_backtraces);
+    }
+    else
+      client_printf(client, "Argument of list must be at least 1.\n");
+  }
+  else if (strncmp(cmd, "dump ", 5) == 0)
+  {
+    int arg = atoi(cmd + 5);
+    pthread_mutex_lock(&memleak_mutex);
+    pin_entries();
+
+    BacktraceEntry* entry = stats.first_entry_n;
+    while (entry && entry->backtrace_nr != arg)
+      entry = entry->next_n;
+
+    pthread_mutex_unlock(&memleak_mutex);
+    if (entry)
+    {
+      char* text;
+      size_t len;
+      FILE* fp = open_memstream(&text, &len);
+      addr2line_print(fp, entry->ptr, entry->backtrace_size);
+      fclose(fp);
+      client_write(client, text, len);
+      free(text);
+    }
+    else
+      client_printf(client, "Backtrace %d doesn't exist.\n", arg);
+    unpin_entries();
+  }
+  else if (strcmp(cmd, "trace on") == 0 || strcmp(cmd, "trace off") == 0)
+  {
+    int on = cmd[7] == 'n';
+    char const* prefix = trace_enable(on);
+    if (on)
+      client_printf(client, "Tracing to \"%s.N\".\n", prefix);
+    else
+      client_printf(client, "Tracing stopped.\n");
+    output_printf(output_stats, "libmemleak: Tracing %s.\n", on ? "started" : "stopped");
+    monitor_arm_timer();
+  }
+  else if (strcmp(cmd, "snapshot") == 0 || strncmp(cmd, "snapshot ", 9) == 0)
+  {
+    char path[256];
+    if (cmd[8] && cmd[9])
+      strncpy(path, cmd + 9, sizeof(path) - 1);
+    else
+    {
+      struct timeval tm;
+      gettimeofday(&tm, NULL);
+      snprintf(path, sizeof(path), "memleak_snapshot.%lu", tm.tv_sec - application_start);
+    }
+    path[sizeof(path) - 1] = 0;
+    SnapshotHeader header;
+    int error = memleak_snapshot(path, &header);
+    if (error)
+      client_printf(client, "%s: %s\n", path, strerror(error));
+    else
+    {
+      client_printf(client, "Wrote %lu allocations (%lu bytes) of %lu backtraces to \"%s\".\n",
+          header.allocations, header.total_memory, header.record_count, path);
+      if (header.unknown_age)
+        client_printf(client, "The age of %lu of those allocations isn't known, because they aren't linked (see 'lists').\n", header.unknown_age);
+      output_printf(output_stats, "libmemleak: Wrote snapshot \"%s\".\n", path);
+    }
+  }
+  else if (strcmp(cmd, "marks") == 0)
+    client_marks(client);
+  else if (strncmp(cmd, "since ", 6) == 0)
+    client_since(client, atoi(cmd + 6));
+  else if (strncmp(cmd, "lifetimes ", 10) == 0)
+    client_lifetimes(client, atoi(cmd + 10));
+  else if (strcmp(cmd, "filter") == 0)
+  {
+    pthread_mutex_lock(&filter_mutex);
+    struct Filter copy = filter;
+    pthread_mutex_unlock(&filter_mutex);
+    if (copy.max_size == SIZE_MAX)
+      client_printf(client, "Tracking allocations of %lu bytes or more", copy.min_size);
+    else
+      client_printf(client, "Tracking allocations of %lu to %lu bytes", copy.min_size, copy.max_size);
+    if (copy.tid_count == 0 && copy.name_count == 0)
+      client_printf(client, " by all threads.\n");
+    else
+    {
+      client_printf(client, " by the threads:\n");
+      for (int i = 0; i < copy.tid_count; ++i)
+        client_printf(client, "  %d\n", copy.tids[i]);
+      for (int i = 0; i < copy.name_count; ++i)
+        client_printf(client, "  %s*\n", copy.names[i]);
+    }
+    client_printf(client, "%lu allocations were not tracked.\n", __atomic_load_n(&filter_skipped, __ATOMIC_RELAXED));
+  }
+  else if (strncmp(cmd, "filter ", 7) == 0)
+  {
+    char reply[128];
+    filter_command(cmd + 7, reply, sizeof(reply));
+    client_printf(client, "%s", reply);
+  }
+  else if (strcmp(cmd, "shallow") == 0)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    int depth = backtrace_depth;
+    int suspects = suspect_count;
+    pthread_mutex_unlock(&memleak_mutex);
+    if (depth == backtrace_size_max)
+      client_printf(client, "Taking up to %d frames per allocation.\n", backtrace_size_max);
+    else
+      client_printf(client, "Taking %d frames per allocation; %d suspects get up to %d frames (%lu times so far).\n",
+          depth, suspects, backtrace_size_max, __atomic_load_n(&deep_captures, __ATOMIC_RELAXED));
+  }
+  else if (strcmp(cmd, "shallow off") == 0)
+  {
+    set_backtrace_depth(backtrace_size_max);
+    client_printf(client, "Taking up to %d frames per allocation.\n", backtrace_size_max);
+  }
+  else if (strncmp(cmd, "shallow ", 8) == 0)
+  {
+    int arg = atoi(cmd + 8);
+    if (arg >= 1 && arg < backtrace_size_max)
+    {
+      set_backtrace_depth(arg);
+      client_printf(client, "Taking %d frames per allocation, except for suspects.\n", arg);
+    }
+    else
+      client_printf(client, "Usage: shallow N, with 1 <= N < %d, or shallow off.\n", backtrace_size_max);
+  }
+  else if (strcmp(cmd, "metadata") == 0)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    size_t entries = stats.entries;
+    size_t max = metadata_max;
+    size_t reclaimed = reclaimed_entries;
+    size_t folded = folded_allocations;
+    pthread_mutex_unlock(&memleak_mutex);
+    client_printf(client, "%lu backtraces use %lu bytes", entries, entries * sizeof(BacktraceEntry));
+    if (max)
+      client_printf(client, " (limit %lu bytes).\n", max);
+    else
+      client_printf(client, " (no limit).\n");
+    client_printf(client, "%lu backtraces without allocations were reclaimed%s; %lu allocations were added to the other backtrace.\n",
+        reclaimed, reclaim ? "" : " (reclaiming is off)", folded);
+  }
+  else if (strncmp(cmd, "metadata max ", 13) == 0)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    metadata_max = (size_t)atoi(cmd + 13) << 20;
+    pthread_mutex_unlock(&memleak_mutex);
+    if (metadata_max)
+      client_printf(client, "Limiting the backtraces to %d MB.\n", atoi(cmd + 13));
+    else
+      client_printf(client, "The backtraces can use any amount of memory.\n");
+  }
+  else if (strcmp(cmd, "metadata reclaim on") == 0 || strcmp(cmd, "metadata reclaim off") == 0)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    reclaim = cmd[18] == 'n';
+    pthread_mutex_unlock(&memleak_mutex);
+    client_printf(client, "Backtraces without allocations are %s.\n", reclaim ? "reclaimed" : "kept");
+  }
+  else if (strcmp(cmd, "lists") == 0)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    int all = link_all;
+    size_t linked = 0;
+    for (BacktraceEntry* entry = stats.first_entry; entry; entry = entry->next)
+      linked += entry->linked;
+    size_t backtraces = stats.backtraces;
+    pthread_mutex_unlock(&memleak_mutex);
+    client_printf(client, "Linking the allocations of %s: %lu of %lu backtraces.\n", all ? "all backtraces" : "suspects", linked, backtraces);
+  }
+  else if (strcmp(cmd, "lists all") == 0 || strcmp(cmd, "lists suspects") == 0)
+  {
+    int all = cmd[6] == 'a';
+    set_link_all(all);
+    client_printf(client, "Linking the new allocations of %s.\n", all ? "all backtraces" : "suspects only");
+  }
+  else if (strcmp(cmd, "sketch") == 0)
+    client_sketch(client);
+  else if (strcmp(cmd, "sketch on") == 0 || strcmp(cmd, "sketch off") == 0)
+  {
+    int on = cmd[8] == 'n';
+    set_sketch(on);
+    if (on)
+      client_printf(client, "Only giving heavy hitters a backtrace, once they have %lu surviving allocations.\n", sketch.threshold);
+    else
+      client_printf(client, "Giving every new call site a backtrace.\n");
+  }
+  else if (strncmp(cmd, "sketch threshold ", 17) == 0)
+  {
+    int arg = atoi(cmd + 17);
+    if (arg >= 1)
+    {
+      pthread_mutex_lock(&memleak_mutex);
+      sketch.threshold = arg;
+      pthread_mutex_unlock(&memleak_mutex);
+      client_printf(client, "Giving heavy hitters a backtrace once they have %d surviving allocations.\n", arg);
+    }
+    else
+      client_printf(client, "Argument of sketch threshold must be at least 1.\n");
+  }
+  else if (strcmp(cmd, "suppress") == 0)
+  {
+    if (suppress_rule_count() == 0)
+      client_printf(client, "There are no suppression rules.\n");
+    for (int i = 0; i < suppress_rule_count(); ++i)
+    {
+      int ranges;
+      char const* rule = suppress_rule(i, &ranges);
+      client_printf(client, "%-60s %6d ranges\n", rule, ranges);
+    }
+    pthread_mutex_lock(&memleak_mutex);
+    int count = suppress_set ? suppress_set->count : 0;
+    size_t total = suppressed_total;
+    pthread_mutex_unlock(&memleak_mutex);
+    client_printf(client, "%lu allocations were suppressed, by %d address ranges.\n", total, count);
+  }
+  else if (strncmp(cmd, "suppress ", 9) == 0)
+  {
+    char reply[160];
+    suppress_command(cmd + 9, reply, sizeof(reply));
+    client_printf(client, "%s", reply);
+  }
+  else if (strcmp(cmd, "threads") == 0)
+    client_threads(client);
+  else if (strcmp(cmd, "threads on") == 0 || strcmp(cmd, "threads off") == 0)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    thread_tracking = cmd[9] == 'n';
+    pthread_mutex_unlock(&memleak_mutex);
+    client_printf(client, "Thread tracking is %s.\n", thread_tracking ? "on" : "off");
+  }
+  else if (strncmp(cmd, "threads sample ", 15) == 0)
+  {
+    int arg = atoi(cmd + 15);
+    if (arg >= 1)
+    {
+      thread_sample_rate = arg;
+      client_printf(client, "Sampling one in %d frees.\n", thread_sample_rate);
+    }
+    else
+      client_printf(client, "Argument of threads sample must be at least 1.\n");
+  }
+  else if (strcmp(cmd, "xfree") == 0)
+    client_xfree(client);
+  else if (strncmp(cmd, "xfree ", 6) == 0)
+    client_xfree_backtrace(client, atoi(cmd + 6));
+  else if (strcmp(cmd, "scan") == 0)
+    client_scan(client);
+  else if (strcmp(cmd, "latency") == 0)
+    client_latency(client);
+  else if (strcmp(cmd, "latency on") == 0 || strcmp(cmd, "latency off") == 0)
+  {
+    latency_enable(cmd[9] == 'n');
+    client_printf(client, "Timing of the real allocator is %s.\n", latency_enabled ? "on" : "off");
+  }
+  else if (strcmp(cmd, "latency reset") == 0)
+  {
+    pthread_mutex_lock(&memleak_mutex);
+    latency_reset(stats.first_entry);
+    pthread_mutex_unlock(&memleak_mutex);
+    client_printf(client, "Erased all latency histograms.\n");
+  }
+  else if (strncmp(cmd, "latency ", 8) == 0)
+    client_latency_backtrace(client, atoi(cmd + 8));
+  else if (strcmp(cmd, "churn") == 0)
+    client_churn(client);
+  else if (strcmp(cmd, "churn reset") == 0)
+  {
+    struct timeval tm;
+    gettimeofday(&tm, NULL);
+    pthread_mutex_lock(&memleak_mutex);
+    churn_reset(&stats.churn, tm.tv_sec - application_start);
+    pthread_mutex_unlock(&memleak_mutex);
+    client_printf(client, "Started a new churn window.\n");
+  }
+  else if (strncmp(cmd, "churn by ", 9) == 0)
+  {
+    int key = churn_parse(cmd + 9);
+    if (key < 0)
+      client_printf(client, "Unknown churn key \"%s\"; use allocations, bytes or pairs.\n", cmd + 9);
+    else
+    {
+      pthread_mutex_lock(&memleak_mutex);
+      stats.churn.key = key;
+      churn_rebuild(&stats.churn, stats.first_entry);
+      pthread_mutex_unlock(&memleak_mutex);
+      client_printf(client, "Ranking churn by %s.\n", churn_name(key));
+    }
+  }
+  else if (strncmp(cmd, "churn ", 6) == 0)
+  {
+    int arg = atoi(cmd + 6);
+    if (arg >= 1 && arg <= churn_top_max)
+    {
+      pthread_mutex_lock(&memleak_mutex);
+      stats.churn.limit = arg;
+      churn_rebuild(&stats.churn, stats.first_entry);
+      pthread_mutex_unlock(&memleak_mutex);
+      client_printf(client, "Now listing the first %d backtraces by churn.\n", arg);
+    }
+    else
+      client_printf(client, "Argument of churn must be between 1 and %d.\n", churn_top_max);
+  }
+  else if (strncmp(cmd, "sizes ", 6) == 0)
+    client_sizes(client, atoi(cmd + 6));
+  else if (strncmp(cmd, "score ", 6) == 0)
+  {
+    int scorer = score_parse(cmd + 6);
+    if (scorer >= 0)
+    {
+      pthread_mutex_lock(&memleak_mutex);
+      stats.scorer = scorer;
+      pthread_mutex_unlock(&memleak_mutex);
+      client_printf(client, "Ranking backtraces by %s.\n", score_name(scorer));
+    }
+    else
+      client_printf(client, "Unknown scorer; use value_n or trend.\n");
+  }
+  else if (strcmp(cmd, "format off") == 0)
+  {
+    client->format = -1;
+    client_printf(client, "Stats reports are no longer sent to this client.\n");
+  }
+  else if (strncmp(cmd, "format ", 7) == 0)
   {
-    if (entry->recording_interval)
+    int format = format_parse(cmd + 7);
+    if (format >= 0)
     {
-      entry->recording_interval->end = interval_end;
-      if (entry->recording_interval->n == 0)
+      client->format = format;
+      client_printf(client, "Stats reports are sent to this client in %s format.\n", format_name(format));
+      if (format == format_csv)
       {
-        interval_unlink(entry, entry->recording_interval);
-	(*memleak_libc_free)(entry->recording_interval);
+        OutputBuffer* out = client_output(client);
+        size_t offset = message_begin(out, protocol_text);
+        format_csv_columns(out);
+        message_end(out, offset);
       }
-      entry->recording_interval = NULL;
     }
+    else
+      client_printf(client, "Unknown format; use text, json, csv or off.\n");
   }
-  interval_start = interval_end;
-  pthread_mutex_unlock(&memleak_mutex);
-  printf("*** RESTART RECORDING ***\n");
+  else
+    client_write(client, "Ignored.\n", 9);
+  client_send(client, protocol_prompt, "", 0);
 }
 
-static int quit = 0;
-static void terminate();
-static int sockfd;
-static int fd = 0;
-static char const* sockname;
+// Close CLIENT because it sent something that doesn't follow the protocol.
+static void client_protocol_error(Client* client)
+{
+  output_printf(output_stats, "libmemleak: Protocol error on \"%s\"; closing connection.\n", sockname);
+  client_close(client);
+}
 
-static void* monitor(void* dummy __attribute__((unused)))
+// Handle a message of TYPE with LEN bytes of PAYLOAD from CLIENT. Returns -1 if the client was closed.
+static int client_message(Client* client, int type, char const* payload, uint32_t len)
 {
-  if (strcmp(appname, "SLPlugin") == 0)
-    pthread_exit(0);
-  atexit(terminate);
-  sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
-  if (sockfd < 0)
+  if (client->closing)
+    return 0;
+  if (!client->version)
+  {
+    uint32_t version;
+    if (type != protocol_hello || len < sizeof(version))
+    {
+      client_protocol_error(client);
+      return -1;
+    }
+    memcpy(&version, payload, sizeof(version));
+    if (version != PROTOCOL_VERSION)
+    {
+      client_printf(client, "libmemleak uses protocol version %d; this client uses version %u.\n", PROTOCOL_VERSION, version);
+      client_send(client, protocol_quit, "", 0);
+      client->closing = 1;
+      return 0;
+    }
+    client->version = version;
+    client_send(client, protocol_prompt, "", 0);
+    return 0;
+  }
+  switch (type)
+  {
+    case protocol_command:
+    {
+      char cmd[CLIENT_INPUT_MAX + 1];
+      memcpy(cmd, payload, len);
+      // Strip trailing white space.
+      while (len > 0 && isspace(cmd[len - 1]))
+        --len;
+      cmd[len] = 0;
+      if (len > 0)
+        client_command(client, cmd);
+      else
+        client_send(client, protocol_prompt, "", 0);
+      return 0;
+    }
+    case protocol_subscribe:
+    {
+      uint32_t on;
+      if (len < sizeof(on))
+        break;
+      memcpy(&on, payload, sizeof(on));
+      client->subscribed = on != 0;
+      client->need_snapshot = 0;
+      if (client->subscribed)
+        stats_message(client_output(client), 1);
+      return 0;
+    }
+    case protocol_snapshot:
+      stats_message(client_output(client), 1);
+      return 0;
+  }
+  client_protocol_error(client);
+  return -1;
+}
+
+// Read and handle the messages of CLIENT. Returns -1 if the client was closed.
+static int client_read(Client* client)
+{
+  for (;;)
+  {
+    ssize_t len = read(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len);
+    if (len < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return 0;
+    }
+    if (len <= 0)
+    {
+      if (!client->metrics)
+        output_printf(output_stats, "libmemleak: Closing connection on \"%s\".\n", sockname);
+      client_close(client);
+      return -1;
+    }
+    client->in_len += len;
+    if (client->metrics)
+    {
+      metrics_request(client);
+      if (client->closing)
+        return 0;
+      continue;
+    }
+    char* start = client->in;
+    char* end = client->in + client->in_len;
+    while ((size_t)(end - start) >= sizeof(ProtocolFrame))
+    {
+      ProtocolFrame frame;
+      memcpy(&frame, start, sizeof(frame));
+      if (frame.length > CLIENT_INPUT_MAX)
+      {
+        client_protocol_error(client);
+        return -1;
+      }
+      if ((size_t)(end - start) < sizeof(frame) + frame.length)
+        break;
+      if (client_message(client, frame.type, start + sizeof(frame), frame.length) < 0)
+        return -1;
+      start += sizeof(frame) + frame.length;
+    }
+    client->in_len = end - start;
+    memmove(client->in, start, client->in_len);
+    // Stop reading when too much output is pending; client_flush turns EPOLLIN back on.
+    if (client_pending(client) >= CLIENT_OUTPUT_MAX || client->closing)
+      return 0;
+  }
+}
+
+// Accept new connections on LISTENFD (sockfd or metricsfd).
+static void client_accept(int listenfd)
+{
+  for (;;)
+  {
+    int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        fprintf(stderr, "libmemleak: accept: %s\n", strerror(errno));
+      return;
+    }
+    Client* client = (*memleak_libc_malloc)(sizeof(Client));
+    client->fd = fd;
+    client->in_len = 0;
+    client->out = NULL;
+    client->out_pos = 0;
+    client->events = EPOLLIN;
+    client->version = 0;
+    client->subscribed = 0;
+    client->need_snapshot = 0;
+    client->closing = 0;
+    client->format = -1;
+    client->metrics = listenfd == metricsfd;
+    client->id = next_client_id++;
+    struct epoll_event event;
+    event.events = client->events;
+    event.data.u64 = client->id;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      close(fd);
+      (*memleak_libc_free)(client);
+      continue;
+    }
+    client->next = clients;
+    clients = client;
+    if (client->metrics)
+      continue;
+    output_printf(output_stats, "libmemleak: Accepted a connection on \"%s\".\n", sockname);
+    ProtocolHello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.version = PROTOCOL_VERSION;
+    hello.pid = getpid();
+    memcpy(hello.application, exename, sizeof(hello.application));
+    client_send(client, protocol_hello, &hello, sizeof(hello));
+    client_flush(client);
+  }
+}
+
+// Create a listening UNIX socket with path NAME. Returns the socket, or -1 on failure.
+static int monitor_listen(char const* name)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
   {
     fprintf(stderr, "Failed to open AF_UNIX socket: %s\n", strerror(errno));
-    pthread_exit(0);
+    return -1;
   }
-  sockname = getenv("LIBMEMLEAK_SOCKNAME");
-  if (!sockname)
-    sockname = "memleak_sock";
-  printf("sockname = \"%s\"\n", sockname);
   struct sockaddr_un serv_addr;
   memset(&serv_addr, 0, sizeof(serv_addr));
   serv_addr.sun_family = AF_UNIX;
-  strcpy(serv_addr.sun_path, sockname);
+  strncpy(serv_addr.sun_path, name, sizeof(serv_addr.sun_path) - 1);
   int servlen = strlen(serv_addr.sun_path) + sizeof(serv_addr.sun_family);
   for(int try = 0; try < 3; ++try)
   {
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, servlen) < 0)
+    if (bind(fd, (struct sockaddr*)&serv_addr, servlen) < 0)
     {
       if (errno == EADDRINUSE)
       {
-	unlink(sockname);
+	unlink(name);
 	continue;
       }
       fprintf(stderr, "Error binding socket: %s\n", strerror(errno));
-      close(sockfd);
-      unlink(sockname);
-      pthread_exit(0);
+      close(fd);
+      return -1;
     }
     break;
   }
-  if (listen(sockfd, 5) < 0)
+  if (listen(fd, 5) < 0)
   {
     fprintf(stderr, "Error listening on socket: %s\n", strerror(errno));
-    close(sockfd);
-    unlink(sockname);
+    close(fd);
+    return -1;
+  }
+  output_printf(output_stats, "libmemleak: Listening on \"%s\".\n", name);
+  return fd;
+}
+
+static void* monitor(void* dummy __attribute__((unused)))
+{
+  if (strcmp(appname, "SLPlugin") == 0)
+    pthread_exit(0);
+  // Do not record memory allocated by the monitor thread.
+  inside_memleak_stats = 1;
+  quitfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (quitfd < 0)
+  {
+    fprintf(stderr, "libmemleak: eventfd: %s\n", strerror(errno));
     pthread_exit(0);
   }
-  printf("libmemleak: Listening on \"%s\".\n", sockname);
+  atexit(terminate);
+  sockname = getenv("LIBMEMLEAK_SOCKNAME");
+  if (!sockname)
+    sockname = "memleak_sock";
+  sockfd = monitor_listen(sockname);
+  if (sockfd < 0)
+    pthread_exit(0);
+  metrics_sockname = getenv("LIBMEMLEAK_METRICS_SOCKNAME");
+  if (metrics_sockname && *metrics_sockname)
+    metricsfd = monitor_listen(metrics_sockname);
 
-  int count = 0;
-  int restart_multiplier = 5;
   char const*  restart_multiplier_str = getenv("LIBMEMLEAK_RESTART_MULTIPLIER");
   if (restart_multiplier_str)
     restart_multiplier = atoi(restart_multiplier_str);
   if (restart_multiplier < 2)
   {
     fprintf(stderr, "libmemleak: LIBMEMLEAK_RESTART_MULTIPLIER: invalid value. Restart multiplier must be at least 2.");
-    close(sockfd);
-    unlink(sockname);
-    pthread_exit(0);
+    monitor_exit();
   }
-  printf("libmemleak: Restart multiplier set to %d\n", restart_multiplier);
+  output_printf(output_stats, "libmemleak: Restart multiplier set to %d\n", restart_multiplier);
   char const* stats_interval_str = getenv("LIBMEMLEAK_STATS_INTERVAL");
-  struct timeval sleeptime = { stats_interval_str ? atoi(stats_interval_str) : 1, 0 };
-  printf("libmemleak: Printing memory statistics every %lu seconds.\n", sleeptime.tv_sec);
+  stats_interval = stats_interval_str ? atoi(stats_interval_str) : 1;
+  output_printf(output_stats, "libmemleak: Printing memory statistics every %lu seconds.\n", stats_interval);
+  char const* score_str = getenv("LIBMEMLEAK_SCORE");
+  if (score_str && score_parse(score_str) >= 0)
+    stats.scorer = score_parse(score_str);
+  char const* half_life_str = getenv("LIBMEMLEAK_TREND_HALF_LIFE");
+  if (half_life_str && atoi(half_life_str) > 0)
+    stats.trend_half_life = atoi(half_life_str);
+  output_printf(output_stats, "libmemleak: Ranking backtraces by %s.\n", score_name(stats.scorer));
+  char const* filter_str = getenv("LIBMEMLEAK_FILTER");
+  if (filter_str && *filter_str)
+  {
+    // A list of filter commands, separated by semicolons.
+    char buf[256];
+    strncpy(buf, filter_str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    char* saveptr;
+    for (char* cmd = strtok_r(buf, ";", &saveptr); cmd; cmd = strtok_r(NULL, ";", &saveptr))
+    {
+      while (isspace(*cmd))
+        ++cmd;
+      char reply[128];
+      filter_command(cmd, reply, sizeof(reply));
+      output_printf(output_stats, "libmemleak: %s", reply);
+    }
+  }
+  char const* metadata_str = getenv("LIBMEMLEAK_METADATA_MAX");
+  if (metadata_str && atoi(metadata_str) > 0)
+  {
+    metadata_max = (size_t)atoi(metadata_str) << 20;
+    output_printf(output_stats, "libmemleak: Limiting the backtraces to %d MB.\n", atoi(metadata_str));
+  }
+  char const* lists_str = getenv("LIBMEMLEAK_LISTS");
+  if (lists_str && strcmp(lists_str, "suspects") == 0)
+  {
+    set_link_all(0);
+    output_printf(output_stats, "libmemleak: Only linking the allocations of suspects.\n");
+  }
+  char const* shallow_str = getenv("LIBMEMLEAK_SHALLOW");
+  if (shallow_str && atoi(shallow_str) >= 1 && atoi(shallow_str) < backtrace_size_max)
+  {
+    set_backtrace_depth(atoi(shallow_str));
+    output_printf(output_stats, "libmemleak: Taking %d frames per allocation, except for suspects.\n", backtrace_depth);
+  }
+  char const* sketch_threshold_str = getenv("LIBMEMLEAK_SKETCH_THRESHOLD");
+  if (sketch_threshold_str && atoi(sketch_threshold_str) >= 1)
+    sketch.threshold = atoi(sketch_threshold_str);
+  char const* sketch_str = getenv("LIBMEMLEAK_SKETCH");
+  if (sketch_str && atoi(sketch_str) > 0)
+  {
+    set_sketch(1);
+    output_printf(output_stats, "libmemleak: Only giving heavy hitters a backtrace, once they have %lu surviving allocations.\n", sketch.threshold);
+  }
+  char const* suppress_str = getenv("LIBMEMLEAK_SUPPRESS");
+  if (suppress_str && *suppress_str)
+  {
+    // A list of suppression rules, separated by semicolons.
+    char buf[1024];
+    strncpy(buf, suppress_str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    char* saveptr;
+    for (char* rule = strtok_r(buf, ";", &saveptr); rule; rule = strtok_r(NULL, ";", &saveptr))
+    {
+      while (isspace(*rule))
+        ++rule;
+      if (suppress_add(rule) != 0)
+        output_printf(output_stats, "libmemleak: Ignoring invalid suppression rule \"%s\".\n", rule);
+    }
+    output_printf(output_stats, "libmemleak: Suppressing allocations from %d address ranges.\n", suppress_update());
+  }
+  char const* sample_str = getenv("LIBMEMLEAK_THREAD_SAMPLE");
+  if (sample_str && atoi(sample_str) > 0)
+    thread_sample_rate = atoi(sample_str);
+  char const* threads_str = getenv("LIBMEMLEAK_THREADS");
+  if (threads_str && atoi(threads_str) > 0)
+  {
+    thread_tracking = 1;
+    output_printf(output_stats, "libmemleak: Tracking threads; sampling one in %d frees.\n", thread_sample_rate);
+  }
+  char const* latency_str = getenv("LIBMEMLEAK_LATENCY");
+  if (latency_str && atoi(latency_str) > 0)
+  {
+    latency_enable(1);
+    output_printf(output_stats, "libmemleak: Timing the calls to the real allocator.\n");
+  }
+
+  epollfd = epoll_create1(EPOLL_CLOEXEC);
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epollfd < 0 || timerfd < 0)
+  {
+    fprintf(stderr, "libmemleak: epoll/timerfd: %s\n", strerror(errno));
+    monitor_exit();
+  }
+  // The listening sockets, timerfd and quitfd are identified by their index in fds.
+  int* fds[monitor_fds] = { &sockfd, &timerfd, &quitfd, &metricsfd };
+  for (int i = 0; i < monitor_fds; ++i)
+  {
+    if (*fds[i] < 0)
+      continue;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, *fds[i], &event);
+  }
+  metrics_update_totals();
+  monitor_arm_timer();
+
   for(;;)
   {
-    // Only linux, select modifies timeout to be the remaining time, so initialize it here.
-    struct timeval timeout = sleeptime;
-    for(;;)
-    {
-      fd_set wfds, rfds;
-      FD_ZERO(&wfds);
-      FD_ZERO(&rfds);
-      FD_SET(sockfd, &rfds);
-      if (fd > 0)
-	FD_SET(fd, &rfds);
-      //FD_SET(fd, &wfds);  set if we need writing.
-      int n;
-      if ((n = select(FD_SETSIZE, &rfds, &wfds, NULL, stats.recording? &timeout : NULL)) < 0)
-      {
-	if (errno == EINTR)
-	{
-	  timeout = sleeptime;	// Man page says this is undefined after an error.
-	  continue;
-	}
-	perror("select");
-	close(sockfd);
-	unlink(sockname);
-	pthread_exit(0);
-      }
-      if (n == 0)		// Timed out?
-	break;
-      if (FD_ISSET(fd, &wfds))
+    struct epoll_event events[16];
+    int n = epoll_wait(epollfd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      monitor_exit();
+    }
+    int timed_out = 0;
+    for (int i = 0; i < n; ++i)
+    {
+      uint64_t id = events[i].data.u64;
+      if (id == monitor_quitfd)
       {
-	// write here.
+        // Tell all clients that the application terminates.
+        while (clients)
+        {
+          if (!clients->metrics)
+            client_send(clients, protocol_quit, "", 0);
+          if (client_flush(clients) == 0)
+            client_close(clients);
+        }
+        monitor_exit();
       }
-      if (FD_ISSET(sockfd, &rfds))
+      else if (id == monitor_sockfd)
+        client_accept(sockfd);
+      else if (id == monitor_metricsfd)
+        client_accept(metricsfd);
+      else if (id == monitor_timerfd)
       {
-	struct sockaddr_un cli_addr;
-	socklen_t clilen = sizeof(cli_addr);
-	fd = accept(sockfd, (struct sockaddr*)&cli_addr, &clilen);
-	if (fd < 0)
-	{
-	  perror("accept");
-	  close(sockfd);
-	  unlink(sockname);
-	  pthread_exit(0);
-	}
-	printf("libmemleak: Accepted a connection on \"%s\".\n", sockname);
-	if (fd > 0)
-	  my_write(fd, "PROMPT\n", 7);
+        uint64_t expirations;
+        if (read(timerfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+          timed_out = 1;
       }
-      if (FD_ISSET(fd, &rfds))
+      else
       {
-	static char buf[81];
-	int len = read(fd, buf, 80);
-	if (len == -1)
-	{
-	  fprintf(stderr, "read: %s\n", strerror(errno));
-	  close(sockfd);
-	  unlink(sockname);
-	  pthread_exit(0);
-	}
-	if (len == 0)
-	{
-	  printf("libmemleak: Closing socket \"%s\".\n", sockname);
-	  close(fd);
-	  fd = 0;
-	  break;
-	}
-	buf[len] = 0;
-	for(--len; len >= 0; --len)
-	{
-	  if (isspace(buf[len]))
-	    buf[len] = 0;
-	  else
-	  {
-	    ++len;
-	    break;
-	  }
-	}
-	if (len > 0)
-	{
-	  if (strcmp(buf, "help") == 0)
-	  {
-	    static char const* helptext[] = {
-	      "help     : Print this help.\n",
-	      "start    : Erase all intervals and start recording the first interval.\n",
-	      "stop     : Stop recording.\n",
-	      "restart  : Start a new interval. Keep, and possibly combine, previous intervals.\n",
-	      "delete   : Delete the oldest interval.\n",
-              "stats    : Print overview of backtrace with highest leak probability.\n",
-	      "stats N  : Automatically print stats every N seconds (use 0 to turn off).\n",
-	      "restart M: Automatically restart every N * M stats.\n",
-	      "list N   : When printing stats, print only the first N backtraces.\n",
-	      "dump N   : Print backtrace number N.\n"
-	    };
-	    for (size_t line = 0; line < sizeof(helptext) / sizeof(char*); ++line)
-	      my_write(fd, helptext[line], strlen(helptext[line]));
-	  }
-	  else if ((!stats.recording && strcmp(buf, "start") == 0) ||
-	           ( stats.recording && strcmp(buf, "restart") == 0))
-	  {
-	    timeout = sleeptime;
-	    count = -1;
-	    int len = snprintf(buf, sizeof(buf), "Auto restart interval is %d * %lu seconds.\n", restart_multiplier, sleeptime.tv_sec);
-	    if (len > 80)
-	    {
-	      buf[79] = '\n';
-	      len = 80;
-	    }
-	    my_write(fd, buf, len);
-	    if (fd > 0)
-	      my_write(fd, "PROMPT\n", 7);
-	    break;
-	  }
-	  else if (stats.recording && strcmp(buf, "stop") == 0)
-	  {
-	    interval_stop_recording();
-	    my_write(fd, "Stopped.\n", 9);
-	  }
-	  else if (strcmp(buf, "delete") == 0)
-	  {
-            int len = snprintf(buf, sizeof(buf), "Deleting all intervals that end before %lu seconds since application start.\n", stats.oldest_interval_end);
-	    if (len > 80)
-	    {
-	      buf[79] = '\n';
-	      len = 80;
-	    }
-	    my_write(fd, buf, len);
-	    interval_delete(stats.oldest_interval_end);
-	  }
-	  else if (strcmp(buf, "stats") == 0)
-	  {
-	    if (fd > 0)
-	      my_write(fd, "PROMPT\n", 7);
-	    break;
-	  }
-	  else if (strncmp(buf, "stats ", 6) == 0)
-	  {
-	    int arg = atoi(buf + 6);
-	    int len;
-	    if (arg >= 1)
-	    {
-	      sleeptime.tv_sec = arg;
-	      len = snprintf(buf, sizeof(buf), "Printing memory statistics every %lu seconds.\n", sleeptime.tv_sec);
-	    }
-	    else
-	    {
-	      len = snprintf(buf, sizeof(buf), "Interval between printing of stats must be at least 1 second.\n");
-	    }
-	    if (len > 80)
-	    {
-	      buf[79] = '\n';
-	      len = 80;
-	    }
-	    my_write(fd, buf, len);
-	  }
-	  else if (strncmp(buf, "restart ", 8) == 0)
-	  {
-	    int arg = atoi(buf + 8);
-	    int len;
-	    if (arg >= 2)
-	    {
-	      restart_multiplier = arg;
-	      len = snprintf(buf, sizeof(buf), "Restart multiplier set to %d.\n", restart_multiplier);
-	    }
-	    else
-	    {
-	      len = snprintf(buf, sizeof(buf), "Restart multiplier must be at least 2.\n");
-	    }
-	    if (len > 80)
-	    {
-	      buf[79] = '\n';
-	      len = 80;
-	    }
-	    my_write(fd, buf, len);
-	  }
-	  else if (strncmp(buf, "list ", 5) == 0)
-	  {
-	    int arg = atoi(buf + 5);
-	    int len;
-	    if (arg >= 1)
-	    {
-	      stats.max_backtraces = arg;
-	      if (stats.max_backtraces == 1)
-		len = snprintf(buf, sizeof(buf), "Now printing only the first backtrace.\n");
-	      else
-		len = snprintf(buf, sizeof(buf), "Now printing the first %d backtraces.\n", stats.max_backtraces);
-	    }
-	    else
-	    {
-	      len = snprintf(buf, sizeof(buf), "Argument of list must be at least 1.\n");
-	    }
-	    if (len > 80)
-	    {
-	      buf[79] = '\n';
-	      len = 80;
-	    }
-	    my_write(fd, buf, len);
-	  }
-	  else if (strncmp(buf, "dump ", 5) == 0)
-	  {
-	    int arg = atoi(buf + 5);
-	    pthread_mutex_lock(&memleak_mutex);
-
-	    BacktraceEntry* entry = stats.first_entry_n;
-	    while (entry && entry->backtrace_nr != arg)
-	      entry = entry->next_n;
-
-	    pthread_mutex_unlock(&memleak_mutex);
-	    if (entry)
-	    {
-	      FILE* fp = fdopen(fd, "a");
-	      addr2line_print(fp, entry->ptr, entry->backtrace_size);
-	      fflush(fp);
-	    }
-            else
-	    {
-	      int len = snprintf(buf, sizeof(buf), "Backtrace %d doesn't exist.\n", arg);
-	      if (len > 80)
-	      {
-		buf[79] = '\n';
-		len = 80;
-	      }
-	      my_write(fd, buf, len);
-	    }
-	  }
-	  else
-	    my_write(fd, "Ignored.\n", 9);
-	}
-	if (fd > 0)
-	  my_write(fd, "PROMPT\n", 7);
+        // A client that was closed while handling an earlier event in this batch won't have events anymore
+        // (the fd was removed from the epoll set), but the event can still be in this batch. Ids are never
+        // reused, so look the client up by id: a new client can have the same address or fd.
+        Client* client = clients;
+        while (client && client->id != id)
+          client = client->next;
+        if (!client)
+          continue;
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && client_read(client) < 0)
+          continue;
+        client_flush(client);
       }
     }
-    ++count;
-    if (count % restart_multiplier == 0)
-      interval_restart_recording();
-    if (quit)
-      pthread_exit(0);
-    memleak_stats();
+    if (timed_out)
+      monitor_tick(1);
   }
   return NULL;
 }
 
 static void terminate()
 {
-  if (sockfd > 0)
-  {
-    close(sockfd);
-    unlink(sockname);
-  }
-  if (fd > 0)
-  {
-    my_write(fd, "QUIT\n", 5);
-    close(fd);
-    fd = 0;
-  }
-  quit = 1;
-  pthread_join(monitor_thread, NULL);
+  // Let the monitor thread say goodbye to its clients and exit.
+  uint64_t one = 1;
+  if (write(quitfd, &one, sizeof(one)) == sizeof(one))
+    pthread_join(monitor_thread, NULL);
   interval_stop_recording();
-  printf("libmemleak: Final memleak stats:\n");
+  output_printf(output_stats, "libmemleak: Final memleak stats:\n");
   memleak_stats();
+  output_flush();
+  shared_stats_close();
+}
+
+static void* writer(void* dummy __attribute__((unused)))
+{
+  // Do not record memory allocated by the writer thread (ie, while symbolizing).
+  inside_memleak_stats = 1;
+  output_writer();
+  return NULL;
 }
 
 #ifdef DEBUG_EXPENSIVE
@@ -1624,7 +4196,7 @@ static void __attribute__ ((unused)) check_backtrace_headers(BacktraceEntry* ent
     ++count;
   }
   Debug(print(" head ("); print_ptr(end); print(")"); print_unlock());
-  assert(entry->allocations == count);
+  assert(entry->allocations == count + entry->unlinked);
 }
 
 static void __attribute__ ((unused)) check_interval_headers(BacktraceEntry* entry)
@@ -1651,9 +4223,13 @@ static void __attribute__ ((unused)) check_interval_headers(BacktraceEntry* entr
       if (h->time == is)
 	++count_equal;
     }
-    assert((!entry->recording_interval && count == count_equal) || (entry->recording_interval && entry->recording_interval->n == count));
-    // entry->recording_interval->first points to the oldest allocation that falls into the interval.
-    assert(!entry->recording_interval || entry->recording_interval->first == fh);
+    // Allocations that aren't linked are counted in the interval, but can't be seen here.
+    if (!entry->unlinked)
+    {
+      assert((!entry->recording_interval && count == count_equal) || (entry->recording_interval && entry->recording_interval->n == count));
+      // entry->recording_interval->first points to the oldest allocation that falls into the interval.
+      assert(!entry->recording_interval || entry->recording_interval->first == fh);
+    }
   }
   Interval* interval = entry->intervals;
   assert(!interval || !interval->prev);
@@ -1691,7 +4267,8 @@ static void __attribute__ ((unused)) check_intervals(BacktraceEntry* entry)
     {
       assert(!last_interval);
       passed_intervals = 1;
-      assert(header->time >= end);
+      // Allocations done after stopping, in the last second of the last interval, aren't recorded.
+      assert(header->time >= end || (!stats.recording && header->time + 1 == end));
       continue;
     }
     assert(!passed_intervals);
@@ -1700,7 +4277,7 @@ static void __attribute__ ((unused)) check_intervals(BacktraceEntry* entry)
       assert(interval->first == header);
       if (prev_interval)
       {
-       assert(count == prev_interval->n);
+       assert(count == prev_interval->n || entry->unlinked);
        assert(prev_interval->end <= interval->start);
       }
       count = 0;
@@ -1712,13 +4289,13 @@ static void __attribute__ ((unused)) check_intervals(BacktraceEntry* entry)
     assert(header->time >= interval->start && (last_interval || header->time < interval->end));
     prev_interval = interval;
   }
-  assert(header_count == entry->allocations);
+  assert(header_count + entry->unlinked == entry->allocations);
 }
 
-static void __attribute__ ((unused)) check_interval_first(Interval* interval)
+static void __attribute__ ((unused)) check_interval_first(BacktraceEntry* entry, Interval* interval)
 {
   assert(!interval->first || interval->n > 0);
-  assert(interval->first || interval->n == 0);
+  assert(interval->first || interval->n == 0 || entry->unlinked);
   if (interval->first)
   {
     assert(interval->first->interval == interval);
@@ -1726,7 +4303,7 @@ static void __attribute__ ((unused)) check_interval_first(Interval* interval)
     unsigned int cnt = 0;
     for (Header* header = interval->first; header->interval == interval; header = header->prev)
       ++cnt;
-    assert(cnt == interval->n);
+    assert(cnt == interval->n || (entry->unlinked && cnt <= interval->n));
   }
 }
 #endif
@@ -1741,7 +4318,7 @@ void print_entry(BacktraceEntry* entry)
   {
     ++count;
     Interval* interval = header->interval;
-    printf("%d: Header %p; time %lu; interval %p", count, header, header->time, interval);
+    printf("%d: Header %p; time %d; interval %p", count, header, header->time, interval);
     if (interval)
       printf(" [%lu, %lu>; interval->first = %p", interval->start, interval->end, interval->first);
     printf("\n");
@@ -0,0 +1,192 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file memleak_btdb.c Read and export the binary backtrace database.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "BacktraceDB.h"
+
+static char const* db;                          // The mapped database.
+static size_t db_size;
+static BacktraceDBHeader const* header;
+static BacktraceDBModule const* modules;
+static uint64_t record_count;
+static char const* strings;                     // The mapped string table, or NULL.
+static size_t strings_size;
+
+static void error(char const* msg, char const* arg)
+{
+  fprintf(stderr, "memleak_btdb: %s: %s\n", arg, msg);
+  exit(1);
+}
+
+// Map PATH. Returns NULL on failure, with errno set (to 0 when the file is empty).
+static char const* map_file(char const* path, size_t* size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  int empty = 0;
+  if (fstat(fd, &st) < 0 || (empty = st.st_size == 0))
+  {
+    close(fd);
+    if (empty)
+      errno = 0;
+    return NULL;
+  }
+  void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  *size = st.st_size;
+  return ptr;
+}
+
+static void open_db(char const* path)
+{
+  db = map_file(path, &db_size);
+  if (!db)
+    error(errno ? strerror(errno) : "Truncated backtrace database", path);
+  header = (BacktraceDBHeader const*)db;
+  if (db_size < sizeof(BacktraceDBHeader) || memcmp(header->magic, BACKTRACE_DB_MAGIC, sizeof(header->magic)) != 0)
+    error("Not a libmemleak backtrace database", path);
+  if (header->record_size != sizeof(BacktraceRecord) || header->frames_max != BACKTRACE_DB_FRAMES)
+    error("Unsupported database version", path);
+  if (header->module_offset > db_size || header->module_count > (db_size - header->module_offset) / sizeof(BacktraceDBModule) ||
+      header->record_offset > db_size)
+    error("Truncated backtrace database", path);
+  modules = (BacktraceDBModule const*)(db + header->module_offset);
+  // Only trust records that were committed, and that are completely in the file.
+  record_count = header->record_count;
+  if (record_count > (db_size - header->record_offset) / header->record_size)
+    record_count = (db_size - header->record_offset) / header->record_size;
+  char* strings_path = malloc(strlen(path) + 5);
+  sprintf(strings_path, "%s.str", path);
+  strings = map_file(strings_path, &strings_size);
+  free(strings_path);
+}
+
+// Return backtrace NR, or NULL if it doesn't exist (O(1), no parsing involved).
+static BacktraceRecord const* lookup(uint64_t nr)
+{
+  if (nr == 0 || nr > record_count)
+    return NULL;
+  BacktraceRecord const* record = (BacktraceRecord const*)(db + header->record_offset + (nr - 1) * header->record_size);
+  return record->backtrace_nr == nr ? record : NULL;
+}
+
+static void print_modules()
+{
+  for (uint32_t m = 0; m < header->module_count; ++m)
+    printf("%3u: %.16lx-%.16lx %8lx %s\n", m, (unsigned long)modules[m].begin, (unsigned long)modules[m].end,
+        (unsigned long)modules[m].offset, modules[m].path);
+}
+
+static void print_backtrace(BacktraceRecord const* record, int raw)
+{
+  uint64_t loc = record->strings;
+  if (!raw && loc && strings && BACKTRACE_DB_STRINGS_OFFSET(loc) + BACKTRACE_DB_STRINGS_LENGTH(loc) <= strings_size)
+  {
+    fwrite(strings + BACKTRACE_DB_STRINGS_OFFSET(loc), 1, BACKTRACE_DB_STRINGS_LENGTH(loc), stdout);
+    return;
+  }
+  // Not symbolized; print module and file offset of each frame, which is what is needed to symbolize it later.
+  printf("Backtrace %u:\n", record->backtrace_nr);
+  for (uint32_t f = 0; f < record->frames && f < BACKTRACE_DB_FRAMES; ++f)
+  {
+    printf(" #%-2u %.16lx", f, (unsigned long)record->pc[f]);
+    uint16_t m = record->module[f];
+    if (m != BACKTRACE_DB_NO_MODULE && m < header->module_count)
+      printf(" in %s+0x%lx\n", modules[m].path, (unsigned long)(record->pc[f] - modules[m].begin + modules[m].offset));
+    else
+      printf(" in ??\n");
+  }
+}
+
+static void usage(char const* progname)
+{
+  fprintf(stderr, "Usage: %s [-f DATABASE] [-m] [-r] [N...]\n", progname);
+  fprintf(stderr, "  -f DATABASE : The backtrace database (default: memleak_backtraces).\n");
+  fprintf(stderr, "  -m          : Print the module table.\n");
+  fprintf(stderr, "  -r          : Print raw frames (module and offset), even when symbolized text is available.\n");
+  fprintf(stderr, "  N           : Print backtrace N. The default is to print all backtraces.\n");
+  exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+  char const* path = "memleak_backtraces";
+  int print_module_table = 0;
+  int raw = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:mrh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'f':
+        path = optarg;
+        break;
+      case 'm':
+        print_module_table = 1;
+        break;
+      case 'r':
+        raw = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  open_db(path);
+  if (print_module_table)
+    print_modules();
+  if (optind < argc)
+  {
+    for (int i = optind; i < argc; ++i)
+    {
+      BacktraceRecord const* record = lookup(strtoull(argv[i], NULL, 10));
+      if (record)
+        print_backtrace(record, raw);
+      else
+        fprintf(stderr, "%s: Backtrace %s doesn't exist.\n", argv[0], argv[i]);
+    }
+  }
+  else if (!print_module_table)
+  {
+    printf("Application: \"%s\"\n", header->application);
+    for (uint64_t nr = 1; nr <= record_count; ++nr)
+    {
+      BacktraceRecord const* record = lookup(nr);
+      if (record)
+        print_backtrace(record, raw);
+    }
+  }
+  return 0;
+}
@@ -23,18 +23,38 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdio.h>
+#include <dirent.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <termios.h>
+#include <fcntl.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
-#define UNUSED(...) (void)(__VA_ARGS__)
+#include "Protocol.h"
+#include "SharedStats.h"
+
+// The largest message that we accept from the library.
+#define MESSAGE_MAX (256 * 1024 * 1024)
 
 void error(char const*);
 
+static int sockfd;
+static char* input;                             // Received data that wasn't handled yet.
+static size_t input_len;                        // The number of valid bytes in 'input'.
+static size_t input_capacity;
+static size_t input_consumed;                   // The size of the message returned by the last call to next_message.
+static ProtocolHello hello;                     // The hello message of the library.
+
 // A static variable for holding the line.
 static char* line_read = NULL;
 
@@ -58,13 +78,360 @@ char* rl_gets()
   return line_read;
 }
 
+static void send_message(int type, void const* payload, size_t len)
+{
+  ProtocolFrame frame;
+  frame.length = len;
+  frame.type = type;
+  frame.reserved = 0;
+  if (write(sockfd, &frame, sizeof(frame)) != sizeof(frame) || (len > 0 && write(sockfd, payload, len) != (ssize_t)len))
+    error("write");
+}
+
+static void terminated() __attribute__((noreturn));
+
+static void terminated()
+{
+  printf("Application terminated.\n");
+  exit(0);
+}
+
+// Read whatever is available on the socket (blocks if nothing is).
+static void read_socket()
+{
+  // Remove the previous message.
+  input_len -= input_consumed;
+  memmove(input, input + input_consumed, input_len);
+  input_consumed = 0;
+  if (input_capacity - input_len < 4096)
+  {
+    input_capacity = input_capacity ? 2 * input_capacity : 65536;
+    input = realloc(input, input_capacity);
+    if (!input)
+      error("realloc");
+  }
+  ssize_t len = read(sockfd, input + input_len, input_capacity - input_len);
+  if (len < 0 && errno == EINTR)
+    return;
+  if (len <= 0)
+    terminated();
+  input_len += len;
+}
+
+// If a complete message was received, return its type and set PAYLOAD and LEN. Otherwise return 0.
+// The payload is valid until the next call to next_message or read_socket.
+static int next_message(char const** payload, uint32_t* len)
+{
+  char* start = input + input_consumed;
+  size_t available = input_len - input_consumed;
+  ProtocolFrame frame;
+  if (available < sizeof(frame))
+    return 0;
+  memcpy(&frame, start, sizeof(frame));
+  if (frame.length > MESSAGE_MAX)
+  {
+    fprintf(stderr, "Protocol error: message of %u bytes.\n", frame.length);
+    exit(1);
+  }
+  if (available < sizeof(frame) + frame.length)
+    return 0;
+  input_consumed += sizeof(frame) + frame.length;
+  *payload = start + sizeof(frame);
+  *len = frame.length;
+  return frame.type;
+}
+
+// Block until a complete message was received.
+static int receive_message(char const** payload, uint32_t* len)
+{
+  int type;
+  while (!(type = next_message(payload, len)))
+    read_socket();
+  return type;
+}
+
+//---------------------------------------------------------------------------------------------
+// The top view.
+
+// What we know about a backtrace.
+struct TopEntry {
+  int present;                                  // Set if the backtrace has intervals.
+  ProtocolEntry entry;
+  ProtocolInterval* intervals;
+};
+
+static struct TopEntry* top_entries;            // Indexed by backtrace number.
+static uint32_t top_size;
+static ProtocolStats top_stats;                 // The header of the last received message.
+static size_t top_bytes;                        // The size of the last received message.
+
+// Update the view with a snapshot or delta.
+static void top_apply(char const* payload, uint32_t len)
+{
+  char const* end = payload + len;
+  if (len < sizeof(ProtocolStats))
+    return;
+  memcpy(&top_stats, payload, sizeof(top_stats));
+  payload += sizeof(top_stats);
+  top_bytes = sizeof(ProtocolFrame) + len;
+  if ((top_stats.flags & protocol_stats_snapshot))
+    for (uint32_t nr = 0; nr < top_size; ++nr)
+      top_entries[nr].present = 0;
+  for (uint32_t e = 0; e < top_stats.entry_count && end - payload >= (ssize_t)sizeof(ProtocolEntry); ++e)
+  {
+    ProtocolEntry entry;
+    memcpy(&entry, payload, sizeof(entry));
+    payload += sizeof(entry);
+    size_t intervals_size = entry.interval_count * sizeof(ProtocolInterval);
+    if ((size_t)(end - payload) < intervals_size)
+      return;
+    if (entry.backtrace_nr >= top_size)
+    {
+      uint32_t size = top_size ? top_size : 256;
+      while (entry.backtrace_nr >= size)
+        size *= 2;
+      top_entries = realloc(top_entries, size * sizeof(struct TopEntry));
+      if (!top_entries)
+        error("realloc");
+      memset(top_entries + top_size, 0, (size - top_size) * sizeof(struct TopEntry));
+      top_size = size;
+    }
+    struct TopEntry* te = &top_entries[entry.backtrace_nr];
+    te->present = 1;
+    te->entry = entry;
+    te->intervals = realloc(te->intervals, intervals_size + 1);
+    memcpy(te->intervals, payload, intervals_size);
+    payload += intervals_size;
+  }
+  for (uint32_t r = 0; r < top_stats.removed_count && end - payload >= (ssize_t)sizeof(uint32_t); ++r)
+  {
+    uint32_t nr;
+    memcpy(&nr, payload, sizeof(nr));
+    payload += sizeof(nr);
+    if (nr < top_size)
+      top_entries[nr].present = 0;
+  }
+}
+
+static int top_compare(void const* a, void const* b)
+{
+  double va = top_entries[*(uint32_t const*)a].entry.value_n;
+  double vb = top_entries[*(uint32_t const*)b].entry.value_n;
+  return va < vb ? 1 : va > vb ? -1 : 0;
+}
+
+static void top_render()
+{
+  struct winsize ws;
+  int rows = 24;
+  if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0)
+    rows = ws.ws_row;
+  uint32_t* order = malloc((top_size + 1) * sizeof(uint32_t));
+  uint32_t count = 0;
+  for (uint32_t nr = 0; nr < top_size; ++nr)
+    if (top_entries[nr].present)
+      order[count++] = nr;
+  qsort(order, count, sizeof(uint32_t), top_compare);
+
+  printf("\033[H\033[2J");
+  printf("%s (pid %d); now: %ld; %s.\n", hello.application, hello.pid, (long)top_stats.now,
+      (top_stats.flags & protocol_stats_recording) ? "recording" : "not recording (use 'start')");
+  printf("Backtraces: %lu; allocations: %lu; total memory: %lu bytes.\n",
+      (unsigned long)top_stats.backtraces, (unsigned long)top_stats.allocations, (unsigned long)top_stats.total_memory);
+  printf("Tick %lu: %s of %u backtraces (%zu bytes).\n\n", (unsigned long)top_stats.tick,
+      (top_stats.flags & protocol_stats_snapshot) ? "snapshot" : "delta", top_stats.entry_count, top_bytes);
+  printf("%9s %12s %11s %12s %13s %9s\n", "backtrace", "value_n", "allocations", "leaked", "leaked bytes", "intervals");
+  for (uint32_t i = 0; i < count && i < (uint32_t)(rows > 8 ? rows - 7 : 1); ++i)
+  {
+    struct TopEntry* te = &top_entries[order[i]];
+    // Only finished intervals count as leaks.
+    uint64_t n = 0, size = 0;
+    for (uint32_t j = 0; j < te->entry.interval_count; ++j)
+      if (te->intervals[j].end)
+      {
+        n += te->intervals[j].n;
+        size += te->intervals[j].size;
+      }
+    printf("%9u %12.2f %11lu %12lu %13lu %9u\n", te->entry.backtrace_nr, te->entry.value_n,
+        (unsigned long)te->entry.allocations, (unsigned long)n, (unsigned long)size, te->entry.interval_count);
+  }
+  printf("\nPress q to return to the prompt.\n");
+  fflush(stdout);
+  free(order);
+}
+
+// Show a continuously updated view of the stats until the user presses q.
+static void top()
+{
+  uint32_t on = 1;
+  send_message(protocol_subscribe, &on, sizeof(on));
+  struct termios saved;
+  int tty = tcgetattr(0, &saved) == 0;
+  if (tty)
+  {
+    struct termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &raw);
+  }
+  int done = 0;
+  while (!done)
+  {
+    char const* payload;
+    uint32_t len;
+    int type;
+    while ((type = next_message(&payload, &len)))
+    {
+      if (type == protocol_stats)
+      {
+        top_apply(payload, len);
+        top_render();
+      }
+      else if (type == protocol_quit)
+      {
+        if (tty)
+          tcsetattr(0, TCSANOW, &saved);
+        terminated();
+      }
+    }
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(0, &rfds);
+    FD_SET(sockfd, &rfds);
+    if (select(sockfd + 1, &rfds, NULL, NULL, NULL) < 0)
+      continue;
+    if (FD_ISSET(0, &rfds))
+    {
+      char c;
+      if (read(0, &c, 1) != 1 || c == 'q' || c == 'Q')
+        done = 1;
+    }
+    if (FD_ISSET(sockfd, &rfds))
+      read_socket();
+  }
+  if (tty)
+    tcsetattr(0, TCSANOW, &saved);
+  on = 0;
+  send_message(protocol_subscribe, &on, sizeof(on));
+}
+
+//---------------------------------------------------------------------------------------------
+// The shared memory stats.
+
+// Remove the segments /libmemleak.PID of processes that don't exist anymore (they crashed).
+static void remove_stale_shared_stats()
+{
+  DIR* dir = opendir("/dev/shm");
+  if (!dir)
+    return;
+  struct dirent* entry;
+  while ((entry = readdir(dir)))
+  {
+    char const* suffix = entry->d_name + 11;
+    if (strncmp(entry->d_name, "libmemleak.", 11) != 0 || !*suffix || strspn(suffix, "0123456789") != strlen(suffix))
+      continue;
+    if (kill(atoi(suffix), 0) < 0 && errno == ESRCH)
+    {
+      char name[sizeof(entry->d_name) + 1];
+      snprintf(name, sizeof(name), "/%s", entry->d_name);
+      if (shm_unlink(name) == 0)
+        fprintf(stderr, "Removed %s of a process that no longer exists.\n", name);
+    }
+  }
+  closedir(dir);
+}
+
+// Print the stats in the shared memory segment of process ARG (or with name ARG).
+static void print_shared_stats(char const* progname, char const* arg)
+{
+  remove_stale_shared_stats();
+  char name[256];
+  if (strspn(arg, "0123456789") == strlen(arg))
+    snprintf(name, sizeof(name), "/libmemleak.%s", arg);
+  else
+    snprintf(name, sizeof(name), "%s", arg);
+  int fd = shm_open(name, O_RDONLY, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    fprintf(stderr, "%s: %s: %s\n", progname, name, strerror(errno));
+    exit(1);
+  }
+  void* ptr = MAP_FAILED;
+  if (st.st_size >= (off_t)sizeof(SharedStats))
+    ptr = mmap(NULL, sizeof(SharedStats), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  SharedStats const* shared = ptr;
+  if (ptr == MAP_FAILED || memcmp(shared->magic, SHARED_STATS_MAGIC, sizeof(shared->magic)) != 0 ||
+      shared->version != SHARED_STATS_VERSION || shared->size != sizeof(SharedStats))
+  {
+    fprintf(stderr, "%s: %s: Not a libmemleak stats segment of this version.\n", progname, name);
+    exit(1);
+  }
+  // Take a consistent copy.
+  static SharedStats copy;
+  uint32_t sequence;
+  do
+  {
+    sequence = shared_stats_read_begin(shared);
+    memcpy(&copy, shared, sizeof(copy));
+  }
+  while (shared_stats_read_retry(shared, sequence));
+  copy.application[sizeof(copy.application) - 1] = 0;
+
+  printf("%s (pid %d); update %lu; now: %ld; %s.\n", copy.application, copy.pid, (unsigned long)copy.updates, (long)copy.now,
+      copy.recording ? "recording" : "not recording");
+  printf("Backtraces: %lu; allocations: %lu; total memory: %lu bytes; intervals: %lu.\n", (unsigned long)copy.backtraces,
+      (unsigned long)copy.allocations, (unsigned long)copy.total_memory, (unsigned long)copy.intervals);
+  printf("Overhead: headers %lu bytes, backtraces %lu bytes, intervals %lu bytes; last update took %lu us.\n",
+      (unsigned long)copy.header_bytes, (unsigned long)copy.backtrace_bytes, (unsigned long)copy.interval_bytes,
+      (unsigned long)(copy.update_ns / 1000));
+  for (uint32_t e = 0; e < copy.entry_count && e < SHARED_STATS_TOP; ++e)
+  {
+    SharedStatsEntry const* entry = &copy.entries[e];
+    printf(" backtrace %u (value_n: %.2f); %lu allocations\n", entry->backtrace_nr, entry->value_n, (unsigned long)entry->allocations);
+    for (uint32_t i = 0; i < entry->interval_count && i < SHARED_STATS_INTERVALS; ++i)
+    {
+      SharedStatsInterval const* interval = &entry->intervals[i];
+      if (interval->end)
+        printf("   [%4ld, %4ld>: ", (long)interval->start, (long)interval->end);
+      else
+        printf("   [%4ld,  ...>: ", (long)interval->start);
+      printf("%5lu allocations (%6lu total), size %lu\n", (unsigned long)interval->n, (unsigned long)interval->total_n,
+          (unsigned long)interval->size);
+    }
+  }
+  exit(0);
+}
+
+//---------------------------------------------------------------------------------------------
+
+static void usage(char const* progname)
+{
+  fprintf(stderr, "Usage: %s [-t] [-p PID]\n", progname);
+  fprintf(stderr, "  -t     : Start with the top view.\n");
+  fprintf(stderr, "  -p PID : Print the shared memory stats of process PID (or segment name PID) and exit;\n");
+  fprintf(stderr, "           also removes the segments of processes that no longer exist.\n");
+  exit(1);
+}
+
 int main(int argc, char* argv[])
 {
-  UNUSED(argc);
+  int start_with_top = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "tp:h")) != -1)
+  {
+    if (opt == 't')
+      start_with_top = 1;
+    else if (opt == 'p')
+      print_shared_stats(argv[0], optarg);
+    else
+      usage(argv[0]);
+  }
 
-  int sockfd, servlen;
+  int servlen;
   struct sockaddr_un serv_addr;
-  char buffer[82];
 
   memset((char*)&serv_addr, 0, sizeof(serv_addr));
   serv_addr.sun_family = AF_UNIX;
@@ -85,45 +452,57 @@ int main(int argc, char* argv[])
     }
     error("Connecting");
   }
+
+  // Exchange protocol versions.
+  char const* payload;
+  uint32_t len;
+  if (receive_message(&payload, &len) != protocol_hello || len < sizeof(hello))
+  {
+    fprintf(stderr, "%s: %s: Not a libmemleak socket.\n", argv[0], sockname);
+    exit(1);
+  }
+  memcpy(&hello, payload, sizeof(hello));
+  hello.application[sizeof(hello.application) - 1] = 0;
+  ProtocolHello my_hello;
+  memset(&my_hello, 0, sizeof(my_hello));
+  my_hello.version = PROTOCOL_VERSION;
+  my_hello.pid = getpid();
+  send_message(protocol_hello, &my_hello, sizeof(my_hello));
+
   for(;;)
   {
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(sockfd, &rfds);
-    select(sockfd + 1, &rfds, NULL, NULL, NULL);
-    if (FD_ISSET(sockfd, &rfds))
+    switch (receive_message(&payload, &len))
     {
-      size_t len = read(sockfd, buffer, 80);
-      if (len == 0)
-      {
-	printf("Application terminated.\n");
-	exit(0);
-      }
-      int do_prompt = 0, quit = 0;
-      if (len >= 7 && strncmp(buffer + len - 7, "PROMPT\n", 7) == 0)
-      {
-	do_prompt = 1;
-	len -= 7;
-      }
-      else if (len >= 5 && strncmp(buffer + len - 5, "QUIT\n", 5) == 0)
-      {
-	len -= 5;
-	quit = 1;
-      }
-      if (len > 0)
-	len = write(1, buffer, len);                    // Ignore return value, but avoid compiler warning.
-      if (quit)
-      {
-	printf("Application terminated.\n");
-	exit(0);
-      }
-      if (do_prompt)
+      case protocol_text:
+	if (write(1, payload, len) < 0)
+	  error("write");
+	break;
+      case protocol_quit:
+	terminated();
+      case protocol_prompt:
       {
+	if (start_with_top)
+	{
+	  start_with_top = 0;
+	  top();
+	}
 	char* line = NULL;
-	while (!line || !*line)
+	for (;;)
+	{
 	  line = rl_gets();
-	len = write(sockfd, line, strlen(line));        // Ignore return value, but avoid compiler warning.
+	  if (!line)
+	    exit(0);    // End of input.
+	  if (strcmp(line, "top") == 0)
+	    top();
+	  else if (strlen(line) > PROTOCOL_REQUEST_MAX)
+	    printf("Command too long.\n");
+	  else if (*line)
+	    break;
+	}
+	send_message(protocol_command, line, strlen(line));
+	break;
       }
+      // Stats that were still underway when we unsubscribed are ignored.
     }
   }
 }
@@ -0,0 +1,618 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file memleak_replay.c Replay a recorded trace through the leak detection heuristics.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <glob.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "Trace.h"
+#include "sort.h"
+
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+#define assert(x) do { } while(0)
+
+// The environment that interval.hc expects; see there.
+static void* (*memleak_libc_calloc)(size_t nmemb, size_t size) = calloc;
+static void (*memleak_libc_free)(void* ptr) = free;
+static time_t application_start;
+
+struct ReplayStats {
+  int recording;
+};
+
+// Every worker thread replays its own subset of the backtraces.
+static __thread struct ReplayStats stats;
+static __thread time_t interval_start;
+
+#include "interval.hc"
+
+//---------------------------------------------------------------------------------------------
+// Reading the trace.
+
+//! @brief A single allocation or free, decoded from the trace.
+struct Event {
+  int64_t time;                                 //!< Nanoseconds since application start.
+  uintptr_t address;                            //!< The address that was allocated or freed.
+  size_t size;                                  //!< Size of the allocation.
+  size_t order;                                 //!< The position in the trace, to keep the sort stable.
+  size_t match;                                 //!< For a free, the index of the corresponding allocation + 1, or 0 if unknown.
+  uint32_t backtrace_nr;                        //!< The backtrace of the allocation (also set for frees).
+  int tag;                                      //!< trace_alloc or trace_free.
+  Header* header;                               //!< For an allocation, the Header used while replaying.
+};
+
+typedef struct Event Event;
+
+static Event* events;
+static size_t event_count;
+static size_t event_capacity;
+static size_t unmatched_frees;
+
+static void error(char const* msg, char const* arg)
+{
+  fprintf(stderr, "memleak_replay: %s: %s\n", arg, msg);
+  exit(1);
+}
+
+static Event* new_event()
+{
+  if (event_count == event_capacity)
+  {
+    event_capacity = event_capacity ? 2 * event_capacity : 65536;
+    events = realloc(events, event_capacity * sizeof(Event));
+    if (!events)
+      error("Out of memory", "events");
+  }
+  Event* event = &events[event_count];
+  event->order = event_count++;
+  event->match = 0;
+  event->size = 0;
+  event->backtrace_nr = 0;
+  event->header = NULL;
+  return event;
+}
+
+// Return the lowest N for which PREFIX.N exists, or 0 if there is none.
+// The library removes the oldest files of a long trace (see LIBMEMLEAK_TRACE_FILES).
+static int oldest_trace_file(char const* prefix)
+{
+  char pattern[PATH_MAX];
+  snprintf(pattern, sizeof(pattern), "%s.*", prefix);
+  glob_t paths;
+  int oldest = -1;
+  if (glob(pattern, 0, NULL, &paths) == 0)
+  {
+    size_t len = strlen(prefix) + 1;
+    for (size_t i = 0; i < paths.gl_pathc; ++i)
+    {
+      char const* suffix = paths.gl_pathv[i] + len;
+      char* end;
+      long n = strtol(suffix, &end, 10);
+      if (end != suffix && *end == 0 && n >= 0 && n <= INT_MAX && (oldest == -1 || n < oldest))
+        oldest = n;
+    }
+    globfree(&paths);
+  }
+  return oldest == -1 ? 0 : oldest;
+}
+
+// Decode all records of trace file PATH. Returns 0 if the file doesn't exist.
+static int read_trace_file(char const* path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TraceFileHeader))
+    error("Truncated trace file", path);
+  unsigned char const* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED)
+    error(strerror(errno), path);
+  TraceFileHeader const* header = (TraceFileHeader const*)file;
+  if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0)
+    error("Not a libmemleak trace file", path);
+  application_start = header->application_start;
+  // Convert CLOCK_MONOTONIC to nanoseconds since application start.
+  int64_t offset = (int64_t)header->realtime_base - (int64_t)header->monotonic_base - (int64_t)header->application_start * 1000000000;
+  for (uint64_t pos = header->segment_offset; pos + sizeof(TraceSegmentHeader) <= (uint64_t)st.st_size; pos += header->segment_size)
+  {
+    TraceSegmentHeader const* segment = (TraceSegmentHeader const*)(file + pos);
+    if (segment->magic != TRACE_SEGMENT_MAGIC)
+      continue;
+    unsigned char const* p = (unsigned char const*)(segment + 1);
+    unsigned char const* end = p + segment->used;
+    if (end > file + st.st_size || segment->used > header->segment_size - sizeof(TraceSegmentHeader))
+      error("Corrupt segment", path);
+    uint64_t time = segment->base_time;
+    uintptr_t address = 0;
+    while (p < end)
+    {
+      int tag = *p++;
+      uint64_t delta_time, delta_address, size = 0, backtrace_nr = 0;
+      if (!trace_read_varint(&p, end, &delta_time) || !trace_read_varint(&p, end, &delta_address) ||
+          (tag == trace_alloc && (!trace_read_varint(&p, end, &size) || !trace_read_varint(&p, end, &backtrace_nr))))
+        error("Truncated record", path);
+      if (tag != trace_alloc && tag != trace_free)
+        error("Unknown record", path);
+      time += delta_time;
+      address += trace_unzigzag(delta_address);
+      Event* event = new_event();
+      event->time = (int64_t)time + offset;
+      event->address = address;
+      event->tag = tag;
+      event->size = size;
+      event->backtrace_nr = backtrace_nr;
+    }
+  }
+  munmap((void*)file, st.st_size);
+  return 1;
+}
+
+static int compare_events(void const* p1, void const* p2)
+{
+  Event const* e1 = p1;
+  Event const* e2 = p2;
+  if (e1->time != e2->time)
+    return e1->time < e2->time ? -1 : 1;
+  return e1->order < e2->order ? -1 : e1->order > e2->order;
+}
+
+// Open addressing hash table mapping live addresses to the index of their allocation event.
+static uintptr_t* live_address;
+static size_t* live_event;
+static size_t live_capacity;
+static size_t live_count;
+
+static inline size_t live_hash(uintptr_t address)
+{
+  return (address * 0x9e3779b97f4a7c15ULL >> 20) & (live_capacity - 1);
+}
+
+static void live_insert(uintptr_t address, size_t event);
+
+static void live_grow()
+{
+  uintptr_t* old_address = live_address;
+  size_t* old_event = live_event;
+  size_t old_capacity = live_capacity;
+  live_capacity = old_capacity ? 2 * old_capacity : 65536;
+  live_address = calloc(live_capacity, sizeof(uintptr_t));
+  live_event = malloc(live_capacity * sizeof(size_t));
+  if (!live_address || !live_event)
+    error("Out of memory", "hash table");
+  live_count = 0;
+  for (size_t i = 0; i < old_capacity; ++i)
+    if (old_address[i])
+      live_insert(old_address[i], old_event[i]);
+  free(old_address);
+  free(old_event);
+}
+
+static void live_insert(uintptr_t address, size_t event)
+{
+  if (2 * (live_count + 1) > live_capacity)
+    live_grow();
+  size_t i = live_hash(address);
+  while (live_address[i] && live_address[i] != address)
+    i = (i + 1) & (live_capacity - 1);
+  if (!live_address[i])
+    ++live_count;
+  live_address[i] = address;
+  live_event[i] = event;
+}
+
+// Remove ADDRESS and return the index of its allocation event + 1, or 0 if it isn't there.
+static size_t live_remove(uintptr_t address)
+{
+  if (!live_capacity)
+    return 0;
+  size_t i = live_hash(address);
+  while (live_address[i] != address)
+  {
+    if (!live_address[i])
+      return 0;
+    i = (i + 1) & (live_capacity - 1);
+  }
+  size_t event = live_event[i];
+  // Backward shift deletion.
+  size_t j = i;
+  for (;;)
+  {
+    j = (j + 1) & (live_capacity - 1);
+    if (!live_address[j])
+      break;
+    size_t k = live_hash(live_address[j]);
+    if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+    {
+      live_address[i] = live_address[j];
+      live_event[i] = live_event[j];
+      i = j;
+    }
+  }
+  live_address[i] = 0;
+  --live_count;
+  return event + 1;
+}
+
+// Pair every free with its allocation.
+static void match_events()
+{
+  for (size_t i = 0; i < event_count; ++i)
+  {
+    Event* event = &events[i];
+    if (event->tag == trace_alloc)
+      live_insert(event->address, i);
+    else if ((event->match = live_remove(event->address)))
+      event->backtrace_nr = events[event->match - 1].backtrace_nr;
+    else
+      ++unmatched_frees;        // Allocated before the trace started.
+  }
+}
+
+//---------------------------------------------------------------------------------------------
+// Replaying.
+
+static time_t stats_interval = 1;
+static int restart_multiplier = 5;
+static time_t begin_time = -1;                  // The time at which recording starts (the 'start' command).
+static time_t end_time;                         // The time of the last event.
+static int max_backtraces = 4;
+
+struct Worker {
+  pthread_t thread;
+  int index;
+  size_t* event_indices;                        // The events of the backtraces of this worker, in chronological order.
+  size_t count;
+  BacktraceEntry** entries;                     // Indexed by backtrace_nr / number of workers.
+  size_t entries_size;
+  BacktraceEntry* first_entry;                  // All entries of this worker.
+};
+
+typedef struct Worker Worker;
+
+static Worker* workers;
+static int worker_count;
+
+static BacktraceEntry* get_entry(Worker* worker, uint32_t backtrace_nr)
+{
+  size_t index = backtrace_nr / worker_count;
+  if (index >= worker->entries_size)
+  {
+    size_t size = worker->entries_size ? worker->entries_size : 1024;
+    while (size <= index)
+      size *= 2;
+    worker->entries = realloc(worker->entries, size * sizeof(BacktraceEntry*));
+    memset(worker->entries + worker->entries_size, 0, (size - worker->entries_size) * sizeof(BacktraceEntry*));
+    worker->entries_size = size;
+  }
+  BacktraceEntry* entry = worker->entries[index];
+  if (UNLIKELY(!entry))
+  {
+    entry = worker->entries[index] = calloc(1, sizeof(BacktraceEntry));
+    entry->backtrace_nr = backtrace_nr;
+    entry->head.prev = &entry->head;
+    entry->head.next = &entry->head;
+    entry->next = worker->first_entry;
+    worker->first_entry = entry;
+  }
+  return entry;
+}
+
+// The equivalent of one timeout of the monitor thread, at time NOW.
+static void replay_tick(Worker* worker, time_t now, int* count)
+{
+  ++*count;
+  if (*count % restart_multiplier == 0)
+  {
+    if (!stats.recording)
+    {
+      // interval_start_recording (there are no intervals yet).
+      interval_start = now;
+      stats.recording = 1;
+    }
+    else
+    {
+      // interval_restart_recording.
+      for (BacktraceEntry* entry = worker->first_entry; entry; entry = entry->next)
+        interval_end_recording(entry, now + 1);
+      interval_start = now + 1;
+    }
+  }
+  // memleak_stats.
+  for (BacktraceEntry* entry = worker->first_entry; entry; entry = entry->next)
+    interval_update_value_n(entry);
+}
+
+static void* replay(void* arg)
+{
+  Worker* worker = arg;
+  int count = -1;
+  time_t next_tick = begin_time;
+  for (size_t i = 0; i < worker->count; ++i)
+  {
+    Event* event = &events[worker->event_indices[i]];
+    time_t now = event->time / 1000000000;
+    while (now >= next_tick)
+    {
+      replay_tick(worker, next_tick, &count);
+      next_tick += stats_interval;
+    }
+    if (event->tag == trace_alloc)
+    {
+      // See add() in memleak.c.
+      Header* header = malloc(sizeof(Header));
+      BacktraceEntry* entry = get_entry(worker, event->backtrace_nr);
+      header->size = event->size;
+      header->backtrace = entry;
+      header->prev = &entry->head;
+      header->next = entry->head.next;
+      header->prev->next = header->next->prev = header;
+      ++entry->allocations;
+      header->interval = NULL;
+      header->time = now;
+      update_interval_add(header);
+      event->header = header;
+    }
+    else if (event->match)
+    {
+      // See del() in memleak.c.
+      Event* alloc = &events[event->match - 1];
+      Header* header = alloc->header;
+      alloc->header = NULL;
+      update_interval_del(header, now);
+      header->prev->next = header->next;
+      header->next->prev = header->prev;
+      --header->backtrace->allocations;
+      free(header);
+    }
+  }
+  while (end_time >= next_tick)
+  {
+    replay_tick(worker, next_tick, &count);
+    next_tick += stats_interval;
+  }
+  // See terminate() in memleak.c: stop recording and print the final stats.
+  if (stats.recording)
+    for (BacktraceEntry* entry = worker->first_entry; entry; entry = entry->next)
+      interval_end_recording(entry, end_time + 1);
+  stats.recording = 0;
+  for (BacktraceEntry* entry = worker->first_entry; entry; entry = entry->next)
+    interval_update_value_n(entry);
+  return NULL;
+}
+
+//---------------------------------------------------------------------------------------------
+// Reporting.
+
+static void interval_print(Interval const* interval)
+{
+  printf("[%4lu,%4lu>(%4lu): %5lu allocations (%6lu total, %4.1f%%), size %7lu; %6.2f allocations/s, %lu bytes/s\n",
+      interval->start, interval->end, interval->end - interval->start,
+      interval->n, interval->total_n, (100.0 * interval->n / interval->total_n), interval->size,
+      (double)interval->n / (interval->end - interval->start),
+      interval->size / (interval->end - interval->start));
+}
+
+struct LeakSet {
+  BacktraceEntry* entry;
+  size_t size;                                  // Total size of the allocations that were never freed.
+  time_t oldest;                                // Time of the oldest of them.
+};
+
+typedef struct LeakSet LeakSet;
+
+static int compare_leak_sets(void const* p1, void const* p2)
+{
+  LeakSet const* l1 = p1;
+  LeakSet const* l2 = p2;
+  return l1->size < l2->size ? 1 : l1->size > l2->size ? -1 : 0;
+}
+
+static void report(int print_allocations)
+{
+  // Collect all entries into a single list and sort it, like memleak_stats does.
+  BacktraceEntry* list = NULL;
+  size_t entries = 0;
+  for (int w = 0; w < worker_count; ++w)
+    for (BacktraceEntry* entry = workers[w].first_entry; entry; entry = entry->next)
+    {
+      entry->next_n = list;
+      list = entry;
+      ++entries;
+    }
+  list = sort_n(list, NULL);
+
+  printf("Leak ranking (stats interval %lu seconds, restart multiplier %d, recording from %lu to %lu):\n",
+      stats_interval, restart_multiplier, begin_time, end_time + 1);
+  int count = 0;
+  for (BacktraceEntry* entry = list; entry && count < max_backtraces; entry = entry->next_n)
+  {
+    int has_interval = 0;
+    for (Interval* interval = entry->intervals; interval; interval = interval->next)
+    {
+      // Skip not-so-interesting "leaks".
+      if (interval->n > 1 && interval->end)
+      {
+        printf(" backtrace %d (value_n: %6.2f); ", entry->backtrace_nr, entry->value_n);
+        interval_print(interval);
+        has_interval = 1;
+      }
+    }
+    if (has_interval)
+      ++count;
+  }
+
+  // The exact leak sets: everything that was allocated during the trace and never freed.
+  LeakSet* leak_sets = malloc(entries * sizeof(LeakSet));
+  size_t sets = 0;
+  size_t total_allocations = 0;
+  size_t total_size = 0;
+  for (BacktraceEntry* entry = list; entry; entry = entry->next_n)
+  {
+    if (entry->allocations == 0)
+      continue;
+    LeakSet* set = &leak_sets[sets++];
+    set->entry = entry;
+    set->size = 0;
+    set->oldest = end_time;
+    for (Header* header = entry->head.next; header != &entry->head; header = header->next)
+    {
+      set->size += header->size;
+      if (header->time < set->oldest)
+        set->oldest = header->time;
+    }
+    total_allocations += entry->allocations;
+    total_size += set->size;
+  }
+  qsort(leak_sets, sets, sizeof(LeakSet), compare_leak_sets);
+  printf("Never freed: %lu allocations, %lu bytes, in %lu backtraces (%lu frees of memory allocated before the trace started were ignored):\n",
+      total_allocations, total_size, sets, unmatched_frees);
+  for (size_t i = 0; i < sets && (print_allocations || i < (size_t)max_backtraces); ++i)
+    printf(" backtrace %d: %d allocations, %lu bytes, oldest at %lu\n",
+        leak_sets[i].entry->backtrace_nr, leak_sets[i].entry->allocations, leak_sets[i].size, leak_sets[i].oldest);
+  free(leak_sets);
+
+  if (print_allocations)
+  {
+    printf("Never freed allocations (time, address, size, backtrace):\n");
+    for (size_t i = 0; i < event_count; ++i)
+      if (events[i].tag == trace_alloc && events[i].header)
+        printf(" %lu.%09lu %#lx %lu %u\n", events[i].time / 1000000000, events[i].time % 1000000000,
+            events[i].address, events[i].size, events[i].backtrace_nr);
+  }
+}
+
+static void usage(char const* progname)
+{
+  fprintf(stderr, "Usage: %s [-p PREFIX] [-s N] [-r M] [-b T] [-j THREADS] [-l N] [-a]\n", progname);
+  fprintf(stderr, "  -p PREFIX  : Read the trace files PREFIX.N, PREFIX.N+1, ... starting with the oldest (default: memleak_trace).\n");
+  fprintf(stderr, "  -s N       : Stats interval in seconds (default: 1).\n");
+  fprintf(stderr, "  -r M       : Restart multiplier; must be at least 2 (default: 5).\n");
+  fprintf(stderr, "  -b T       : Start recording at T seconds since application start (default: the first event).\n");
+  fprintf(stderr, "  -j THREADS : Number of threads (default: the number of CPUs).\n");
+  fprintf(stderr, "  -l N       : Print only the first N backtraces (default: 4).\n");
+  fprintf(stderr, "  -a         : Print all backtraces and allocations that were never freed.\n");
+  exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+  char const* prefix = "memleak_trace";
+  int print_allocations = 0;
+  worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "p:s:r:b:j:l:ah")) != -1)
+  {
+    switch (opt)
+    {
+      case 'p':
+        prefix = optarg;
+        break;
+      case 's':
+        stats_interval = atoi(optarg);
+        break;
+      case 'r':
+        restart_multiplier = atoi(optarg);
+        break;
+      case 'b':
+        begin_time = atoi(optarg);
+        break;
+      case 'j':
+        worker_count = atoi(optarg);
+        break;
+      case 'l':
+        max_backtraces = atoi(optarg);
+        break;
+      case 'a':
+        print_allocations = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (stats_interval < 1 || restart_multiplier < 2 || worker_count < 1 || max_backtraces < 1 || optind != argc)
+    usage(argv[0]);
+
+  // Read all files, starting with the oldest one that is left.
+  int first = oldest_trace_file(prefix);
+  int files = 0;
+  char path[PATH_MAX];
+  for (;; ++files)
+  {
+    snprintf(path, sizeof(path), "%s.%d", prefix, first + files);
+    if (!read_trace_file(path))
+      break;
+  }
+  if (files == 0)
+    error(strerror(errno), path);
+  if (event_count == 0)
+    error("Empty trace", prefix);
+  qsort(events, event_count, sizeof(Event), compare_events);
+  match_events();
+  end_time = events[event_count - 1].time / 1000000000;
+  if (begin_time < 0)
+    begin_time = events[0].time / 1000000000;
+  fprintf(stderr, "memleak_replay: %lu events in %d files; replaying with %d threads.\n", event_count, files, worker_count);
+
+  // Partition the events by backtrace.
+  workers = calloc(worker_count, sizeof(Worker));
+  for (size_t i = 0; i < event_count; ++i)
+    if (events[i].tag == trace_alloc || events[i].match)
+      ++workers[events[i].backtrace_nr % worker_count].count;
+  for (int w = 0; w < worker_count; ++w)
+  {
+    workers[w].index = w;
+    workers[w].event_indices = malloc(workers[w].count * sizeof(size_t));
+    workers[w].count = 0;
+  }
+  for (size_t i = 0; i < event_count; ++i)
+    if (events[i].tag == trace_alloc || events[i].match)
+    {
+      Worker* worker = &workers[events[i].backtrace_nr % worker_count];
+      worker->event_indices[worker->count++] = i;
+    }
+
+  for (int w = 0; w < worker_count; ++w)
+    pthread_create(&workers[w].thread, NULL, &replay, &workers[w]);
+  for (int w = 0; w < worker_count; ++w)
+    pthread_join(workers[w].thread, NULL);
+
+  report(print_allocations);
+  return 0;
+}
@@ -0,0 +1,223 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file memleak_snapdiff.c Compare two heap snapshots.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "Snapshot.h"
+
+//! @brief A mapped snapshot file.
+struct Snapshot {
+  SnapshotHeader const* header;
+  SnapshotRecord const* records;
+  uint64_t record_count;
+};
+
+typedef struct Snapshot Snapshot;
+
+//! @brief The difference between two snapshots for a single backtrace.
+struct Difference {
+  SnapshotRecord const* old_record;             //!< The record in the old snapshot, or NULL.
+  SnapshotRecord const* new_record;             //!< The record in the new snapshot, or NULL.
+  int64_t count;                                //!< The change in the number of live allocations.
+  int64_t bytes;                                //!< The change in the size of the live allocations.
+};
+
+typedef struct Difference Difference;
+
+static int sort_by_count;
+
+static void error(char const* msg, char const* arg)
+{
+  fprintf(stderr, "memleak_snapdiff: %s: %s\n", arg, msg);
+  exit(1);
+}
+
+static void open_snapshot(char const* path, Snapshot* snapshot)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    error(strerror(errno), path);
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    error("Truncated snapshot", path);
+  char const* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED)
+    error(strerror(errno), path);
+  snapshot->header = (SnapshotHeader const*)file;
+  if (memcmp(snapshot->header->magic, SNAPSHOT_MAGIC, sizeof(snapshot->header->magic)) != 0)
+    error("Not a libmemleak snapshot", path);
+  if (snapshot->header->record_size != sizeof(SnapshotRecord) || snapshot->header->age_buckets != SNAPSHOT_AGE_BUCKETS)
+    error("Unsupported snapshot version", path);
+  snapshot->records = (SnapshotRecord const*)(file + snapshot->header->header_size);
+  snapshot->record_count = snapshot->header->record_count;
+  if (snapshot->header->header_size + snapshot->record_count * sizeof(SnapshotRecord) > (uint64_t)st.st_size)
+    error("Truncated snapshot", path);
+}
+
+// Merge the records of OLD and NEW, which are both sorted by backtrace number. Returns the number of differences.
+static size_t compare(Snapshot const* old, Snapshot const* new, Difference* differences)
+{
+  size_t count = 0;
+  uint64_t i = 0, j = 0;
+  while (i < old->record_count || j < new->record_count)
+  {
+    Difference* difference = &differences[count];
+    difference->old_record = difference->new_record = NULL;
+    if (j == new->record_count || (i < old->record_count && old->records[i].backtrace_nr < new->records[j].backtrace_nr))
+      difference->old_record = &old->records[i++];
+    else if (i == old->record_count || new->records[j].backtrace_nr < old->records[i].backtrace_nr)
+      difference->new_record = &new->records[j++];
+    else
+    {
+      difference->old_record = &old->records[i++];
+      difference->new_record = &new->records[j++];
+    }
+    difference->count = (difference->new_record ? (int64_t)difference->new_record->count : 0) -
+                        (difference->old_record ? (int64_t)difference->old_record->count : 0);
+    difference->bytes = (difference->new_record ? (int64_t)difference->new_record->bytes : 0) -
+                        (difference->old_record ? (int64_t)difference->old_record->bytes : 0);
+    if (difference->count != 0 || difference->bytes != 0)
+      ++count;
+  }
+  return count;
+}
+
+// Sort on decreasing growth.
+static int compare_differences(void const* p1, void const* p2)
+{
+  Difference const* d1 = p1;
+  Difference const* d2 = p2;
+  int64_t v1 = sort_by_count ? d1->count : d1->bytes;
+  int64_t v2 = sort_by_count ? d2->count : d2->bytes;
+  return v1 < v2 ? 1 : v1 > v2 ? -1 : 0;
+}
+
+static uint32_t backtrace_nr(Difference const* difference)
+{
+  return difference->new_record ? difference->new_record->backtrace_nr : difference->old_record->backtrace_nr;
+}
+
+static void print_ages(SnapshotRecord const* record)
+{
+  printf("    age:");
+  for (int bucket = 0; bucket < SNAPSHOT_AGE_BUCKETS; ++bucket)
+  {
+    if (record->age[bucket] == 0)
+      continue;
+    if (bucket == 0)
+      printf(" <1s: %u", record->age[bucket]);
+    else if (bucket == 1)
+      printf(" 1s: %u", record->age[bucket]);
+    else if (bucket == SNAPSHOT_AGE_BUCKETS - 1)
+      printf(" >=%ds: %u", 1 << (bucket - 1), record->age[bucket]);
+    else
+      printf(" %d-%ds: %u", 1 << (bucket - 1), (1 << bucket) - 1, record->age[bucket]);
+  }
+  if (record->unknown_age)
+    printf(" unknown: %u", record->unknown_age);
+  printf("\n");
+}
+
+static void usage(char const* progname)
+{
+  fprintf(stderr, "Usage: %s [-n N] [-c] [-a] OLD NEW\n", progname);
+  fprintf(stderr, "  -n N : Print only the N backtraces that grew the most (default: 20; 0 prints all).\n");
+  fprintf(stderr, "  -c   : Sort on the change in the number of allocations instead of bytes.\n");
+  fprintf(stderr, "  -a   : Print the age histogram of the live allocations in NEW.\n");
+  exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+  int max_backtraces = 20;
+  int print_ages_histogram = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:cah")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        max_backtraces = atoi(optarg);
+        break;
+      case 'c':
+        sort_by_count = 1;
+        break;
+      case 'a':
+        print_ages_histogram = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (max_backtraces < 0 || optind + 2 != argc)
+    usage(argv[0]);
+
+  Snapshot old, new;
+  open_snapshot(argv[optind], &old);
+  open_snapshot(argv[optind + 1], &new);
+  // Backtrace numbers are only meaningful within the same run of the application.
+  if (old.header->pid != new.header->pid || old.header->application_start != new.header->application_start)
+    fprintf(stderr, "memleak_snapdiff: Warning: the snapshots are of different processes; backtrace numbers don't correspond.\n");
+
+  Difference* differences = malloc((old.record_count + new.record_count + 1) * sizeof(Difference));
+  if (!differences)
+    error("Out of memory", "differences");
+  size_t count = compare(&old, &new, differences);
+  qsort(differences, count, sizeof(Difference), compare_differences);
+
+  printf("Application: \"%s\" (pid %d); backtraces in \"%s\".\n", new.header->application, new.header->pid, new.header->backtraces);
+  printf("Old: %ld seconds after start; %lu allocations (%lu of unknown age), %lu bytes.\n", (long)old.header->time,
+      (unsigned long)old.header->allocations, (unsigned long)old.header->unknown_age, (unsigned long)old.header->total_memory);
+  printf("New: %ld seconds after start; %lu allocations (%lu of unknown age), %lu bytes.\n", (long)new.header->time,
+      (unsigned long)new.header->allocations, (unsigned long)new.header->unknown_age, (unsigned long)new.header->total_memory);
+  printf("Change over %ld seconds: %+ld allocations, %+ld bytes, in %lu backtraces.\n", (long)(new.header->time - old.header->time),
+      (long)(new.header->allocations - old.header->allocations), (long)(new.header->total_memory - old.header->total_memory),
+      (unsigned long)count);
+  if (max_backtraces == 0 || (size_t)max_backtraces > count)
+    max_backtraces = count;
+  for (int i = 0; i < max_backtraces; ++i)
+  {
+    Difference const* difference = &differences[i];
+    printf("backtrace %u: %lu -> %lu allocations (%+ld), %lu -> %lu bytes (%+ld)", backtrace_nr(difference),
+        (unsigned long)(difference->old_record ? difference->old_record->count : 0),
+        (unsigned long)(difference->new_record ? difference->new_record->count : 0), (long)difference->count,
+        (unsigned long)(difference->old_record ? difference->old_record->bytes : 0),
+        (unsigned long)(difference->new_record ? difference->new_record->bytes : 0), (long)difference->bytes);
+    if (difference->new_record && difference->new_record->count > difference->new_record->unknown_age)
+      printf("; oldest allocated at %ld", (long)difference->new_record->oldest);
+    printf("\n");
+    if (print_ages_histogram && difference->new_record)
+      print_ages(difference->new_record);
+  }
+  free(differences);
+  return 0;
+}
@@ -0,0 +1,343 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file output.c Asynchronous writing of stats and backtraces.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "output.h"
+#include "format.h"
+#include "addr2line.h"
+#include "BacktraceEntry.h"
+#include "BacktraceDB.h"
+
+extern void* (*memleak_libc_malloc)(size_t size);
+extern void (*memleak_libc_free)(void* ptr);
+
+// The maximum number of buffers that can be queued before output_submit blocks.
+#define OUTPUT_QUEUE_SIZE 64
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int output_fd[output_channels] = { -1, -1 };
+static int output_stats_format = format_text;
+
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_idle = PTHREAD_COND_INITIALIZER;
+static OutputBuffer* output_queue[OUTPUT_QUEUE_SIZE];
+static unsigned int output_head;                // Index of the oldest queued buffer.
+static unsigned int output_count;               // Number of queued buffers.
+static int output_busy;                         // Set while the writer is processing buffers that it took from the queue.
+
+// Open the destination described by SPEC: "-" or "stdout", "stderr", "fd:N" or a file name.
+static int output_open(char const* spec)
+{
+  if (strcmp(spec, "-") == 0 || strcmp(spec, "stdout") == 0)
+    return 1;
+  if (strcmp(spec, "stderr") == 0)
+    return 2;
+  if (strncmp(spec, "fd:", 3) == 0)
+    return atoi(spec + 3);
+  int fd = open(spec, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    fprintf(stderr, "libmemleak: %s: %s\n", spec, strerror(errno));
+  return fd;
+}
+
+void output_init(char const* exename, int64_t application_start)
+{
+  char const* stats_spec = getenv("LIBMEMLEAK_OUTPUT");
+  if (!stats_spec)
+    stats_spec = "memleak_stats";
+  char const* backtraces_spec = getenv("LIBMEMLEAK_BACKTRACES");
+  if (!backtraces_spec)
+    backtraces_spec = "memleak_backtraces";
+  output_fd[output_stats] = output_open(stats_spec);
+  char const* format_spec = getenv("LIBMEMLEAK_FORMAT");
+  if (format_spec && format_parse(format_spec) < 0)
+    fprintf(stderr, "libmemleak: LIBMEMLEAK_FORMAT: unknown format \"%s\"; use text, json or csv.\n", format_spec);
+  else if (format_spec)
+    output_stats_format = format_parse(format_spec);
+  if (output_stats_format == format_csv)
+  {
+    OutputBuffer* buf = output_buffer_create(output_stats);
+    format_csv_columns(buf);
+    output_submit(buf);
+  }
+  backtrace_db_open(backtraces_spec, exename, application_start);
+}
+
+int output_format()
+{
+  return output_stats_format;
+}
+
+OutputBuffer* output_buffer_create(int channel)
+{
+  OutputBuffer* buf = (*memleak_libc_malloc)(sizeof(OutputBuffer));
+  buf->channel = channel;
+  buf->len = 0;
+  buf->capacity = 256;
+  buf->data = (*memleak_libc_malloc)(buf->capacity);
+  buf->backtraces = NULL;
+  buf->entries = 0;
+  buf->records = NULL;
+  buf->record_count = 0;
+  return buf;
+}
+
+void output_buffer_destroy(OutputBuffer* buf)
+{
+  if (buf->backtraces)
+    (*memleak_libc_free)(buf->backtraces);
+  if (buf->records)
+    (*memleak_libc_free)(buf->records);
+  (*memleak_libc_free)(buf->data);
+  (*memleak_libc_free)(buf);
+}
+
+void output_buffer_reserve(OutputBuffer* buf, size_t len)
+{
+  if (buf->len + len < buf->capacity)
+    return;
+  size_t capacity = buf->capacity;
+  while (buf->len + len >= capacity)
+    capacity *= 2;
+  char* data = (*memleak_libc_malloc)(capacity);
+  memcpy(data, buf->data, buf->len);
+  (*memleak_libc_free)(buf->data);
+  buf->data = data;
+  buf->capacity = capacity;
+}
+
+void output_buffer_vprintf(OutputBuffer* buf, char const* format, va_list ap)
+{
+  va_list ap2;
+  va_copy(ap2, ap);
+  int len = vsnprintf(buf->data + buf->len, buf->capacity - buf->len, format, ap);
+  if (len >= 0 && buf->len + len >= buf->capacity)
+  {
+    output_buffer_reserve(buf, len);
+    len = vsnprintf(buf->data + buf->len, buf->capacity - buf->len, format, ap2);
+  }
+  va_end(ap2);
+  if (len > 0)
+    buf->len += len;
+}
+
+void output_buffer_write(OutputBuffer* buf, char const* data, size_t len)
+{
+  output_buffer_reserve(buf, len);
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+void output_buffer_printf(OutputBuffer* buf, char const* format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  output_buffer_vprintf(buf, format, ap);
+  va_end(ap);
+}
+
+void output_printf(int channel, char const* format, ...)
+{
+  OutputBuffer* buf = output_buffer_create(channel);
+  va_list ap;
+  va_start(ap, format);
+  output_buffer_vprintf(buf, format, ap);
+  va_end(ap);
+  if (channel == output_stats && output_stats_format != format_text)
+  {
+    OutputBuffer* formatted = output_buffer_create(channel);
+    format_message(formatted, output_stats_format, buf->data, buf->len);
+    output_buffer_destroy(buf);
+    buf = formatted;
+  }
+  output_submit(buf);
+}
+
+void output_submit(OutputBuffer* buf)
+{
+  pthread_mutex_lock(&output_mutex);
+  while (output_count == OUTPUT_QUEUE_SIZE)
+    pthread_cond_wait(&output_not_full, &output_mutex);
+  output_queue[(output_head + output_count) % OUTPUT_QUEUE_SIZE] = buf;
+  ++output_count;
+  pthread_cond_signal(&output_not_empty);
+  pthread_mutex_unlock(&output_mutex);
+}
+
+void output_flush()
+{
+  pthread_mutex_lock(&output_mutex);
+  while (output_count > 0 || output_busy)
+    pthread_cond_wait(&output_idle, &output_mutex);
+  pthread_mutex_unlock(&output_mutex);
+}
+
+// Write IOVCNT buffers to FD, continuing after partial writes.
+static void output_writev(int fd, struct iovec* iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    ssize_t ret = writev(fd, iov, iovcnt);
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+      {
+        // A non-blocking pipe or socket; wait until it can take more.
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, -1) >= 0 || errno == EINTR)
+          continue;
+      }
+      // Fatal error; drop the output.
+      return;
+    }
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len)
+    {
+      ret -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+}
+
+// Symbolize the backtraces of BUF and add them to the string table of the backtrace database.
+// Returns the summary for output_stats, or NULL.
+static OutputBuffer* output_symbolize(OutputBuffer* buf)
+{
+  for(int e = buf->entries - 1; e >= 0; --e)
+  {
+    BacktraceEntry* entry = &buf->backtraces[e];
+    char* text;
+    size_t len;
+    FILE* fp = open_memstream(&text, &len);
+    fprintf(fp, "Backtrace %d:\n", entry->backtrace_nr);
+    addr2line_print(fp, entry->ptr, entry->backtrace_size);
+    fclose(fp);
+    backtrace_db_set_strings(entry->backtrace_nr, text, len);
+    free(text);
+  }
+  OutputBuffer* summary = NULL;
+  if (buf->entries > 0)
+  {
+    char msg[80];
+    int len = snprintf(msg, sizeof(msg), "libmemleak: Wrote %d new backtraces (%3.1f %% cache hits).\n", buf->entries, 100.0 * frame_cache_stats());
+    summary = output_buffer_create(output_stats);
+    format_message(summary, output_stats_format, msg, len);
+  }
+  (*memleak_libc_free)(buf->backtraces);
+  buf->backtraces = NULL;
+  return summary;
+}
+
+void output_writer()
+{
+  // Room for a summary after every queued buffer.
+  OutputBuffer* batch[2 * OUTPUT_QUEUE_SIZE];
+  struct iovec iov[2 * OUTPUT_QUEUE_SIZE];
+  for(;;)
+  {
+    // Take everything that is queued.
+    pthread_mutex_lock(&output_mutex);
+    while (output_count == 0)
+    {
+      output_busy = 0;
+      pthread_cond_broadcast(&output_idle);
+      pthread_cond_wait(&output_not_empty, &output_mutex);
+    }
+    int n = output_count;
+    for (int i = 0; i < n; ++i)
+      batch[i] = output_queue[(output_head + i) % OUTPUT_QUEUE_SIZE];
+    output_head = (output_head + n) % OUTPUT_QUEUE_SIZE;
+    output_count = 0;
+    output_busy = 1;
+    pthread_cond_broadcast(&output_not_full);
+    pthread_mutex_unlock(&output_mutex);
+
+    // Symbolizing is done here, so that neither the monitor nor the application has to wait for it.
+    // The summary is inserted into the batch right after its buffer: the writer can't use output_submit,
+    // because it would block on itself when the queue is full.
+    for (int i = 0; i < n; ++i)
+    {
+      if (batch[i]->records)
+        backtrace_db_append(batch[i]->records, batch[i]->record_count);
+      OutputBuffer* summary = batch[i]->backtraces ? output_symbolize(batch[i]) : NULL;
+      if (summary)
+      {
+        memmove(&batch[i + 2], &batch[i + 1], (n - i - 1) * sizeof(OutputBuffer*));
+        batch[++i] = summary;
+        ++n;
+      }
+    }
+
+    // Write consecutive buffers for the same channel with a single writev.
+    int first = 0;
+    while (first < n)
+    {
+      int channel = batch[first]->channel;
+      int last = first;
+      int iovcnt = 0;
+      while (last < n && batch[last]->channel == channel && iovcnt < IOV_MAX)
+      {
+        if (batch[last]->len > 0)
+        {
+          iov[iovcnt].iov_base = batch[last]->data;
+          iov[iovcnt].iov_len = batch[last]->len;
+          ++iovcnt;
+        }
+        ++last;
+      }
+      if (output_fd[channel] >= 0)
+        output_writev(output_fd[channel], iov, iovcnt);
+      for (int i = first; i < last; ++i)
+        output_buffer_destroy(batch[i]);
+      first = last;
+    }
+  }
+}
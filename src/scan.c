@@ -0,0 +1,698 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file scan.c Conservative reachability scan of the tracked allocations.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <link.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "scan.h"
+
+// The size of the pieces that the roots are divided into, for the marking threads.
+#define SCAN_CHUNK (64 * 1024)
+
+// Fixed capacities; all of these are mapped with MAP_NORESERVE, so only what is used costs memory.
+#define SCAN_MAPS_BUFFER (64 * 1024 * 1024)
+#define SCAN_RANGES_MAX (1024 * 1024)
+#define SCAN_THREADS_MAX 16384
+#define SCAN_WORKERS_MAX 64
+
+// Stop at most this long for all threads to acknowledge the stop signal.
+#define SCAN_STOP_TIMEOUT_MS 2000
+
+// Extra static TLS that glibc reserves beyond the PT_TLS segments, and room for the thread control block.
+#define SCAN_TLS_SURPLUS 4096
+#define SCAN_TCB_SIZE 2048
+
+// A range of addresses [start, end).
+struct Range {
+  uintptr_t start;
+  uintptr_t end;
+};
+
+// A stopped thread, as recorded by its signal handler.
+struct ScanThread {
+  pid_t tid;
+  uintptr_t sp;                                 // The stack pointer at the moment the thread was interrupted.
+  uintptr_t tp;                                 // The thread pointer.
+  ucontext_t context;                           // The registers.
+};
+
+struct ScanWorker {
+  pthread_t thread;
+  pid_t tid;
+  ScanState* scan;
+  size_t* stack;                                // Allocations that were marked but not scanned yet.
+  size_t top;
+};
+
+struct ScanState {
+  ScanBlock* blocks;
+  ScanBlock* tmp;                               // Second buffer for the radix sort.
+  size_t capacity;                              // The size of blocks and tmp.
+  size_t count;
+  uint64_t* marks;                              // One bit per allocation, set atomically.
+  uintptr_t lowest;                             // The start of the first allocation.
+  uintptr_t span;                               // The end of the last allocation minus lowest.
+
+  struct Range* segments;                       // The writable segments of all loaded objects.
+  size_t segment_count;
+  size_t tls_size;                              // The static TLS of all loaded objects.
+
+  struct Range* maps;                           // All readable mappings, sorted.
+  size_t map_count;
+  struct Range* roots;
+  size_t root_count;
+  struct Range* chunks;
+  size_t chunk_count;
+  size_t next_chunk;                            // The first chunk that no worker took yet.
+
+  pid_t* signalled;                             // The threads that were sent the stop signal.
+  size_t signalled_count;
+
+  int worker_count;                              // The number of marking threads besides the one that calls scan_run.
+  int started;                                  // The number of marking threads that started.
+  int go;                                       // Set to scan_go or scan_abort to let the marking threads continue.
+  int done;                                     // The number of marking threads that are done.
+  struct ScanWorker workers[SCAN_WORKERS_MAX + 1];      // workers[0] is the thread that calls scan_run.
+};
+
+enum { scan_wait, scan_go, scan_abort };
+
+static int scan_signal;
+static struct ScanThread* scan_threads;
+static int scan_threads_used;                   // The number of slots of scan_threads that handlers claimed.
+static int scan_acks;                           // The number of threads that stopped.
+static int scan_active;                         // Set while the world is being stopped.
+static int scan_generation;                     // Incremented to resume the world.
+
+static void* scan_map(size_t size)
+{
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static void scan_unmap(void* ptr, size_t size)
+{
+  if (ptr)
+    munmap(ptr, size);
+}
+
+static void futex_wait(int* addr, int value, struct timespec const* timeout)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake(int* addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static double scan_elapsed_ms(struct timespec const* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+//---------------------------------------------------------------------------------------------
+// Stopping the world
+
+static void scan_suspend(int sig __attribute__((unused)), siginfo_t* info __attribute__((unused)), void* context)
+{
+  int saved_errno = errno;
+  // Read the generation before scan_active; see scan_resume.
+  int generation = __atomic_load_n(&scan_generation, __ATOMIC_ACQUIRE);
+  if (!__atomic_load_n(&scan_active, __ATOMIC_ACQUIRE))
+  {
+    errno = saved_errno;
+    return;     // A signal that arrived after the scan was over.
+  }
+  int slot = __atomic_fetch_add(&scan_threads_used, 1, __ATOMIC_RELAXED);
+  if (slot < SCAN_THREADS_MAX)
+  {
+    struct ScanThread* thread = &scan_threads[slot];
+    ucontext_t* uc = context;
+    thread->tid = syscall(SYS_gettid);
+    thread->context = *uc;
+#if defined(__x86_64__)
+    thread->sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+    thread->sp = uc->uc_mcontext.gregs[REG_ESP];
+#elif defined(__aarch64__)
+    thread->sp = uc->uc_mcontext.sp;
+#else
+    thread->sp = (uintptr_t)&slot;
+#endif
+    thread->tp = (uintptr_t)pthread_self();     // glibc: the thread control block.
+  }
+  __atomic_fetch_add(&scan_acks, 1, __ATOMIC_RELEASE);
+  futex_wake(&scan_acks);
+  while (__atomic_load_n(&scan_generation, __ATOMIC_ACQUIRE) == generation)
+    futex_wait(&scan_generation, generation, NULL);
+  errno = saved_errno;
+}
+
+static int scan_install_handler()
+{
+  if (scan_signal)
+    return 0;
+  int sig = SIGRTMIN + 6;
+  char const* signal_str = getenv("LIBMEMLEAK_SCAN_SIGNAL");
+  if (signal_str && atoi(signal_str) > 0)
+    sig = atoi(signal_str);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = scan_suspend;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigfillset(&action.sa_mask);
+  if (sigaction(sig, &action, NULL) == -1)
+    return -1;
+  scan_signal = sig;
+  return 0;
+}
+
+static int scan_is_ours(ScanState const* scan, pid_t tid)
+{
+  for (int i = 0; i <= scan->worker_count; ++i)
+    if (scan->workers[i].tid == tid)
+      return 1;
+  for (size_t i = 0; i < scan->signalled_count; ++i)
+    if (scan->signalled[i] == tid)
+      return 1;
+  return 0;
+}
+
+// Send the stop signal to every thread that didn't get it yet. Returns the number of threads signalled.
+// Doesn't use opendir, because that calls malloc.
+static size_t scan_signal_threads(ScanState* scan)
+{
+  int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  pid_t pid = getpid();
+  size_t signalled = 0;
+  char buf[4096];
+  long len;
+  while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+  {
+    for (long pos = 0; pos < len;)
+    {
+      struct {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+      } const* d = (void const*)(buf + pos);
+      pos += d->d_reclen;
+      pid_t tid = atoi(d->d_name);
+      if (tid <= 0 || scan_is_ours(scan, tid) || scan->signalled_count == SCAN_THREADS_MAX)
+        continue;
+      if (syscall(SYS_tgkill, pid, tid, scan_signal) == 0)
+      {
+        scan->signalled[scan->signalled_count++] = tid;
+        ++signalled;
+      }
+    }
+  }
+  close(fd);
+  return signalled;
+}
+
+// Wait until COUNT threads acknowledged the stop signal, or the deadline passed.
+static void scan_wait_acks(int count, struct timespec const* start)
+{
+  int acks;
+  while ((acks = __atomic_load_n(&scan_acks, __ATOMIC_ACQUIRE)) < count)
+  {
+    if (scan_elapsed_ms(start) > SCAN_STOP_TIMEOUT_MS)
+      break;
+    struct timespec timeout = { 0, 10000000 };
+    futex_wait(&scan_acks, acks, &timeout);
+  }
+}
+
+static void scan_stop_world(ScanState* scan)
+{
+  scan_threads_used = 0;
+  scan_acks = 0;
+  __atomic_store_n(&scan_active, 1, __ATOMIC_RELEASE);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // Threads that were created while signalling the others might have been missed: repeat until there are no new ones.
+  while (scan_signal_threads(scan) > 0)
+    scan_wait_acks(scan->signalled_count, &start);
+}
+
+static void scan_resume_world()
+{
+  // Clear scan_active before changing the generation, so that a handler that sees the new
+  // generation also sees that the scan is over.
+  __atomic_store_n(&scan_active, 0, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&scan_generation, 1, __ATOMIC_RELEASE);
+  futex_wake(&scan_generation);
+}
+
+//---------------------------------------------------------------------------------------------
+// Roots
+
+static int scan_segment(struct dl_phdr_info* info, size_t size __attribute__((unused)), void* data)
+{
+  ScanState* scan = data;
+  for (int i = 0; i < info->dlpi_phnum; ++i)
+  {
+    ElfW(Phdr) const* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type == PT_TLS)
+      scan->tls_size += phdr->p_memsz + phdr->p_align;
+    if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_W) || scan->segment_count == SCAN_RANGES_MAX)
+      continue;
+    struct Range* segment = &scan->segments[scan->segment_count++];
+    segment->start = info->dlpi_addr + phdr->p_vaddr;
+    segment->end = segment->start + phdr->p_memsz;
+  }
+  return 0;
+}
+
+static uintptr_t parse_hex(char const** p)
+{
+  uintptr_t value = 0;
+  for (;; ++*p)
+  {
+    char c = **p;
+    if (c >= '0' && c <= '9')
+      value = value * 16 + c - '0';
+    else if (c >= 'a' && c <= 'f')
+      value = value * 16 + c - 'a' + 10;
+    else
+      return value;
+  }
+}
+
+// Read the readable mappings from /proc/self/maps into scan->maps.
+static int scan_read_maps(ScanState* scan)
+{
+  char* buf = scan_map(SCAN_MAPS_BUFFER);
+  if (!buf)
+    return -1;
+  int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  size_t len = 0;
+  ssize_t n;
+  while (fd >= 0 && len < SCAN_MAPS_BUFFER - 1 && (n = read(fd, buf + len, SCAN_MAPS_BUFFER - 1 - len)) > 0)
+    len += n;
+  if (fd >= 0)
+    close(fd);
+  buf[len] = 0;
+  scan->map_count = 0;
+  for (char const* p = buf; *p && scan->map_count < SCAN_RANGES_MAX;)
+  {
+    char const* line = p;
+    uintptr_t start = parse_hex(&p);
+    ++p;
+    uintptr_t end = parse_hex(&p);
+    int readable = p[1] == 'r';
+    while (*p && *p != '\n')
+      ++p;
+    // Reading [vvar] can fault.
+    char const* name = memchr(line, '[', p - line);
+    if (readable && !(name && strncmp(name, "[vvar", 5) == 0) && !(name && strncmp(name, "[vsyscall", 9) == 0))
+    {
+      scan->maps[scan->map_count].start = start;
+      scan->maps[scan->map_count].end = end;
+      ++scan->map_count;
+    }
+    if (*p)
+      ++p;
+  }
+  scan_unmap(buf, SCAN_MAPS_BUFFER);
+  return 0;
+}
+
+// Return the first readable mapping that ends after ADDR.
+static size_t scan_find_map(ScanState const* scan, uintptr_t addr)
+{
+  size_t lo = 0, hi = scan->map_count;
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (scan->maps[mid].end <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Add the readable parts of [START, END) to the roots.
+static void scan_add_root(ScanState* scan, uintptr_t start, uintptr_t end)
+{
+  for (size_t m = scan_find_map(scan, start); m < scan->map_count && scan->maps[m].start < end; ++m)
+  {
+    if (scan->root_count == SCAN_RANGES_MAX)
+      return;
+    struct Range* root = &scan->roots[scan->root_count++];
+    root->start = start > scan->maps[m].start ? start : scan->maps[m].start;
+    root->end = end < scan->maps[m].end ? end : scan->maps[m].end;
+  }
+}
+
+static void scan_collect_roots(ScanState* scan, int stopped)
+{
+  scan->root_count = 0;
+  for (size_t i = 0; i < scan->segment_count; ++i)
+    scan_add_root(scan, scan->segments[i].start, scan->segments[i].end);
+  for (int i = 0; i < stopped; ++i)
+  {
+    struct ScanThread* thread = &scan_threads[i];
+    // The registers.
+    scan_add_root(scan, (uintptr_t)&thread->context, (uintptr_t)(&thread->context + 1));
+    // The stack, from the stack pointer up to the end of its mapping. Threads created by
+    // glibc also have their static TLS there.
+    size_t m = scan_find_map(scan, thread->sp);
+    if (m < scan->map_count && scan->maps[m].start <= thread->sp)
+      scan_add_root(scan, thread->sp, scan->maps[m].end);
+    // The static TLS and the thread control block (which points to the dynamic TLS).
+    uintptr_t tls_start = thread->tp > scan->tls_size ? thread->tp - scan->tls_size : 0;
+    scan_add_root(scan, tls_start, thread->tp + SCAN_TCB_SIZE);
+  }
+  // Divide the roots into chunks.
+  scan->chunk_count = 0;
+  for (size_t i = 0; i < scan->root_count && scan->chunk_count < SCAN_RANGES_MAX; ++i)
+    for (uintptr_t start = scan->roots[i].start; start < scan->roots[i].end && scan->chunk_count < SCAN_RANGES_MAX; start += SCAN_CHUNK)
+    {
+      struct Range* chunk = &scan->chunks[scan->chunk_count++];
+      chunk->start = start;
+      chunk->end = scan->roots[i].end - start > SCAN_CHUNK ? start + SCAN_CHUNK : scan->roots[i].end;
+    }
+  scan->next_chunk = 0;
+}
+
+//---------------------------------------------------------------------------------------------
+// Marking
+
+// Return the index of the allocation that contains ADDR, or -1.
+static inline ssize_t scan_lookup(ScanState const* scan, uintptr_t addr)
+{
+  size_t lo = 0, hi = scan->count;
+  while (hi - lo > 1)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (scan->blocks[mid].start <= addr)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  ScanBlock const* block = &scan->blocks[lo];
+  // Pointers just past the end of an allocation count too, as well as pointers to allocations of size 0.
+  return addr >= block->start && addr <= block->start + block->size ? (ssize_t)lo : -1;
+}
+
+// Set the mark of allocation I. Returns nonzero if it wasn't marked yet.
+static inline int scan_mark(ScanState* scan, size_t i)
+{
+  uint64_t bit = (uint64_t)1 << (i % 64);
+  uint64_t* word = &scan->marks[i / 64];
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+    return 0;
+  return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+static void scan_range(struct ScanWorker* worker, uintptr_t start, uintptr_t end)
+{
+  ScanState* scan = worker->scan;
+  start = (start + sizeof(uintptr_t) - 1) & ~(uintptr_t)(sizeof(uintptr_t) - 1);
+  for (uintptr_t p = start; p + sizeof(uintptr_t) <= end; p += sizeof(uintptr_t))
+  {
+    uintptr_t value = *(uintptr_t const*)p;
+    if (value - scan->lowest > scan->span)
+      continue;
+    ssize_t i = scan_lookup(scan, value);
+    if (i >= 0 && scan_mark(scan, i))
+      worker->stack[worker->top++] = i;
+  }
+}
+
+static void scan_work(struct ScanWorker* worker)
+{
+  ScanState* scan = worker->scan;
+  size_t chunk;
+  while ((chunk = __atomic_fetch_add(&scan->next_chunk, 1, __ATOMIC_RELAXED)) < scan->chunk_count)
+  {
+    scan_range(worker, scan->chunks[chunk].start, scan->chunks[chunk].end);
+    while (worker->top > 0)
+    {
+      ScanBlock const* block = &scan->blocks[worker->stack[--worker->top]];
+      scan_range(worker, block->start, block->start + block->size);
+    }
+  }
+}
+
+static void* scan_worker(void* arg)
+{
+  struct ScanWorker* worker = arg;
+  ScanState* scan = worker->scan;
+  __atomic_store_n(&worker->tid, syscall(SYS_gettid), __ATOMIC_RELAXED);
+  __atomic_fetch_add(&scan->started, 1, __ATOMIC_RELEASE);
+  futex_wake(&scan->started);
+  int go;
+  while ((go = __atomic_load_n(&scan->go, __ATOMIC_ACQUIRE)) == scan_wait)
+    futex_wait(&scan->go, scan_wait, NULL);
+  if (go == scan_go)
+  {
+    scan_work(worker);
+    __atomic_fetch_add(&scan->done, 1, __ATOMIC_RELEASE);
+    futex_wake(&scan->done);
+  }
+  return NULL;
+}
+
+// Wait until *COUNTER reaches VALUE.
+static void scan_wait_for(int* counter, int value)
+{
+  int current;
+  while ((current = __atomic_load_n(counter, __ATOMIC_ACQUIRE)) < value)
+    futex_wait(counter, current, NULL);
+}
+
+// Let the marking threads continue with GO (scan_go or scan_abort).
+static void scan_release_workers(ScanState* scan, int go)
+{
+  __atomic_store_n(&scan->go, go, __ATOMIC_RELEASE);
+  futex_wake(&scan->go);
+}
+
+//---------------------------------------------------------------------------------------------
+// Sorting
+
+// Sort the allocations by address with a radix sort, because qsort might call malloc.
+static int scan_sort(ScanState* scan)
+{
+  size_t count = scan->count;
+  if (count < 2)
+    return 0;
+  size_t* counts = scan_map(65536 * sizeof(size_t));
+  if (!counts)
+    return -1;
+  uintptr_t diff = 0;
+  for (size_t i = 1; i < count; ++i)
+    diff |= scan->blocks[i].start ^ scan->blocks[0].start;
+  ScanBlock* from = scan->blocks;
+  ScanBlock* to = scan->tmp;
+  for (unsigned int shift = 0; shift < 8 * sizeof(uintptr_t) && (diff >> shift); shift += 16)
+  {
+    memset(counts, 0, 65536 * sizeof(size_t));
+    for (size_t i = 0; i < count; ++i)
+      ++counts[(from[i].start >> shift) & 0xffff];
+    size_t sum = 0;
+    for (int digit = 0; digit < 65536; ++digit)
+    {
+      size_t n = counts[digit];
+      counts[digit] = sum;
+      sum += n;
+    }
+    for (size_t i = 0; i < count; ++i)
+      to[counts[(from[i].start >> shift) & 0xffff]++] = from[i];
+    ScanBlock* tmp = from;
+    from = to;
+    to = tmp;
+  }
+  if (from != scan->blocks)
+    memcpy(scan->blocks, from, count * sizeof(ScanBlock));
+  scan_unmap(counts, 65536 * sizeof(size_t));
+  return 0;
+}
+
+//---------------------------------------------------------------------------------------------
+// Interface
+
+ScanState* scan_prepare(int workers)
+{
+  if (scan_install_handler() == -1)
+    return NULL;
+  if (!scan_threads && !(scan_threads = scan_map(SCAN_THREADS_MAX * sizeof(struct ScanThread))))
+    return NULL;
+  if (workers > SCAN_WORKERS_MAX)
+    workers = SCAN_WORKERS_MAX;
+  if (workers < 0)
+    workers = 0;
+  ScanState* scan = scan_map(sizeof(ScanState));
+  if (!scan)
+    return NULL;
+  scan->segments = scan_map(SCAN_RANGES_MAX * sizeof(struct Range));
+  scan->maps = scan_map(SCAN_RANGES_MAX * sizeof(struct Range));
+  scan->roots = scan_map(SCAN_RANGES_MAX * sizeof(struct Range));
+  scan->chunks = scan_map(SCAN_RANGES_MAX * sizeof(struct Range));
+  scan->signalled = scan_map(SCAN_THREADS_MAX * sizeof(pid_t));
+  if (!scan->segments || !scan->maps || !scan->roots || !scan->chunks || !scan->signalled)
+  {
+    scan_finish(scan);
+    return NULL;
+  }
+  // dl_iterate_phdr takes a lock that a stopped thread, or one that waits for memleak_mutex, might hold.
+  scan->tls_size = SCAN_TLS_SURPLUS;
+  dl_iterate_phdr(scan_segment, scan);
+  // Start the marking threads here, because pthread_create calls malloc. They have to be
+  // running before the world is stopped, so that their thread IDs are known.
+  scan->workers[0].scan = scan;
+  scan->workers[0].tid = syscall(SYS_gettid);
+  for (int i = 1; i <= workers; ++i)
+  {
+    scan->workers[i].scan = scan;
+    if (pthread_create(&scan->workers[i].thread, NULL, scan_worker, &scan->workers[i]) != 0)
+      break;    // Continue with the threads that could be started.
+    ++scan->worker_count;
+  }
+  scan_wait_for(&scan->started, scan->worker_count);
+  return scan;
+}
+
+ScanBlock* scan_blocks(ScanState* scan, size_t count)
+{
+  scan->capacity = count;
+  scan->blocks = scan_map((count + 1) * sizeof(ScanBlock));
+  scan->tmp = scan_map((count + 1) * sizeof(ScanBlock));
+  scan->marks = scan_map((count / 64 + 1) * sizeof(uint64_t));
+  for (int i = 0; i <= scan->worker_count; ++i)
+    scan->workers[i].stack = scan_map((count + 1) * sizeof(size_t));
+  for (int i = 0; i <= scan->worker_count; ++i)
+    if (!scan->workers[i].stack)
+      return NULL;
+  if (!scan->blocks || !scan->tmp || !scan->marks)
+    return NULL;
+  return scan->blocks;
+}
+
+int scan_run(ScanState* scan, size_t count, ScanResult* result)
+{
+  memset(result, 0, sizeof(ScanResult));
+  scan->count = count;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (scan_sort(scan) == -1)
+    return -1;
+  if (count > 0)
+  {
+    scan->lowest = scan->blocks[0].start;
+    scan->span = scan->blocks[count - 1].start + scan->blocks[count - 1].size - scan->lowest;
+  }
+  else
+  {
+    scan->lowest = 1;
+    scan->span = 0;
+  }
+  result->blocks = count;
+  result->index_ms = scan_elapsed_ms(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  scan_stop_world(scan);
+  int stopped = __atomic_load_n(&scan_acks, __ATOMIC_ACQUIRE);
+  if (stopped > SCAN_THREADS_MAX)
+    stopped = SCAN_THREADS_MAX;
+  result->threads = stopped;
+  result->unstopped = scan->signalled_count > (size_t)stopped ? scan->signalled_count - stopped : 0;
+  int ret = scan_read_maps(scan);
+  if (ret == 0)
+  {
+    scan_collect_roots(scan, stopped);
+    for (size_t i = 0; i < scan->root_count; ++i)
+      result->root_bytes += scan->roots[i].end - scan->roots[i].start;
+    scan_release_workers(scan, scan_go);
+    scan_work(&scan->workers[0]);
+    scan_wait_for(&scan->done, scan->worker_count);
+  }
+  else
+    scan_release_workers(scan, scan_abort);
+  scan_resume_world();
+  result->pause_ms = scan_elapsed_ms(&start);
+  result->workers = scan->worker_count + 1;
+  if (ret == -1)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+  for (size_t i = 0; i < count; ++i)
+    if (!scan_reachable(scan, i))
+      ++result->unreachable;
+  return 0;
+}
+
+ScanBlock const* scan_block(ScanState const* scan, size_t i)
+{
+  return &scan->blocks[i];
+}
+
+int scan_reachable(ScanState const* scan, size_t i)
+{
+  return (scan->marks[i / 64] >> (i % 64)) & 1;
+}
+
+void scan_finish(ScanState* scan)
+{
+  if (scan->go == scan_wait)
+    scan_release_workers(scan, scan_abort);     // scan_run wasn't called, or failed early.
+  for (int i = 1; i <= scan->worker_count; ++i)
+    pthread_join(scan->workers[i].thread, NULL);
+  for (int i = 0; i <= scan->worker_count; ++i)
+    scan_unmap(scan->workers[i].stack, (scan->capacity + 1) * sizeof(size_t));
+  scan_unmap(scan->blocks, (scan->capacity + 1) * sizeof(ScanBlock));
+  scan_unmap(scan->tmp, (scan->capacity + 1) * sizeof(ScanBlock));
+  scan_unmap(scan->marks, (scan->capacity / 64 + 1) * sizeof(uint64_t));
+  scan_unmap(scan->segments, SCAN_RANGES_MAX * sizeof(struct Range));
+  scan_unmap(scan->maps, SCAN_RANGES_MAX * sizeof(struct Range));
+  scan_unmap(scan->roots, SCAN_RANGES_MAX * sizeof(struct Range));
+  scan_unmap(scan->chunks, SCAN_RANGES_MAX * sizeof(struct Range));
+  scan_unmap(scan->signalled, SCAN_THREADS_MAX * sizeof(pid_t));
+  scan_unmap(scan, sizeof(ScanState));
+}
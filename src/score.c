@@ -0,0 +1,146 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file score.c The scorers that rank the backtraces by leak probability.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <string.h>
+#include <math.h>
+
+#include "score.h"
+#include "BacktraceEntry.h"
+
+// The number of standard errors of the 95% confidence bound.
+#define TREND_Z 1.96
+
+// Limit the significance of a perfect fit.
+#define TREND_SIGNIFICANCE_MAX 1000.0
+
+static double score_value_n(BacktraceEntry const* entry)
+{
+  // Computed by interval_update_value_n.
+  return entry->value_n;
+}
+
+// Rank backtraces by how fast they leak at least, so that noisy backtraces with a lot
+// of churn end up below backtraces that leak slowly but steadily.
+static double score_trend(BacktraceEntry const* entry)
+{
+  TrendResult result;
+  trend_result(&entry->trend, &result);
+  double lower_bound = result.bytes_rate - result.bytes_error;
+  return lower_bound > 0 ? lower_bound : 0;
+}
+
+static struct {
+  char const* name;
+  double (*score)(BacktraceEntry const* entry);
+} const scorers[] = {
+  { "value_n", score_value_n },
+  { "trend", score_trend }
+};
+
+int score_parse(char const* name)
+{
+  for (int scorer = 0; scorer < (int)(sizeof(scorers) / sizeof(scorers[0])); ++scorer)
+    if (strcmp(name, scorers[scorer].name) == 0)
+      return scorer;
+  return -1;
+}
+
+char const* score_name(int scorer)
+{
+  return scorers[scorer].name;
+}
+
+double score(int scorer, BacktraceEntry const* entry)
+{
+  return scorers[scorer].score(entry);
+}
+
+void trend_sample(Trend* trend, time_t now, double half_life, size_t n, size_t bytes)
+{
+  double dt = now - trend->last;
+  if (trend->w > 0 && dt > 0)
+  {
+    // Move the origin of time to NOW (t becomes t - dt).
+    trend->tt -= dt * (2 * trend->t - dt * trend->w);
+    trend->t -= dt * trend->w;
+    trend->tn -= dt * trend->n;
+    trend->tb -= dt * trend->b;
+    // Weigh down the old samples.
+    double decay = exp2(-dt / half_life);
+    trend->w *= decay;
+    trend->w2 *= decay * decay;
+    trend->t *= decay;
+    trend->tt *= decay;
+    trend->n *= decay;
+    trend->tn *= decay;
+    trend->nn *= decay;
+    trend->b *= decay;
+    trend->tb *= decay;
+    trend->bb *= decay;
+  }
+  trend->last = now;
+  // Add the new sample, at t = 0 with weight 1.
+  trend->w += 1;
+  trend->w2 += 1;
+  trend->n += n;
+  trend->nn += (double)n * n;
+  trend->b += bytes;
+  trend->bb += (double)bytes * bytes;
+}
+
+// Return the slope of the regression of y against t and put the standard error of it in *ERROR.
+static double trend_slope(Trend const* trend, double mean_t, double var_t, double n_eff, double y, double ty, double yy, double* error)
+{
+  double mean_y = y / trend->w;
+  double cov = ty / trend->w - mean_t * mean_y;
+  double var_y = yy / trend->w - mean_y * mean_y;
+  double slope = cov / var_t;
+  double residual = var_y - slope * cov;
+  *error = residual > 0 ? sqrt(residual / (var_t * (n_eff - 2))) : 0;
+  return slope;
+}
+
+void trend_result(Trend const* trend, TrendResult* result)
+{
+  memset(result, 0, sizeof(TrendResult));
+  if (trend->w <= 0)
+    return;
+  double mean_t = trend->t / trend->w;
+  double var_t = trend->tt / trend->w - mean_t * mean_t;
+  // The effective number of samples.
+  double n_eff = trend->w * trend->w / trend->w2;
+  if (var_t <= 0 || n_eff <= 2)
+    return;
+  double error;
+  result->rate = trend_slope(trend, mean_t, var_t, n_eff, trend->n, trend->tn, trend->nn, &error);
+  result->bytes_rate = trend_slope(trend, mean_t, var_t, n_eff, trend->b, trend->tb, trend->bb, &error);
+  result->bytes_error = TREND_Z * error;
+  if (error > 0)
+    result->significance = result->bytes_rate / error;
+  else
+    result->significance = result->bytes_rate > 0 ? TREND_SIGNIFICANCE_MAX : 0;
+  if (result->significance > TREND_SIGNIFICANCE_MAX)
+    result->significance = TREND_SIGNIFICANCE_MAX;
+  else if (result->significance < -TREND_SIGNIFICANCE_MAX)
+    result->significance = -TREND_SIGNIFICANCE_MAX;
+}
@@ -0,0 +1,101 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file shared_stats.c Publish the stats in a shared memory segment.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "SharedStats.h"
+
+static SharedStats* shared;                     // The mapped segment, or NULL.
+static char shared_name[256];
+
+void shared_stats_init(char const* exename, int64_t application_start)
+{
+  char const* name = getenv("LIBMEMLEAK_SHM");
+  if (name)
+    strncpy(shared_name, name, sizeof(shared_name) - 1);
+  else
+    snprintf(shared_name, sizeof(shared_name), "/libmemleak.%d", getpid());
+  if (!shared_name[0])
+    return;
+  // Only the user that runs the application may read its stats.
+  int fd = shm_open(shared_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    fprintf(stderr, "libmemleak: shm_open: %s: %s\n", shared_name, strerror(errno));
+    shared_name[0] = 0;
+    return;
+  }
+  // A segment that already existed keeps its mode.
+  fchmod(fd, 0600);
+  void* ptr = MAP_FAILED;
+  if (ftruncate(fd, sizeof(SharedStats)) == 0)
+    ptr = mmap(NULL, sizeof(SharedStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED)
+  {
+    fprintf(stderr, "libmemleak: %s: %s\n", shared_name, strerror(errno));
+    shm_unlink(shared_name);
+    shared_name[0] = 0;
+    return;
+  }
+  shared = ptr;
+  shared->version = SHARED_STATS_VERSION;
+  shared->size = sizeof(SharedStats);
+  shared->pid = getpid();
+  shared->application_start = application_start;
+  strncpy(shared->application, exename, sizeof(shared->application) - 1);
+  // Readers check the magic number first.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(shared->magic, SHARED_STATS_MAGIC, sizeof(shared->magic));
+}
+
+SharedStats* shared_stats_begin()
+{
+  if (!shared)
+    return NULL;
+  __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return shared;
+}
+
+void shared_stats_end()
+{
+  ++shared->updates;
+  __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void shared_stats_close()
+{
+  if (shared_name[0])
+    shm_unlink(shared_name);
+  shared_name[0] = 0;
+}
@@ -0,0 +1,166 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file sketch.c A count-min sketch with a space-saving heavy hitters table.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sketch.h"
+
+// Row R of the sketch uses its own multiplier, so that call sites that collide in one row don't collide in the others.
+static uint64_t const row_multipliers[sketch_depth] = {
+  0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL, 0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL
+};
+
+static inline unsigned int sketch_column(uint64_t hash, int row)
+{
+  return (hash * row_multipliers[row]) >> (64 - __builtin_ctz(sketch_width));
+}
+
+// Return the index of HASH in the heavy hitters table, or -1.
+static inline int heavy_find(Sketch const* sketch, uint64_t hash)
+{
+  // No early exit, so that this loop is vectorized.
+  int index = -1;
+  for (int i = 0; i < sketch->heavy_count; ++i)
+    index = sketch->heavy_hash[i] == hash ? i : index;
+  return index;
+}
+
+static int64_t estimate(int64_t const (*counters)[sketch_width], uint64_t hash)
+{
+  int64_t result = counters[0][sketch_column(hash, 0)];
+  for (int row = 1; row < sketch_depth; ++row)
+  {
+    int64_t value = counters[row][sketch_column(hash, row)];
+    if (value < result)
+      result = value;
+  }
+  return result;
+}
+
+static void set_frames(Sketch* sketch, int index, void* const* frames, int frame_count)
+{
+  if (frame_count > sketch_frames_max)
+    frame_count = sketch_frames_max;
+  memcpy(sketch->heavy_frames[index], frames, frame_count * sizeof(void*));
+  sketch->heavy_frame_count[index] = frame_count;
+}
+
+int sketch_alloc(Sketch* sketch, uint64_t hash, void* const* frames, int frame_count, size_t size)
+{
+  int index = heavy_find(sketch, hash);
+  if (index >= 0 && sketch->heavy_materialized[index])
+    return 1;
+  for (int row = 0; row < sketch_depth; ++row)
+  {
+    unsigned int column = sketch_column(hash, row);
+    ++sketch->counts[row][column];
+    sketch->bytes[row][column] += size;
+  }
+  ++sketch->surviving;
+  sketch->surviving_bytes += size;
+  ++sketch->allocations;
+  if (index >= 0)
+    ++sketch->heavy_allocations[index];
+  else if (sketch->heavy_count < sketch_heavy_max)
+  {
+    index = sketch->heavy_count++;
+    sketch->heavy_hash[index] = hash;
+    sketch->heavy_allocations[index] = 1;
+    sketch->heavy_error[index] = 0;
+    sketch->heavy_materialized[index] = 0;
+    set_frames(sketch, index, frames, frame_count);
+  }
+  else
+  {
+    // Space-saving: replace the call site with the fewest allocations and inherit its count.
+    // Materialized call sites are only replaced when there is nothing else.
+    index = 0;
+    for (int i = 1; i < sketch_heavy_max; ++i)
+      if (sketch->heavy_materialized[i] < sketch->heavy_materialized[index] ||
+          (sketch->heavy_materialized[i] == sketch->heavy_materialized[index] &&
+           sketch->heavy_allocations[i] < sketch->heavy_allocations[index]))
+        index = i;
+    sketch->heavy_hash[index] = hash;
+    sketch->heavy_error[index] = sketch->heavy_allocations[index];
+    ++sketch->heavy_allocations[index];
+    sketch->heavy_materialized[index] = 0;
+    set_frames(sketch, index, frames, frame_count);
+  }
+  if ((uint64_t)estimate(sketch->counts, hash) >= sketch->threshold)
+    sketch->heavy_materialized[index] = 1;
+  return 0;
+}
+
+void sketch_free(Sketch* sketch, uint64_t hash, size_t size)
+{
+  for (int row = 0; row < sketch_depth; ++row)
+  {
+    unsigned int column = sketch_column(hash, row);
+    --sketch->counts[row][column];
+    sketch->bytes[row][column] -= size;
+  }
+  --sketch->surviving;
+  sketch->surviving_bytes -= size;
+}
+
+static int compare_rows(void const* p1, void const* p2)
+{
+  SketchRow const* r1 = p1;
+  SketchRow const* r2 = p2;
+  return r1->surviving_bytes < r2->surviving_bytes ? 1 : r1->surviving_bytes > r2->surviving_bytes ? -1 : 0;
+}
+
+int sketch_top(Sketch const* sketch, SketchRow* rows)
+{
+  for (int i = 0; i < sketch->heavy_count; ++i)
+  {
+    SketchRow* row = &rows[i];
+    row->hash = sketch->heavy_hash[i];
+    row->surviving = estimate(sketch->counts, row->hash);
+    row->surviving_bytes = estimate(sketch->bytes, row->hash);
+    row->allocations = sketch->heavy_allocations[i];
+    row->allocations_error = sketch->heavy_error[i];
+    row->materialized = sketch->heavy_materialized[i];
+    row->frame_count = sketch->heavy_frame_count[i];
+    memcpy(row->frames, sketch->heavy_frames[i], sizeof(row->frames));
+  }
+  return sketch->heavy_count;
+}
+
+void sketch_sort(SketchRow* rows, int count)
+{
+  qsort(rows, count, sizeof(SketchRow), compare_rows);
+}
+
+uint64_t sketch_error(Sketch const* sketch, int bytes)
+{
+  // With width w every estimate is at most e/w times the total too large (with probability 1 - e^-depth).
+  uint64_t total = bytes ? sketch->surviving_bytes : sketch->surviving;
+  return (uint64_t)(2.718281828 * total / sketch_width);
+}
+
+void sketch_reset(Sketch* sketch)
+{
+  sketch->heavy_count = 0;
+}
@@ -0,0 +1,219 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file suppress.c Compile suppression rules into a set of address ranges.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "suppress.h"
+#include "addr2line.h"
+
+extern void* (*memleak_libc_malloc)(size_t size);
+extern void (*memleak_libc_free)(void* ptr);
+
+struct SuppressRule {
+  int kind;                                     // A SuppressKind.
+  char const* pattern;                          // Points into text.
+  int ranges;                                   // The number of ranges matched by the last compilation.
+  char text[136];                               // The rule as given.
+};
+
+// Only used by the monitor thread.
+static struct SuppressRule rules[suppress_rules_max];
+static int rule_count;
+
+static char const* kind_names[] = { "module", "function", "file" };
+
+int suppress_add(char const* rule)
+{
+  if (rule_count == suppress_rules_max || strlen(rule) >= sizeof(rules[0].text))
+    return -1;
+  for (int kind = 0; kind < (int)(sizeof(kind_names) / sizeof(kind_names[0])); ++kind)
+  {
+    size_t len = strlen(kind_names[kind]);
+    if (strncmp(rule, kind_names[kind], len) != 0 || rule[len] != ' ')
+      continue;
+    char const* pattern = rule + len;
+    while (*pattern == ' ')
+      ++pattern;
+    if (!*pattern)
+      return -1;
+    struct SuppressRule* r = &rules[rule_count++];
+    r->kind = kind;
+    strcpy(r->text, rule);
+    r->pattern = r->text + (pattern - rule);
+    r->ranges = 0;
+    return 0;
+  }
+  return -1;
+}
+
+void suppress_clear()
+{
+  rule_count = 0;
+}
+
+int suppress_rule_count()
+{
+  return rule_count;
+}
+
+char const* suppress_rule(int index, int* ranges)
+{
+  *ranges = rules[index].ranges;
+  return rules[index].text;
+}
+
+// Match PATH against PATTERN; only the last component of PATH when PATTERN has no slash.
+static int path_match(char const* pattern, char const* path)
+{
+  if (!strchr(pattern, '/'))
+  {
+    char const* slash = strrchr(path, '/');
+    if (slash)
+      path = slash + 1;
+  }
+  return fnmatch(pattern, path, 0) == 0;
+}
+
+// The address ranges collected so far.
+struct RangeList {
+  uintptr_t (*ranges)[2];
+  int count;
+  int capacity;
+};
+
+static void range_add(struct RangeList* list, void const* begin, void const* end)
+{
+  if (list->count == list->capacity)
+  {
+    int capacity = list->capacity ? 2 * list->capacity : 256;
+    uintptr_t (*ranges)[2] = (*memleak_libc_malloc)(capacity * sizeof(ranges[0]));
+    if (!ranges)
+      return;
+    if (list->count)
+      memcpy(ranges, list->ranges, list->count * sizeof(ranges[0]));
+    (*memleak_libc_free)(list->ranges);
+    list->ranges = ranges;
+    list->capacity = capacity;
+  }
+  list->ranges[list->count][0] = (uintptr_t)begin;
+  list->ranges[list->count][1] = (uintptr_t)end;
+  ++list->count;
+}
+
+static void function_match(void* data, void const* begin, void const* end, char const* name, char const* demangled, char const* file)
+{
+  for (int i = 0; i < rule_count; ++i)
+  {
+    struct SuppressRule* rule = &rules[i];
+    int match;
+    if (rule->kind == suppress_function)
+      match = fnmatch(rule->pattern, name, 0) == 0 || (demangled && fnmatch(rule->pattern, demangled, 0) == 0);
+    else if (rule->kind == suppress_file)
+      match = file && path_match(rule->pattern, file);
+    else
+      continue;
+    if (match)
+    {
+      range_add((struct RangeList*)data, begin, end);
+      ++rule->ranges;
+      return;
+    }
+  }
+}
+
+static int range_compare(void const* r1, void const* r2)
+{
+  uintptr_t b1 = (*(uintptr_t const(*)[2])r1)[0];
+  uintptr_t b2 = (*(uintptr_t const(*)[2])r2)[0];
+  return b1 < b2 ? -1 : b1 > b2;
+}
+
+SuppressSet* suppress_compile()
+{
+  if (rule_count == 0)
+    return NULL;
+  int need_functions = 0;
+  int need_files = 0;
+  for (int i = 0; i < rule_count; ++i)
+  {
+    rules[i].ranges = 0;
+    need_functions |= rules[i].kind != suppress_module;
+    need_files |= rules[i].kind == suppress_file;
+  }
+  struct RangeList list = { NULL, 0, 0 };
+  for (int m = 0; m < addr2line_module_count(); ++m)
+  {
+    Module const* module = addr2line_module(m);
+    int whole = 0;
+    for (int i = 0; i < rule_count; ++i)
+      if (rules[i].kind == suppress_module && path_match(rules[i].pattern, module->path))
+      {
+        range_add(&list, module->begin, module->end);
+        ++rules[i].ranges;
+        whole = 1;
+        break;
+      }
+    if (!whole && need_functions)
+      addr2line_functions(module, need_files, function_match, &list);
+  }
+  // Sort the ranges and merge the ones that overlap or touch.
+  qsort(list.ranges, list.count, sizeof(list.ranges[0]), range_compare);
+  int count = 0;
+  for (int i = 0; i < list.count; ++i)
+  {
+    if (count > 0 && list.ranges[i][0] <= list.ranges[count - 1][1])
+    {
+      if (list.ranges[i][1] > list.ranges[count - 1][1])
+        list.ranges[count - 1][1] = list.ranges[i][1];
+    }
+    else
+    {
+      list.ranges[count][0] = list.ranges[i][0];
+      list.ranges[count][1] = list.ranges[i][1];
+      ++count;
+    }
+  }
+  SuppressSet* set = (*memleak_libc_malloc)(sizeof(SuppressSet) + 2 * count * sizeof(uintptr_t));
+  if (set)
+  {
+    set->count = count;
+    set->begin = (uintptr_t*)(set + 1);
+    set->size = set->begin + count;
+    for (int i = 0; i < count; ++i)
+    {
+      set->begin[i] = list.ranges[i][0];
+      set->size[i] = list.ranges[i][1] - list.ranges[i][0];
+    }
+  }
+  (*memleak_libc_free)(list.ranges);
+  return set;
+}
+
+void suppress_free(SuppressSet* set)
+{
+  (*memleak_libc_free)(set);
+}
@@ -0,0 +1,269 @@
+// libmemleak -- Detect leaking memory by allocation backtrace
+//
+//! @file trace.c Record all allocations and deallocations to a binary trace.
+//
+// Copyright (C) 2010 - 2016, by
+// 
+// Carlo Wood, Run on IRC <carlo@alinoe.com>
+// RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+// Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "Trace.h"
+#include "BacktraceDB.h"
+
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+// The size of a segment. Every thread that allocates memory owns one.
+#define TRACE_SEGMENT_SIZE (1024 * 1024)
+
+int trace_enabled;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char trace_prefix[240];
+static char trace_application[256];
+static int64_t trace_application_start;
+static uint64_t trace_size_max;                 // Start a new file when the current one would grow beyond this size.
+static int trace_fd = -1;                       // The current file.
+static uint32_t trace_sequence;                 // The sequence number of the next file.
+static uint64_t trace_file_size;                // The size of the current file.
+static uint32_t trace_segment_offset;           // The file offset of the first segment.
+static uint32_t trace_files_max;                // Remove the oldest file when there would be more than this many.
+static long trace_pagesize;
+static pthread_key_t trace_key;                 // Only used for its destructor, which runs when a thread that owns a segment exits.
+
+// Per thread state.
+struct TraceThread {
+  TraceSegmentHeader* segment;                  // The current segment of this thread, or NULL.
+  unsigned char* pos;                           // Where the next record will be written.
+  unsigned char* end;                           // No record may start beyond this point.
+  uint64_t last_time;                           // The time of the previous record.
+  uintptr_t last_address;                       // The address of the previous record.
+  uint32_t thread;                              // The kernel thread ID.
+};
+
+static __thread struct TraceThread trace_thread;
+
+uint64_t trace_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called when a thread that owns a segment exits. Unmap the segment and give
+// its unused tail back to the file system; it stays a hole in the file.
+static void trace_thread_exit(void* arg)
+{
+  struct TraceThread* t = arg;
+  if (!t->segment)
+    return;
+  size_t used = sizeof(TraceSegmentHeader) + __atomic_load_n(&t->segment->used, __ATOMIC_RELAXED);
+  used = (used + trace_pagesize - 1) / trace_pagesize * trace_pagesize;
+  if (used < TRACE_SEGMENT_SIZE)
+    madvise((char*)t->segment + used, TRACE_SEGMENT_SIZE - used, MADV_REMOVE);
+  munmap(t->segment, TRACE_SEGMENT_SIZE);
+  t->segment = NULL;
+  t->pos = t->end = NULL;
+}
+
+void trace_init(char const* exename, int64_t application_start)
+{
+  strncpy(trace_application, exename, sizeof(trace_application) - 1);
+  trace_application_start = application_start;
+  trace_pagesize = sysconf(_SC_PAGESIZE);
+  trace_segment_offset = ((sizeof(TraceFileHeader) - 1) / trace_pagesize + 1) * trace_pagesize;
+  trace_size_max = 1024;
+  char const* size_str = getenv("LIBMEMLEAK_TRACE_SIZE");
+  if (size_str && atoi(size_str) > 0)
+    trace_size_max = atoi(size_str);
+  trace_size_max <<= 20;
+  if (trace_size_max < trace_segment_offset + TRACE_SEGMENT_SIZE)
+    trace_size_max = trace_segment_offset + TRACE_SEGMENT_SIZE;
+  trace_files_max = 8;
+  char const* files_str = getenv("LIBMEMLEAK_TRACE_FILES");
+  if (files_str && atoi(files_str) > 0)
+    trace_files_max = atoi(files_str);
+  pthread_key_create(&trace_key, trace_thread_exit);
+  char const* prefix = getenv("LIBMEMLEAK_TRACE");
+  if (prefix && *prefix)
+    trace_enable(1);
+}
+
+char const* trace_enable(int on)
+{
+  pthread_mutex_lock(&trace_mutex);
+  if (on && !trace_prefix[0])
+  {
+    char const* prefix = getenv("LIBMEMLEAK_TRACE");
+    strncpy(trace_prefix, prefix && *prefix ? prefix : "memleak_trace", sizeof(trace_prefix) - 1);
+  }
+  trace_enabled = on;
+  pthread_mutex_unlock(&trace_mutex);
+  return trace_prefix;
+}
+
+// Start a new file. Called with trace_mutex locked.
+static void trace_open_file()
+{
+  if (trace_fd >= 0)
+    close(trace_fd);    // Threads that still use a segment of this file keep their mapping.
+  char path[256];
+  // Rotate: remove the oldest file. Threads that still use a segment of it keep their mapping.
+  if (trace_sequence >= trace_files_max)
+  {
+    snprintf(path, sizeof(path), "%s.%u", trace_prefix, trace_sequence - trace_files_max);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s.%u", trace_prefix, trace_sequence);
+  trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0)
+  {
+    fprintf(stderr, "libmemleak: %s: %s\n", path, strerror(errno));
+    trace_enabled = 0;
+    return;
+  }
+  TraceFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.header_size = sizeof(TraceFileHeader);
+  header.segment_offset = trace_segment_offset;
+  header.segment_size = TRACE_SEGMENT_SIZE;
+  header.sequence = trace_sequence;
+  header.pid = getpid();
+  header.application_start = trace_application_start;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  header.monotonic_base = trace_now();
+  header.realtime_base = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  memcpy(header.application, trace_application, sizeof(header.application));
+  strncpy(header.backtraces, backtrace_db_path(), sizeof(header.backtraces) - 1);
+  if (pwrite(trace_fd, &header, sizeof(header), 0) != sizeof(header))
+  {
+    close(trace_fd);
+    trace_fd = -1;
+    trace_enabled = 0;
+    return;
+  }
+  trace_file_size = trace_segment_offset;
+  ++trace_sequence;
+}
+
+// Give the calling thread a new segment. Returns 0 if that failed.
+static int trace_new_segment(struct TraceThread* t, uint64_t now)
+{
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_fd < 0 || trace_file_size + TRACE_SEGMENT_SIZE > trace_size_max)
+    trace_open_file();
+  void* segment = MAP_FAILED;
+  if (trace_fd >= 0 && ftruncate(trace_fd, trace_file_size + TRACE_SEGMENT_SIZE) == 0)
+    segment = mmap(NULL, TRACE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, trace_file_size);
+  if (segment != MAP_FAILED)
+    trace_file_size += TRACE_SEGMENT_SIZE;
+  pthread_mutex_unlock(&trace_mutex);
+
+  // The old segment is complete.
+  if (t->segment)
+    munmap(t->segment, TRACE_SEGMENT_SIZE);
+  t->segment = NULL;
+  t->pos = t->end = NULL;
+  if (segment == MAP_FAILED)
+    return 0;
+
+  if (!t->thread)
+    t->thread = syscall(SYS_gettid);
+  t->segment = segment;
+  t->segment->magic = TRACE_SEGMENT_MAGIC;
+  t->segment->thread = t->thread;
+  t->segment->base_time = now;
+  t->segment->used = 0;
+  t->pos = (unsigned char*)(t->segment + 1);
+  t->end = (unsigned char*)t->segment + TRACE_SEGMENT_SIZE - TRACE_RECORD_MAX;
+  t->last_time = now;
+  t->last_address = 0;
+  // Have trace_thread_exit called when this thread exits.
+  pthread_setspecific(trace_key, t);
+  return 1;
+}
+
+static inline unsigned char* trace_write_varint(unsigned char* p, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    *p++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+  return p;
+}
+
+static inline uint64_t trace_zigzag(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+// Write the common part of a record and return where the rest goes, or NULL.
+static inline unsigned char* trace_record_begin(struct TraceThread* t, int tag, void const* ptr, uint64_t now)
+{
+  if (UNLIKELY(t->pos >= t->end) && !trace_new_segment(t, now))
+    return NULL;
+  unsigned char* p = t->pos;
+  *p++ = tag;
+  p = trace_write_varint(p, now - t->last_time);
+  p = trace_write_varint(p, trace_zigzag((intptr_t)ptr - (intptr_t)t->last_address));
+  t->last_time = now;
+  t->last_address = (uintptr_t)ptr;
+  return p;
+}
+
+// Commit the record that ends at P.
+static inline void trace_record_end(struct TraceThread* t, unsigned char* p)
+{
+  t->pos = p;
+  // Readers use 'used' to find the end of the records, so only update it once the record is complete.
+  __atomic_store_n(&t->segment->used, p - (unsigned char*)(t->segment + 1), __ATOMIC_RELEASE);
+}
+
+void trace_record_alloc(void const* ptr, size_t size, uint32_t backtrace_nr, uint64_t now)
+{
+  struct TraceThread* t = &trace_thread;
+  unsigned char* p = trace_record_begin(t, trace_alloc, ptr, now);
+  if (!p)
+    return;
+  p = trace_write_varint(p, size);
+  p = trace_write_varint(p, backtrace_nr);
+  trace_record_end(t, p);
+}
+
+void trace_record_free(void const* ptr, uint64_t now)
+{
+  struct TraceThread* t = &trace_thread;
+  unsigned char* p = trace_record_begin(t, trace_free, ptr, now);
+  if (p)
+    trace_record_end(t, p);
+}